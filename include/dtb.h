@@ -11,6 +11,8 @@
 #define FDT_NOP        0x00000004
 #define FDT_END        0x00000009
 
+#define DTB_MAX_DEPTH 16
+
 /**
  * Flat device tree structure:
  * https://devicetree-specification.readthedocs.io/en/v0.1/flattened-format.html
@@ -37,5 +39,6 @@ typedef struct _Fdt_rsv_entry
 
 void parse_dtb(int(*callback)(char*, char*, char*, int));
 void dtb_init(void *_dtb_base);
+void dtb_scan_memory();
 
 #endif /* _DTB_H_ */
\ No newline at end of file
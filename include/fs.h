@@ -57,6 +57,7 @@ struct vnode {
     struct list_head list;
     uint8_t type;
     uint8_t cache_attr;
+    uint32_t refcnt; /* Number of opened files */
     uint64_t size;
 
     union {
@@ -85,6 +86,7 @@ struct fdt_struct {
     struct file *files[FDT_SIZE];
 };
 
+void vfs_cache_init();
 struct file *new_file(struct vnode *vnode, int flags);
 int register_filesystem(const struct filesystem *fs);
 
@@ -23,9 +23,26 @@
 #define disable_timer() do { \
     *(uint32_t *)CORE0_TIMER_IRQ_CTRL = 0; } while (0)
 
+#define DAIF_IRQ_BIT (1 << 7)
 #define disable_intr() do { __asm__("msr DAIFSet, 0xf"); } while (0)
 #define enable_intr() do { __asm__("msr DAIFClr, 0xf"); } while (0)
 
+/* Mask interrupts and restore them to the saved state, can be nested */
+#define local_irq_save(flags) do { \
+    __asm__ volatile("mrs %0, daif" : "=r"(flags)); \
+    __asm__ volatile("msr DAIFSet, 0xf"); } while (0)
+
+#define local_irq_restore(flags) do { \
+    __asm__ volatile("msr daif, %0" :: "r"(flags)); } while (0)
+
+static inline uint32_t smp_processor_id()
+{
+    uint64_t mpidr;
+    __asm__ volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+    return mpidr & 0xff;
+}
+
 void irq_handler();
+void timer_cache_init();
 
 #endif /* _IRQ_H_ */
\ No newline at end of file
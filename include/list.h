@@ -60,4 +60,15 @@ static inline void list_del(struct list_head *entry)
     entry->next = LIST_POISON2;
 }
 
+static inline int list_empty(const struct list_head *head)
+{
+    return head->next == head;
+}
+
+static inline void list_move(struct list_head *entry, struct list_head *head)
+{
+    __list_del(entry->prev, entry->next);
+    list_add(entry, head);
+}
+
 #endif /* _LIST_H_ */
\ No newline at end of file
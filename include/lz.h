@@ -0,0 +1,19 @@
+#ifndef _LIB_LZ_H_
+#define _LIB_LZ_H_
+
+#include <types.h>
+
+/**
+ * LZ77 codec in the LZ4 sequence layout: a token of literal / match length
+ * nibbles, literals, then a 2 bytes offset. Input is at most 64KB.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_DICT_SIZE (sizeof(uint16_t) << LZ_HASH_BITS)
+
+/* Compressed size, 0 if it does not fit in cap. dict is LZ_DICT_SIZE bytes of scratch */
+uint32_t lz_compress(const void *src, uint32_t len, void *dst, uint32_t cap, uint16_t *dict);
+/* Decompressed size, -1 on corrupted input or overflow of cap */
+int32_t lz_decompress(const void *src, uint32_t len, void *dst, uint32_t cap);
+
+#endif /* _LIB_LZ_H_ */
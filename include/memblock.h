@@ -0,0 +1,35 @@
+#ifndef _MEMBLOCK_H_
+#define _MEMBLOCK_H_
+
+#include <types.h>
+#include <util.h>
+
+/* Regions are sorted by base and never overlap or touch each other */
+#define MEMBLOCK_MAX_REGIONS 32
+
+typedef struct _MemblockRegion {
+    uint64_t base;
+    uint64_t size;
+} MemblockRegion;
+
+typedef struct _MemblockType {
+    const char *name;
+    uint32_t cnt;
+    MemblockRegion regions[MEMBLOCK_MAX_REGIONS];
+} MemblockType;
+
+extern MemblockType memblock_memory, memblock_reserved;
+
+/* Physical addresses, used before page_init() sets up mem_map */
+void memblock_add(uint64_t base, uint64_t size);
+void memblock_reserve(uint64_t base, uint64_t size);
+void *memblock_alloc(uint64_t size, uint64_t align);
+void *memblock_alloc_raw(uint64_t size, uint64_t align);
+
+uint64_t memblock_start();
+uint64_t memblock_end();
+bool memblock_is_memory(uint64_t base, uint64_t size);
+bool memblock_is_free(uint64_t base, uint64_t size);
+void memblock_dump();
+
+#endif /* _MEMBLOCK_H_ */
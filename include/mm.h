@@ -3,6 +3,7 @@
 
 #include <types.h>
 #include <list.h>
+#include <util.h>
 
 #define PAGE_SIZE (4 * KB)
 #define PAGE_SHIFT 12
@@ -10,20 +11,20 @@
 #define MM_VIRT_KERN_START 0xFFFF000000000000
 #define PFN_BASE_OFFSET (phys_mem_start >> PAGE_SHIFT)
 
-#define phys_to_pfn(_phys_addr) ((((uint64_t) _phys_addr) >> PAGE_SHIFT) - PFN_BASE_OFFSET)
-#define pfn_to_phys(pfn) ( (pfn + PFN_BASE_OFFSET) << PAGE_SHIFT )
+#define phys_to_pfn(_phys_addr) ((((uint64_t)(_phys_addr)) >> PAGE_SHIFT) - PFN_BASE_OFFSET)
+#define pfn_to_phys(pfn) ( ((uint64_t)(pfn) + PFN_BASE_OFFSET) << PAGE_SHIFT )
 #define pfn_to_virt(pfn) ( pfn_to_phys(pfn) + MM_VIRT_KERN_START )
 
-#define page_to_pfn(_page) ( (((uint64_t) _page) - ((uint64_t) mem_map)) / sizeof(Page) )
-#define pfn_to_page(pfn) (mem_map + pfn)
+#define page_to_pfn(_page) ( (((uint64_t)(_page)) - ((uint64_t) mem_map)) / sizeof(Page) )
+#define pfn_to_page(pfn) (mem_map + (pfn))
 
 #define page_to_phys(_page)      pfn_to_phys( page_to_pfn(_page) )
 #define page_to_virt(_page)      pfn_to_virt( page_to_pfn(_page) )
 #define phys_to_page(_phys_addr) pfn_to_page( phys_to_pfn(_phys_addr) )
-#define virt_to_page(_virt_addr) pfn_to_page( phys_to_pfn(((uint64_t)_virt_addr) - MM_VIRT_KERN_START) )
+#define virt_to_page(_virt_addr) pfn_to_page( phys_to_pfn(((uint64_t)(_virt_addr)) - MM_VIRT_KERN_START) )
 
-#define virt_to_phys(_virt_addr) (((uint64_t)_virt_addr) - MM_VIRT_KERN_START)
-#define phys_to_virt(_phys_addr) (((uint64_t)_phys_addr) + MM_VIRT_KERN_START)
+#define virt_to_phys(_virt_addr) (((uint64_t)(_virt_addr)) - MM_VIRT_KERN_START)
+#define phys_to_virt(_phys_addr) (((uint64_t)(_phys_addr)) + MM_VIRT_KERN_START)
 
 #define align_page(phys) ( (phys + ((1 << PAGE_SHIFT) - 1)) & ~((1 << PAGE_SHIFT) - 1) )
 
@@ -31,12 +32,14 @@
 #define spin_table_end   0xFFFF000000003000
 #define kern_start       0xFFFF000000080000
 #define kern_end         0xFFFF000000100000
-#define su_rsvd_start    0xFFFF000000100000
-#define su_rsvd_end      0xFFFF000000200000
 
 #define PAGE_ROUNDUP(addr) (((addr) + 0xfff) & ~0xfff)
 
-extern uint64_t phys_mem_end;
+/* RAM below the VideoCore when the DTB has no /memory, peripherals start at the max */
+#define PHYS_MEM_DEFAULT_END 0x3B400000
+#define PHYS_MEM_MAX         0x3F000000
+
+extern uint64_t phys_mem_start, phys_mem_end;
 
 typedef struct _Page {
     /* Used to check the page status */
@@ -53,10 +56,41 @@ typedef struct _Page {
     #define PAGE_ORDER_UND  0b1110
 
     uint16_t refcnt : 8;
+
+    /* Page belongs to a slab cache, and its page offset from the cache head */
+    uint16_t slab : 1;
+    uint16_t slab_off : 14;
+
+    /* Page is in the CMA region, its free blocks are kept on cma_area */
+    uint16_t cma : 1;
+
+    /* Links of buddy free list in pfn */
+    union {
+        uint32_t next;
+        uint32_t rmap; /* Physical address of the first Rmap of an allocated page */
+    };
+    union {
+        uint32_t prev;
+        uint16_t site; /* Call site of an allocated page, see AllocSite */
+    };
+    #define PFN_NONE 0xffffffff
 } Page;
 
+/* One of the page table entries which map a page */
+typedef struct _Rmap {
+    uint64_t *pte;
+    uint64_t va;
+    struct _Rmap *next;
+} Rmap;
+
+/* mem_map is initialized a largest block at a time, only the first part at boot */
+#define SECTION_PAGES       (1 << PAGE_ORDER_MAX)
+#define DEFERRED_INIT_FIRST (64 * MB)
+
 typedef struct _FreeArea {
-    struct list_head list;
+    uint32_t head;
+    uint32_t nr_free;
+    uint64_t *map; /* Bit (pfn >> order) is set if the block is free */
 } FreeArea;
 
 static const uint32_t slab_size_pool[] = \
@@ -67,29 +101,190 @@ static const uint32_t slab_size_pool[] = \
 
 #define SLAB_POOL_SIZE (sizeof(slab_size_pool) / sizeof(slab_size_pool[0]))
 
+/* Index of slab_size_pool, must be kept in sync with it */
+#define kmalloc_index(sz) \
+    ((sz) <= 0x10   ? 0  : (sz) <= 0x20   ? 1  : (sz) <= 0x30   ? 2  : \
+     (sz) <= 0x60   ? 3  : (sz) <= 0x80   ? 4  : (sz) <= 0x100  ? 5  : \
+     (sz) <= 0x200  ? 6  : (sz) <= 0x400  ? 7  : (sz) <= 0x800  ? 8  : \
+     (sz) <= 0x1000 ? 9  : (sz) <= 0x2000 ? 10 : (sz) <= 0x3000 ? 11 : \
+     (sz) <= 0x4000 ? 12 : (sz) <= 0x6000 ? 13 : (sz) <= 0x8000 ? 14 : -1)
+
+#define SLAB_ORDER_MAX   6
+#define SLAB_MIN_OBJS    8
+#define SLAB_COLOUR_SIZE 64 /* Cache line size of cortex-a53 */
+
 typedef struct _Slab {
     struct list_head list;
 } Slab;
 
+/* Cortex-A53 cores of the board, per-cpu data is indexed by smp_processor_id() */
+#define NR_CPUS 4
+
+/* Per-cpu list of order-0 pages, linked by Page.next */
+#define PCP_HIGH  32
+#define PCP_BATCH 8
+
+typedef struct _PerCpuPages {
+    uint32_t head;
+    uint32_t count;
+} PerCpuPages;
+
+/* Per-cpu stack of free objects in front of a KmemCache */
+#define MAG_SIZE 16
+
+typedef struct _Magazine {
+    uint32_t count;
+    void *objs[MAG_SIZE];
+} Magazine;
+
+struct _KmemCache;
+
+/* Header of a slab, which is placed at the beginning of its pages */
 typedef struct _SlabCache {
     uint32_t size;
+    uint32_t inuse;
+    uint32_t total;
     uint64_t start;
     uint64_t end;
     Slab slab;
     struct list_head cache_list;
+    struct _KmemCache *kmem_cache;
+    uint16_t *sites; /* Call site of each object, right after the header */
 } SlabCache;
-extern SlabCache *slab_cache_ptr[SLAB_POOL_SIZE];
+
+/* Object cache, each one owns slabs on its partial / full / empty list */
+typedef struct _KmemCache {
+    const char *name;
+    uint32_t size;
+    uint32_t align;
+    void (*ctor)(void *);
+    uint32_t order;
+    uint32_t objs_per_slab;
+    uint32_t colour;
+    uint32_t colour_next;
+    struct list_head slabs_partial;
+    struct list_head slabs_full;
+    struct list_head slabs_empty;
+    uint32_t active_objs;
+    uint32_t total_objs;
+    /* Objects held by magazines are counted as active */
+    uint32_t mag_limit;
+    uint32_t mag_batch;
+    Magazine mag[NR_CPUS];
+    struct list_head list;
+} KmemCache;
+extern KmemCache kmalloc_caches[SLAB_POOL_SIZE];
+
+/**
+ * Bump allocator for objects living as long as their owner, all of them
+ * are freed at once by arena_release(). A zeroed Arena is empty.
+ */
+#define ARENA_ALIGN 16
+
+typedef struct _Arena {
+    void *chunk;   /* Newest chunk, its first word links the previous one */
+    uint32_t off;  /* Next free byte in chunk */
+    uint32_t size;
+    uint32_t nr_chunks;
+} Arena;
+
+/**
+ * Bytes held by each caller of buddy_alloc() / kmalloc(), keyed by the
+ * return address. Site 0 stands for untracked memory or a full table.
+ */
+#define ALLOC_SITE_MAX 256
+
+typedef struct _AllocSite {
+    uint64_t ip;
+    uint64_t live;
+    uint64_t peak;
+    uint32_t nr_allocs;
+    uint32_t nr_frees;
+} AllocSite;
+
+/* Watermarks on free pages, in the fraction of memory outside CMA */
+#define WMARK_LOW_SHIFT  6
+#define WMARK_HIGH_SHIFT 5
+#define WMARK_MIN_PAGES  0x40
+
+/* scan() tries to release nr_to_scan pages and returns how many it did */
+typedef struct _Shrinker {
+    const char *name;
+    uint64_t (*scan)(uint64_t nr_to_scan);
+    struct list_head list;
+} Shrinker;
+
+/* Pre-zeroed pages kept by idle() */
+#define ZERO_POOL_HIGH  64
+#define ZERO_POOL_BATCH 8
+
+/**
+ * Contiguous region at the top of memory, lent to movable user pages while
+ * nobody claims it. The size can be overridden by the "linux,cma" DTB node.
+ */
+#define CMA_SIZE_DEFAULT (16 * MB)
+#define CMA_MAX_SHIFT    2 /* At most 1/4 of memory */
+
+extern uint64_t nr_free_pages;
+extern uint64_t nr_free_cma;
+extern uint64_t wmark_low, wmark_high;
+extern uint64_t cma_size;
 
 void page_init();
 void buddy_init();
+bool deferred_init_section();
+void deferred_init();
 void slab_init();
 void register_mem_reserve(uint64_t start, uint64_t end);
 
 int32_t buddy_inc_refcnt(void *chk);
+uint32_t buddy_refcnt(void *chk);
 
 void* buddy_alloc(uint32_t req_pgcnt);
-void* kmalloc(uint32_t sz);
+void* __kmalloc(uint32_t sz);
 int32_t kfree(void *chk);
+uint32_t ksize(void *chk);
+void *krealloc(void *chk, uint32_t new_sz);
 int32_t buddy_free(void *chk);
 
+extern void *zero_page;
+#define is_zero_page(va) ((void *)(va) == zero_page)
+
+void zero_page_init();
+void *get_zeroed_page();
+void zero_pool_fill();
+
+void rmap_cache_init();
+void rmap_add(void *page, uint64_t *pte, uint64_t va);
+void rmap_del(void *page, uint64_t *pte);
+int32_t compact_memory(int32_t order);
+uint64_t shrink_anon(uint64_t nr_to_scan);
+
+void *alloc_movable_page(bool zero);
+void *alloc_huge_page(bool zero);
+void split_huge_page(void *chk);
+void *cma_alloc(uint32_t pgcnt, uint32_t align);
+void cma_release(void *chk, uint32_t pgcnt);
+
+void *arena_alloc(Arena *arena, uint32_t sz);
+void arena_release(Arena *arena);
+
+KmemCache *kmem_cache_create(const char *name, uint32_t size, uint32_t align,
+                             void (*ctor)(void *));
+void *kmem_cache_alloc(KmemCache *cachep);
+int32_t kmem_cache_free(KmemCache *cachep, void *obj);
+void kmem_cache_report();
+void alloc_site_report(uint32_t top_n);
+int32_t svc_memstat(uint32_t top_n);
+
+void register_shrinker(Shrinker *shrinker);
+uint64_t shrink_memory(uint64_t nr_pages);
+void kswapd();
+
+/* Size class of kmalloc(sizeof(T)) is resolved at compile time */
+#define kmalloc(sz)                                                     \
+    (__builtin_constant_p(sz) && kmalloc_index(sz) >= 0 ?               \
+        kmem_cache_alloc(&kmalloc_caches[MAX(kmalloc_index(sz), 0)]) :  \
+        __kmalloc(sz))
+
 #endif /* _MM_H_ */
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include <initramfs.h>
 #include <fs.h>
 #include <vm.h>
+#include <mm.h>
 
 #define THREAD_STACK_SIZE 0x4000
 #define USER_THREAD_BASE_ADDR 0xffffffffb000
@@ -88,6 +89,8 @@ typedef struct _TaskStruct {
     mm_struct *mm;
     struct fdt_struct *fdt;
     struct vnode *workdir;
+    Arena arena; /* mm, fdt, VMAs and signal handlers, freed at exit */
+    uint32_t nr_faults;
 } TaskStruct;
 
 typedef struct _TaskQueue {
@@ -107,14 +110,17 @@ int32_t svc_exec(const char *name, char *const argv[]);
 int32_t svc_fork();
 
 TaskStruct *get_current();
+void task_cache_init();
 void task_queue_init();
 void try_schedule();
 void schedule();
 void idle();
 void kill_zombies();
-void switch_to(TaskStruct *curr, TaskStruct *next, pgd_t next_pgd);
+void switch_to(TaskStruct *curr, TaskStruct *next, uint64_t ttbr);
 void main_thread_init();
 void thread_release(TaskStruct *curr, int16_t ec);
+void thread_sleep();
+void thread_wake(TaskStruct *target);
 void call_sigreturn();
 
 uint32_t create_kern_task(void(*prog)(), void *arg);
@@ -3,6 +3,7 @@
 
 #include <types.h>
 #include <list.h>
+#include <mm.h>
 
 typedef struct _Signal {
     int32_t signo;
@@ -16,7 +17,7 @@ typedef struct _SignalCtx {
 
 #include <sched.h>
 
-Signal *new_signal(int SIGNAL, void (*handler)());
+Signal *new_signal(Arena *arena, int SIGNAL, void (*handler)());
 SignalCtx *new_signal_ctx(void *tf);
 void ignore(int pid);
 void sigctx_update(void *trap_frame, void (*handler)());
@@ -24,7 +25,7 @@ void try_signal_handle(void *trap_frame);
 
 void svc_kill(int pid);
 void svc_sigreturn();
-void svc_signal(int SIGNAL, void (*handler)());
+int32_t svc_signal(int SIGNAL, void (*handler)());
 void svc_sigkill(int pid, int SIGNAL);
 
 extern void (*default_sighand[])(int);
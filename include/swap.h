@@ -0,0 +1,35 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+#include <types.h>
+#include <vm.h>
+
+/* Linux swap partition type in MBR, the partition is used as raw slots behind zram */
+#define SWAP_PART_TYPE   0x82
+#define SECTORS_PER_SLOT 8 /* PAGE_SIZE / BLOCK_SIZE */
+#define SWAP_MAX_SLOTS   0x10000
+
+/**
+ * Each entry referring to a slot is in a different task, and a task holds
+ * 16KB of kernel stack, so counts never reach 0x10000 within PHYS_MEM_MAX.
+ */
+typedef uint16_t swap_cnt_t;
+
+/**
+ * Entry of a swapped out page, bit 0 is clear so that the MMU faults on it.
+ * The slot takes the place of the output address.
+ */
+#define PTE_SWAP      (1 << 1)
+#define PTE_SWAP_ZRAM (1 << 2) /* Slot of zram instead of the partition */
+#define is_swap_pte(pte)   (((pte) & 0b11) == PTE_SWAP)
+#define is_zram_entry(pte) ((pte) & PTE_SWAP_ZRAM)
+#define swp_entry(slot)    (((uint64_t)(slot) << PTE_BIT) | PTE_SWAP)
+#define swp_slot(pte)      ((uint32_t)((pte) >> PTE_BIT))
+
+void swap_init();
+uint64_t swap_out(void *page, uint32_t cnt);
+void swap_in(uint64_t entry, void *page);
+void swap_dup(uint64_t entry);
+void swap_free(uint64_t entry);
+
+#endif /* _SWAP_H_ */
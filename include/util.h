@@ -85,7 +85,7 @@ int8_t log_2(uint64_t value);
 /* REGISTER OPERATION */
 #define read_sysreg(reg) ({          \
     uint64_t _val;                   \
-    __asm__ volatile("mrs x0, " #reg \
+    __asm__ volatile("mrs %0, " #reg \
                      : "=r"(_val));  \
                     _val; })
 #define read_normreg(reg) ({         \
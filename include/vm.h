@@ -4,12 +4,14 @@
 #include <types.h>
 #include <list.h>
 
+#define MAIR_IDX_DEVICE_nGnRnE  0
 #define MAIR_IDX_NORMAL_NOCACHE 1
+#define MAIR_IDX_NORMAL_WB      2
 #define PD_TABLE     0b11
 #define PD_BLOCK     0b01
 #define PD_TABLE_ENT 0b11
 
-#define LOWER_ATTR_MASK ((1 << 11) - 1)
+#define LOWER_ATTR_MASK ((1 << 12) - 1)
 #define UPPER_ATTR_MASK (0b111111111111L << 52)
 #define ATTR_MASK (LOWER_ATTR_MASK + UPPER_ATTR_MASK)
 
@@ -17,10 +19,17 @@
 #define PTE_AP_RDWR     (0b01 << 6)
 #define PTE_AP_RDONLY   (0b11 << 6)
 #define PTE_AP_NOACCESS (0b00 << 6)
+#define PTE_AP_MASK     (0b11 << 6)
 #define PTE_UXN (1L << 54)
 #define PTE_PXN (1L << 53)
+#define PTE_SH_INNER (0b11 << 8)
+#define PTE_NG (1 << 11) /* TLB entry is tagged by ASID, set on user pages */
 
-#define BASE_PTE_ATTR (AF_ACCESS | (MAIR_IDX_NORMAL_NOCACHE << 2) | PD_TABLE_ENT)
+#define BASE_PTE_ATTR (AF_ACCESS | PTE_SH_INNER | (MAIR_IDX_NORMAL_WB << 2) | PD_TABLE_ENT)
+#define BASE_PMD_ATTR (AF_ACCESS | PTE_SH_INNER | (MAIR_IDX_NORMAL_WB << 2) | PD_BLOCK)
+
+/* Pages mapped by a fault on file-backed memory, an aligned window around it */
+#define FAULT_AROUND_PAGES 16
 
 #define PGD_BIT 39
 #define PUD_BIT 30
@@ -28,6 +37,101 @@
 #define PTE_BIT 12
 #define GRANULE_SIZE 9
 
+/* Anonymous memory covering an aligned 2MB range may be mapped by a PMD block */
+#define HPAGE_SIZE  (1UL << PMD_BIT)
+#define HPAGE_ORDER (PMD_BIT - PTE_BIT)
+#define pmd_huge(ent) (((ent) & 0b11) == PD_BLOCK)
+
+static inline void flush_tlb_page(uint64_t va)
+{
+    __asm__ volatile(
+        "dsb ishst\n"
+        "tlbi vaae1is, %0\n"
+        "dsb ish\n"
+        "isb\n"
+        :: "r"((va >> PTE_BIT) & ((1UL << 44) - 1)));
+}
+
+/**
+ * User tables are loaded with an 8-bit ASID in TTBR0, so a switch needs no
+ * TLB flush. mm_struct.asid keeps the allocator generation above the ASID.
+ */
+#define ASID_BITS 8
+#define NR_ASIDS  (1 << ASID_BITS)
+#define ASID_MASK (NR_ASIDS - 1)
+#define TTBR_ASID_SHIFT 48
+
+static inline void flush_tlb_asid(uint64_t asid)
+{
+    __asm__ volatile(
+        "dsb ishst\n"
+        "tlbi aside1is, %0\n"
+        "dsb ish\n"
+        "isb\n"
+        :: "r"((asid & ASID_MASK) << TTBR_ASID_SHIFT));
+}
+
+/* Entry of va under one ASID on this core, user tasks only run on the boot core */
+static inline void flush_tlb_page_local(uint64_t va, uint64_t asid)
+{
+    __asm__ volatile(
+        "dsb nshst\n"
+        "tlbi vae1, %0\n"
+        "dsb nsh\n"
+        "isb\n"
+        :: "r"((asid & ASID_MASK) << TTBR_ASID_SHIFT | ((va >> PTE_BIT) & ((1UL << 44) - 1))));
+}
+
+/* Past this many pages a range is cheaper to drop with the whole ASID */
+#define TLB_FLUSH_MAX_PAGES 64
+
+/* Entries of [start, end) under one ASID on this core, one barrier for the range */
+static inline void flush_tlb_range(uint64_t start, uint64_t end, uint64_t asid)
+{
+    if ((end - start) >> PTE_BIT > TLB_FLUSH_MAX_PAGES) {
+        flush_tlb_asid(asid);
+        return;
+    }
+
+    __asm__ volatile("dsb nshst" ::: "memory");
+    for (; start < end; start += 1UL << PTE_BIT)
+        __asm__ volatile("tlbi vae1, %0" ::
+                         "r"((asid & ASID_MASK) << TTBR_ASID_SHIFT | ((start >> PTE_BIT) & ((1UL << 44) - 1))));
+    __asm__ volatile(
+        "dsb nsh\n"
+        "isb\n" ::: "memory");
+}
+
+/* Cortex-A53 has 64 bytes lines in both L1 and L2 */
+#define CACHE_LINE_SIZE 64
+
+/* Write back dirty lines and drop them, for memory the GPU reads and writes */
+static inline void dcache_clean_inval_range(void *start, uint64_t size)
+{
+    uint64_t addr = (uint64_t)start & ~(CACHE_LINE_SIZE - 1);
+
+    for (; addr < (uint64_t)start + size; addr += CACHE_LINE_SIZE)
+        __asm__ volatile("dc civac, %0" :: "r"(addr) : "memory");
+    __asm__ volatile("dsb sy" ::: "memory");
+}
+
+/**
+ * Code written by data stores is not seen by instruction fetch until it
+ * is cleaned to PoU. I-cache of A53 is VIPT, drop all of it for aliases.
+ */
+static inline void sync_icache_range(void *start, uint64_t size)
+{
+    uint64_t addr = (uint64_t)start & ~(CACHE_LINE_SIZE - 1);
+
+    for (; addr < (uint64_t)start + size; addr += CACHE_LINE_SIZE)
+        __asm__ volatile("dc cvau, %0" :: "r"(addr) : "memory");
+    __asm__ volatile(
+        "dsb ish\n"
+        "ic ialluis\n"
+        "dsb ish\n"
+        "isb\n" ::: "memory");
+}
+
 typedef unsigned long pgd_t;
 typedef unsigned long pud_t;
 typedef unsigned long pmd_t;
@@ -40,12 +144,24 @@ typedef struct _vm_area_struct {
     uint64_t prot;
     int flags;
     const char *data;
-    struct list_head list;
+    struct list_head list;          /* Sorted by address */
+    struct _vm_area_struct *left;   /* AVL tree keyed by vm_start */
+    struct _vm_area_struct *right;
+    int32_t height;
+    uint64_t gap;                   /* Free space between the previous VMA and vm_start */
+    uint64_t max_gap;               /* Largest gap in the subtree */
 } vm_area_struct;
 
+struct _Arena;
+
 typedef struct _mm_struct {
-    vm_area_struct *mmap;
+    vm_area_struct *mmap;       /* Lowest VMA */
+    vm_area_struct *vma_root;
+    vm_area_struct *vmacache;   /* Last VMA found by find_vma() */
     pgd_t *pgd;
+    struct _Arena *arena;       /* Of the owner task, VMAs are allocated there */
+    vm_area_struct *free_vma;   /* Released VMAs, linked by their first word */
+    uint64_t asid;              /* Generation | ASID, 0 if never loaded */
 } mm_struct;
 
 #define PROT_NONE  0x0
@@ -54,14 +170,20 @@ typedef struct _mm_struct {
 #define PROT_READ  0x1
 #define MAP_ANONYMOUS 0x20
 #define MAP_POPULATE 0x008000
+#define MREMAP_MAYMOVE 0x1
 
-void dup_pages(void *parent, void *child, int level);
-void dup_vma(mm_struct *parent_mm, mm_struct *child_mm);
+void linear_map_init();
+int32_t dup_pages(void *parent, void *child, int level);
+int32_t dup_vma(mm_struct *parent_mm, mm_struct *child_mm);
 void do_page_fault(uint64_t far, uint32_t esr);
 void *svc_mmap(void* addr, uint64_t len, int prot, int flags, int fd, int file_offset);
+int32_t svc_munmap(void *addr, uint64_t len);
+int32_t svc_mprotect(void *addr, uint64_t len, int prot);
+void *svc_mremap(void *old_addr, uint64_t old_len, uint64_t new_len, int flags);
 void release_vma(mm_struct *mm);
 void release_pgtable(void *pagetable, int level);
-void mappages(void *pgd, uint64_t va, uint64_t size, uint64_t pa, uint64_t attr);
+int32_t mappages(void *pgd, uint64_t va, uint64_t size, uint64_t pa, uint64_t attr);
+void unmappages(void *pgd, uint64_t va, uint64_t size);
 pte_t *walk(void *pgd, uint64_t va);
 vm_area_struct *mmap_internal(mm_struct *mm, void* addr, uint64_t len, int prot, int flags);
 vm_area_struct *find_vma(mm_struct *mm, uint64_t addr);
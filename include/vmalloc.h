@@ -0,0 +1,27 @@
+#ifndef _VMALLOC_H_
+#define _VMALLOC_H_
+
+#include <types.h>
+#include <list.h>
+#include <util.h>
+
+/* Second PGD entry of the kernel page table, the first one maps RAM and peripherals */
+#define VMALLOC_START 0xFFFF008000000000
+#define VMALLOC_END   (VMALLOC_START + 4UL * GB)
+
+#define is_vmalloc_addr(addr) \
+    ((uint64_t)(addr) >= VMALLOC_START && (uint64_t)(addr) < VMALLOC_END)
+
+/* Each area is followed by an unmapped guard page */
+typedef struct _VmArea {
+    uint64_t addr;
+    uint64_t size;
+    struct list_head list;
+} VmArea;
+
+void *vmalloc(uint64_t size);
+void vfree(void *addr);
+uint64_t vsize(void *addr);
+void *kvmalloc(uint64_t size);
+
+#endif /* _VMALLOC_H_ */
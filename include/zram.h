@@ -0,0 +1,29 @@
+#ifndef _ZRAM_H_
+#define _ZRAM_H_
+
+#include <types.h>
+#include <mm.h>
+#include <swap.h>
+
+/**
+ * Compressed pages kept in kmalloc objects, tried before the swap partition.
+ * A page which does not compress to ZRAM_MAX_OBJ goes to the partition.
+ */
+#define ZRAM_MAX_SLOTS 0x2000
+#define ZRAM_MAX_OBJ   (PAGE_SIZE / 2)
+
+typedef struct _ZramSlot {
+    void *obj;     /* NULL if the slot is free */
+    uint16_t size;
+    swap_cnt_t cnt; /* Entries referring to the slot */
+} ZramSlot;
+
+void zram_init();
+bool zram_full();
+uint64_t zram_store(void *page, uint32_t cnt);
+void zram_load(uint64_t entry, void *page);
+void zram_dup(uint64_t entry);
+void zram_free(uint64_t entry);
+void zram_report();
+
+#endif /* _ZRAM_H_ */
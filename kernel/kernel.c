@@ -10,6 +10,7 @@
 #include <util.h>
 #include <sdhost.h>
 #include <fat32.h>
+#include <swap.h>
 
 void usage()
 {
@@ -31,20 +32,18 @@ void foo()
     }
 }
 
-int cpio_init_cb(char *node_name, char *prop_name, char *value, int len)
+/* Only records the values, reservations are made by kernel() */
+int boot_param_cb(char *node_name, char *prop_name, char *value, int len)
 {
     if (prop_name) {
         if (!strcmp(prop_name, "linux,initrd-start"))
             cpio_start = endian_xchg_32(*(uint32_t *)value) + MM_VIRT_KERN_START;
         else if (!strcmp(prop_name, "linux,initrd-end"))
             cpio_end = endian_xchg_32(*(uint32_t *)value) + MM_VIRT_KERN_START;
-        else if (!strcmp(prop_name, "memreserve"))
-            phys_mem_end = endian_xchg_32(*(uint32_t *)value);
-    }
-
-    if (cpio_start && cpio_end) {
-        register_mem_reserve(cpio_start, cpio_end);
-        return 1;
+        else if (!strncmp(node_name, "linux,cma", 9) && !strcmp(prop_name, "size"))
+            cma_size = (len == 8) ? ((uint64_t)endian_xchg_32(*(uint32_t *)value) << 32 |
+                                     endian_xchg_32(*(uint32_t *)(value + 4)))
+                                  : endian_xchg_32(*(uint32_t *)value);
     }
 
     return 0;
@@ -62,22 +61,39 @@ static inline void counter_timer_init()
 void kernel(void *dtb_base)
 {
     uint64_t boot_time = read_sysreg(cntpct_el0);
+    uint64_t mm_init_time;
 
     sd_init();
     uart_init();
     printf_init(uart_sendstr);
     dtb_init(dtb_base);
-    parse_dtb(cpio_init_cb);
+    dtb_scan_memory();
+    parse_dtb(boot_param_cb);
+    if (cpio_start && cpio_end)
+        register_mem_reserve(cpio_start, cpio_end);
+    linear_map_init();
+    mm_init_time = read_sysreg(cntpct_el0);
     page_init();
     buddy_init();
+    mm_init_time = read_sysreg(cntpct_el0) - mm_init_time;
     slab_init();
+    zero_page_init();
+    rmap_cache_init();
+    swap_init();
+    task_cache_init();
+    vfs_cache_init();
+    timer_cache_init();
     uart_enable_intr();
     counter_timer_init();
     task_queue_init();
     main_thread_init();
+    create_kern_task(kswapd, NULL);
+    create_kern_task(deferred_init, NULL);
     register_filesystem(&tmpfs);
     
     printf("boot_time: %x\r\n", boot_time);
+    /* The rest of mem_map is reported by deferred_init_time later */
+    printf("mm_init_time: %x\r\n", mm_init_time);
 
     // for (int i = 0; i < 3; i++)
     //     create_kern_task(foo, NULL);
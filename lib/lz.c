@@ -0,0 +1,147 @@
+#include <lz.h>
+#include <util.h>
+#include <types.h>
+
+#define LZ_DICT_NONE 0xffff
+#define lz_hash(v) (((v) * 2654435761U) >> (32 - LZ_HASH_BITS))
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Lengths from 15 on continue in bytes, 255 means another byte follows */
+static uint8_t *put_len(uint8_t *op, uint8_t *oend, uint32_t len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op >= oend)
+            return NULL;
+        *op++ = 255;
+    }
+
+    if (op >= oend)
+        return NULL;
+    *op++ = len;
+    return op;
+}
+
+/* The last sequence has literals only, its mlen is 0 */
+static uint8_t *put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+                        uint32_t nlit, uint32_t off, uint32_t mlen)
+{
+    uint8_t *token = op++;
+
+    if (op > oend)
+        return NULL;
+
+    *token = (MIN(nlit, 15) << 4) | (mlen ? MIN(mlen - LZ_MIN_MATCH, 15) : 0);
+    if (nlit >= 15 && (op = put_len(op, oend, nlit - 15)) == NULL)
+        return NULL;
+
+    if (op + nlit > oend)
+        return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (mlen == 0)
+        return op;
+
+    if (op + 2 > oend)
+        return NULL;
+    *op++ = off & 0xff;
+    *op++ = off >> 8;
+
+    if (mlen - LZ_MIN_MATCH >= 15 && (op = put_len(op, oend, mlen - LZ_MIN_MATCH - 15)) == NULL)
+        return NULL;
+    return op;
+}
+
+uint32_t lz_compress(const void *src, uint32_t len, void *dst, uint32_t cap, uint16_t *dict)
+{
+    const uint8_t *base = src, *ip = src, *anchor = src, *iend = base + len, *ref;
+    uint8_t *op = dst, *oend = op + cap;
+    uint32_t h, mlen;
+    uint16_t pos;
+
+    if (len >= LZ_DICT_NONE)
+        return 0;
+
+    memset(dict, 0xff, LZ_DICT_SIZE);
+
+    while (ip + LZ_MIN_MATCH <= iend) {
+        h = lz_hash(read32(ip));
+        pos = dict[h];
+        dict[h] = ip - base;
+
+        ref = base + pos;
+        if (pos == LZ_DICT_NONE || read32(ref) != read32(ip)) {
+            ip++;
+            continue;
+        }
+
+        for (mlen = LZ_MIN_MATCH; ip + mlen < iend && ref[mlen] == ip[mlen]; mlen++)
+            ;
+
+        if ((op = put_seq(op, oend, anchor, ip - anchor, ip - ref, mlen)) == NULL)
+            return 0;
+        ip += mlen;
+        anchor = ip;
+    }
+
+    if ((op = put_seq(op, oend, anchor, iend - anchor, 0, 0)) == NULL)
+        return 0;
+    return op - (uint8_t *)dst;
+}
+
+int32_t lz_decompress(const void *src, uint32_t len, void *dst, uint32_t cap)
+{
+    const uint8_t *ip = src, *iend = ip + len, *ref;
+    uint8_t *op = dst, *oend = op + cap;
+    uint32_t nlit, mlen, off;
+    uint8_t token;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        nlit = token >> 4;
+        if (nlit == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                nlit += *ip;
+            } while (*ip++ == 255);
+        }
+
+        if (ip + nlit > iend || op + nlit > oend)
+            return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+
+        if (ip == iend)
+            break;
+
+        if (ip + 2 > iend)
+            return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        mlen = (token & 0xf) + LZ_MIN_MATCH;
+        if ((token & 0xf) == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                mlen += *ip;
+            } while (*ip++ == 255);
+        }
+
+        if (off == 0 || off > op - (uint8_t *)dst || op + mlen > oend)
+            return -1;
+
+        /* Byte by byte, the match may overlap what it produces */
+        for (ref = op - off; mlen; mlen--)
+            *op++ = *ref++;
+    }
+
+    return op - (uint8_t *)dst;
+}
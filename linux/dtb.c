@@ -2,28 +2,22 @@
 #include <util.h>
 #include <types.h>
 #include <mm.h>
+#include <memblock.h>
 
 static uint64_t dtb_base, dtb_end;
 
 void dtb_init(void *_dtb_base)
 {
     Fdt_header *fdt_hdr = (Fdt_header *)_dtb_base;
+    if (endian_xchg_32(fdt_hdr->magic) != DTB_MAGIC)
+        return;
+
     dtb_base = (uint64_t)_dtb_base + MM_VIRT_KERN_START;
     dtb_end = dtb_base + endian_xchg_32(fdt_hdr->totalsize);
-    register_mem_reserve(dtb_base, dtb_end);
-}
-
-void parse_dtb(int(*callback)(char*, char*, char*, int))
-{
-    if (dtb_base == NULL)
-        return;
 
-    Fdt_header *fdt_hdr = (Fdt_header *)dtb_base;
-    
+    /* Header and reserve map are converted in place, only once */
+    fdt_hdr = (Fdt_header *)dtb_base;
     fdt_hdr->magic = endian_xchg_32(fdt_hdr->magic);
-    if (fdt_hdr->magic != DTB_MAGIC)
-        return;
-
     fdt_hdr->totalsize = endian_xchg_32(fdt_hdr->totalsize);
     fdt_hdr->off_dt_struct = endian_xchg_32(fdt_hdr->off_dt_struct);
     fdt_hdr->off_dt_strings = endian_xchg_32(fdt_hdr->off_dt_strings);
@@ -42,6 +36,16 @@ void parse_dtb(int(*callback)(char*, char*, char*, int))
         fdt_rsv++;
     }
 
+    register_mem_reserve(dtb_base, dtb_end);
+}
+
+void parse_dtb(int(*callback)(char*, char*, char*, int))
+{
+    if (dtb_base == NULL)
+        return;
+
+    Fdt_header *fdt_hdr = (Fdt_header *)dtb_base;
+
     char *node_name;
     char *prop_name;
     void *prop_value_ptr;
@@ -98,3 +102,102 @@ parse_dtb_ret:
     return;
 }
 
+
+static uint64_t dtb_read_cells(uint32_t **cell, uint32_t cnt)
+{
+    uint64_t val = 0;
+
+    while (cnt--) {
+        val = (val << 32) | endian_xchg_32(**cell);
+        (*cell)++;
+    }
+
+    return val;
+}
+
+/**
+ * Register /memory and /reserved-memory nodes and the memreserve entries
+ * to memblock. "reg" is parsed by the cells of the parent node.
+ */
+void dtb_scan_memory()
+{
+    uint32_t addr_cells[DTB_MAX_DEPTH], size_cells[DTB_MAX_DEPTH];
+    char *node_name[DTB_MAX_DEPTH];
+    int depth = -1;
+
+    if (dtb_base == NULL)
+        return;
+
+    Fdt_header *fdt_hdr = (Fdt_header *)dtb_base;
+    Fdt_rsv_entry *fdt_rsv = (Fdt_rsv_entry *)(dtb_base + fdt_hdr->off_mem_rsvmap);
+    for (; fdt_rsv->address || fdt_rsv->size; fdt_rsv++)
+        memblock_reserve(fdt_rsv->address, fdt_rsv->size);
+
+    char *prop_name;
+    uint32_t *cell, *cell_end;
+    uint32_t prop_len, val;
+    uint64_t base, size;
+    bool is_memory, is_rsvd;
+
+    char *str_block = (char *)dtb_base + fdt_hdr->off_dt_strings;
+    char *stru_block = (char *)dtb_base + fdt_hdr->off_dt_struct;
+
+    while (1)
+    {
+        switch (endian_xchg_32(*(uint32_t *)stru_block)) {
+        case FDT_BEGIN_NODE:
+            stru_block += 4;
+            if (++depth == DTB_MAX_DEPTH)
+                return;
+
+            node_name[depth] = stru_block;
+            addr_cells[depth] = 2;
+            size_cells[depth] = 1;
+            stru_block = PALIGN(stru_block + strlen(stru_block) + 1, 4);
+            break;
+
+        case FDT_PROP:
+            prop_len = endian_xchg_32(*(uint32_t *)(stru_block + 4));
+            prop_name = str_block + endian_xchg_32(*(uint32_t *)(stru_block + 8));
+            cell = (uint32_t *)(stru_block + 12);
+            cell_end = (uint32_t *)((char *)cell + prop_len);
+            stru_block = PALIGN(stru_block + 12 + prop_len, 4);
+
+            val = endian_xchg_32(*cell);
+            if (!strcmp(prop_name, "#address-cells"))
+                addr_cells[depth] = val;
+            else if (!strcmp(prop_name, "#size-cells"))
+                size_cells[depth] = val;
+
+            if (depth < 1 || strcmp(prop_name, "reg"))
+                break;
+
+            is_memory = depth == 1 && !strncmp(node_name[1], "memory", 6) &&
+                             (node_name[1][6] == '\0' || node_name[1][6] == '@');
+            is_rsvd = depth == 2 && !strcmp(node_name[1], "reserved-memory");
+            while (cell + addr_cells[depth-1] + size_cells[depth-1] <= cell_end) {
+                base = dtb_read_cells(&cell, addr_cells[depth-1]);
+                size = dtb_read_cells(&cell, size_cells[depth-1]);
+                if (is_memory)
+                    memblock_add(base, size);
+                else if (is_rsvd)
+                    memblock_reserve(base, size);
+                else
+                    break;
+            }
+            break;
+
+        case FDT_END_NODE:
+            stru_block += 4;
+            depth--;
+            break;
+
+        case FDT_NOP:
+            stru_block += 4;
+            break;
+
+        default:
+            return;
+        }
+    }
+}
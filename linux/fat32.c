@@ -3,6 +3,7 @@
 #include <util.h>
 #include <fs.h>
 #include <mm.h>
+#include <vmalloc.h>
 #include <list.h>
 #include <printf.h>
 
@@ -116,6 +117,51 @@ static uint32_t fat32_writeback_internal(uint32_t curr_fat_idx, char *data, uint
     return first_clus;
 }
 
+/* Read the file into a new buffer, -1 if there is no memory for it */
+static int32_t fat32_load(struct vnode *vnode, FAT32DirEnt *fat32_dir_ent)
+{
+    uint32_t start_sector = get_clusN_sector(fat32_dir_ent->fst_clus_lo + (fat32_dir_ent->fst_clus_hi << 16));
+    uint32_t end_sector = start_sector + ((fat32_dir_ent->file_size - 1) / SECTOR_SIZE + 1);
+
+    vnode->size = fat32_dir_ent->file_size;
+    /* Large files need not be physically contiguous */
+    vnode->internal.mem = kvmalloc((end_sector - start_sector) * SECTOR_SIZE);
+    if (vnode->internal.mem == NULL)
+        return -1;
+
+    char *ptr = vnode->internal.mem;
+    for (int i = start_sector; i < end_sector; i++) {
+        read_block(i, ptr);
+        ptr += SECTOR_SIZE;
+    }
+    return 0;
+}
+
+/* Drop the buffers of clean files which are not opened, reload them on open */
+static uint64_t fat32_shrink(uint64_t nr_to_scan)
+{
+    struct cache_vnode *cvn_iter = container_of(cache_vnode_head.list.next, struct cache_vnode, list);
+    struct vnode *vnode;
+    uint64_t freed = 0;
+
+    while (cvn_iter != &cache_vnode_head && freed < nr_to_scan) {
+        vnode = cvn_iter->vnode;
+        if (!VNODE_IS_DIRTY(vnode) && vnode->refcnt == 0 && vnode->internal.mem != NULL) {
+            kfree(vnode->internal.mem);
+            vnode->internal.mem = NULL;
+            freed += PAGE_ROUNDUP(vnode->size) >> PAGE_SHIFT;
+        }
+        cvn_iter = container_of(cvn_iter->list.next, struct cache_vnode, list);
+    }
+
+    return freed;
+}
+
+static Shrinker fat32_shrinker = {
+    .name = "fat32",
+    .scan = fat32_shrink,
+};
+
 static inline void add_fat32_cache_vnode(struct vnode *vnode)
 {
     struct cache_vnode *cvn = kmalloc(sizeof(struct cache_vnode));
@@ -169,6 +215,7 @@ static int32_t fat32_init()
                            fat32_meta.part_desc.start_sector;
 
     LIST_INIT(cache_vnode_head.list);
+    register_shrinker(&fat32_shrinker);
 
     return 0;
 }
@@ -217,21 +264,28 @@ int fat32_setup_mount(const struct filesystem* fs, struct mount* mount)
 
 int fat32_write(struct file *file, const void *buf, uint64_t len)
 {
+    struct vnode *vnode = file->vnode;
     const char *ptr = buf;
     uint64_t i;
 
-    if (file->f_pos + len > file->vnode->size) {
-        /* Reallocate memory */
+    if (file->f_pos + len > vnode->size) {
+        /* Buffer holds whole sectors for write back, grow it past its capacity only */
+        uint32_t old_end = (vnode->size + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1);
         uint32_t new_sz = (file->f_pos + len + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1);
-        void *tmp = kmalloc(new_sz);
-        memset(tmp, 0, new_sz);
-        memcpy(tmp, file->vnode->internal.mem, file->vnode->size);
-        
-        if (file->vnode->internal.mem != NULL)
-            kfree(file->vnode->internal.mem);
-        
-        file->vnode->size = file->f_pos + len;
-        file->vnode->internal.mem = tmp;
+        if (vnode->internal.mem == NULL || new_sz > ksize(vnode->internal.mem)) {
+            char *tmp = krealloc(vnode->internal.mem, new_sz);
+            if (tmp == NULL)
+                return -1;
+            vnode->internal.mem = tmp;
+        }
+
+        /* Hole left by lseek and the newly covered sectors read as zero */
+        if (file->f_pos > vnode->size)
+            memset(vnode->internal.mem + vnode->size, 0, MIN(file->f_pos, old_end) - vnode->size);
+        if (new_sz > old_end)
+            memset(vnode->internal.mem + old_end, 0, new_sz - old_end);
+
+        vnode->size = file->f_pos + len;
     }
 
     for (i = 0; i < len && file->f_pos < file->vnode->size; i++, file->f_pos++)
@@ -269,22 +323,19 @@ int fat32_open(struct vnode *dir_node, struct vnode *vnode,
         
         add_fat32_cache_vnode(vnode);
 
-        if (lookup_ret == 0) {
-            uint32_t start_sector = get_clusN_sector(fat32_dir_ent.fst_clus_lo + (fat32_dir_ent.fst_clus_hi << 16));
-            uint32_t end_sector = start_sector + ((fat32_dir_ent.file_size - 1) / SECTOR_SIZE + 1);
-
-            vnode->size = fat32_dir_ent.file_size;
-            vnode->internal.mem = kmalloc((end_sector - start_sector) * SECTOR_SIZE);
-
-            char *ptr = vnode->internal.mem;
-            for (int i = start_sector; i < end_sector; i++) {
-                read_block(i, ptr);
-                ptr += SECTOR_SIZE;
-            }
-        }
+        /* Left unloaded, the next open tries again */
+        if (lookup_ret == 0 && fat32_load(vnode, &fat32_dir_ent) != 0)
+            return -1;
+    } else if (vnode->internal.mem == NULL && vnode->size != 0) {
+        /* Buffer was dropped by shrinker */
+        if (fat32_lookup_file(&fat32_dir_ent, vnode->component_name) != 0 ||
+            fat32_load(vnode, &fat32_dir_ent) != 0)
+            return -1;
     }
 
     struct file *file = new_file(vnode, flags);
+    if (file == NULL)
+        return -1;
     *target = file;
 
     return 0;
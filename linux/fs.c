@@ -10,6 +10,7 @@
 #include <stdarg.h>
 
 struct mount *rootfs = NULL;
+static KmemCache *file_cachep, *vnode_cachep;
 
 const struct vnode_operations vnode_ops = {
     .create = vfs_create,
@@ -27,13 +28,23 @@ const struct file_operations file_ops = {
     .ioctl = vfs_ioctl,
 };
 
+void vfs_cache_init()
+{
+    file_cachep = kmem_cache_create("file", sizeof(struct file), 0, NULL);
+    vnode_cachep = kmem_cache_create("vnode", sizeof(struct vnode), 0, NULL);
+}
+
 struct file *new_file(struct vnode *vnode, int flags)
 {
-    struct file *file = kmalloc(sizeof(struct file));
+    struct file *file = kmem_cache_alloc(file_cachep);
+    if (file == NULL)
+        return NULL;
+
     file->f_ops = vnode->f_ops;
     file->f_pos = 0;
     file->flags = flags;
     file->vnode = vnode;
+    vnode->refcnt++;
     return file;
 }
 
@@ -41,7 +52,7 @@ static struct vnode *new_vnode(struct vnode *parent,
             const struct file_operations *fops,
             const char *component_name, uint8_t type)
 {
-    struct vnode *vn = kmalloc(sizeof(struct vnode));
+    struct vnode *vn = kmem_cache_alloc(vnode_cachep);
     memset(vn->component_name, 0, FILE_COMPONENT_NAME_LEN);
     strcpy(vn->component_name, component_name);
     LIST_INIT(vn->list);
@@ -50,6 +61,7 @@ static struct vnode *new_vnode(struct vnode *parent,
     vn->type = type;
     vn->mount = NULL;
     vn->size = 0;
+    vn->refcnt = 0;
     vn->cache_attr = 0;
     vn->internal.mem = NULL;
 
@@ -174,6 +186,8 @@ int vfs_open(struct vnode *dir_node, struct vnode *vnode,
     }
 
     struct file *file = new_file(vnode, flags);
+    if (file == NULL)
+        return -1;
     *target = file;
 
     return 0;
@@ -199,7 +213,8 @@ int __vfs_open_wrapper(const char *pathname, int flags, struct file **file)
 
 int vfs_close(struct file *file)
 {
-    kfree(file);
+    file->vnode->refcnt--;
+    kmem_cache_free(file_cachep, file);
     return 0;
 }
 
@@ -208,14 +223,26 @@ int vfs_write(struct file *file, const void *buf, uint64_t len)
     if (!(file->vnode->type & FILE_NORM) || is_fs_rdonly(file->vnode))
         return -1;
 
-    if (file->vnode->internal.mem == NULL) {
-        file->vnode->internal.mem = kmalloc(FILE_MAX_SIZE);
-        memset(file->vnode->internal.mem, 0, FILE_MAX_SIZE);
+    struct vnode *vnode = file->vnode;
+    uint64_t end = MIN(file->f_pos + len, FILE_MAX_SIZE);
+
+    /* Buffer grows with the file instead of taking FILE_MAX_SIZE at once */
+    if (end > vnode->size) {
+        if (vnode->internal.mem == NULL || end > ksize(vnode->internal.mem)) {
+            char *tmp = krealloc(vnode->internal.mem, end);
+            if (tmp == NULL)
+                return -1;
+            vnode->internal.mem = tmp;
+        }
+
+        /* Hole left by lseek reads as zero */
+        if (file->f_pos > vnode->size)
+            memset(vnode->internal.mem + vnode->size, 0, MIN(file->f_pos, end) - vnode->size);
     }
 
     const char *ptr = buf;
     uint64_t i;
-    for (i = 0; i < len && file->f_pos < FILE_MAX_SIZE; i++, file->f_pos++)
+    for (i = 0; i < len && file->f_pos < end; i++, file->f_pos++)
         *(file->vnode->internal.mem + file->f_pos) = *ptr++;
 
     if (file->f_pos > file->vnode->size)
@@ -246,6 +246,9 @@ static int mailbox_call(uint32_t channel)
     uint32_t magic = (channel & MAILBOX_CHANNEL_MASK) |
                      ((uint32_t)(uint64_t)addr & MAILBOX_DATA_MASK);
                      
+    /* GPU accesses the buffer behind the ARM caches */
+    dcache_clean_inval_range((void *)mbox, sizeof(mbox));
+
     /* Wait for mailbox not full */
     while (*MAILBOX0_STATUS & MAILBOX_STATUS_FULL);
     /* Pass message to GPU */
@@ -253,6 +256,8 @@ static int mailbox_call(uint32_t channel)
     /* Wait for mailbox not empty */
     while (*MAILBOX0_STATUS & MAILBOX_STATUS_EMPTY);
 
+    /* Drop lines fetched speculatively while the GPU was writing the response */
+    dcache_clean_inval_range((void *)mbox, sizeof(mbox));
     return *MAILBOX0_READ == magic;
 }
 
@@ -38,6 +38,10 @@ int initramfs_setup_mount(const struct filesystem* fs, struct mount* mount)
     current->workdir = mount->root;
     while (1)
     {
+        /* Zero words pad headers so that file data starts on a page, like Linux skips them */
+        while (next_hdr < (char *)cpio_end && *(uint32_t *)next_hdr == 0)
+            next_hdr += 4;
+
         hdr = next_hdr;
         buf[8] = '\0';
         for (i = 0, hdr += 6; i < 12; i++, hdr += 8) {
@@ -37,9 +37,16 @@ static struct list_head bhj_hdr = LIST_HEAD_INIT(bhj_hdr);
 void add_timer(void (*callback)(void*), void *arg, uint32_t duration);
 BottomHalfJob *add_bhj(void (*callback)(void*), void *arg, int32_t prio);
 
+static KmemCache *time_job_cachep;
+
+void timer_cache_init()
+{
+    time_job_cachep = kmem_cache_create("time_job", sizeof(TimeJob), 0, NULL);
+}
+
 TimeJob *new_time_job(void (*callback)(void*), void *arg, uint32_t duration)
 {
-    TimeJob *time_job = kmalloc(sizeof(TimeJob));
+    TimeJob *time_job = kmem_cache_alloc(time_job_cachep);
     time_job->callback = callback;
     time_job->arg = arg;
     time_job->duration = duration;
@@ -0,0 +1,153 @@
+#include <memblock.h>
+#include <mm.h>
+#include <util.h>
+#include <printf.h>
+
+MemblockType memblock_memory = { .name = "memory" },
+             memblock_reserved = { .name = "reserved" };
+
+#define region_end(r) ((r)->base + (r)->size)
+
+/* Insert [base, base + size), the regions it overlaps or touches are merged */
+static void memblock_insert(MemblockType *type, uint64_t base, uint64_t size)
+{
+    uint64_t end = base + size;
+    uint32_t i, j, k;
+
+    if (size == 0)
+        return;
+
+    for (i = 0; i < type->cnt && region_end(&type->regions[i]) < base; i++)
+        ;
+
+    for (j = i; j < type->cnt && type->regions[j].base <= end; j++) {
+        base = MIN(base, type->regions[j].base);
+        end = MAX(end, region_end(&type->regions[j]));
+    }
+
+    if (i == j) {
+        if (type->cnt == MEMBLOCK_MAX_REGIONS) {
+            printf("[memblock] Too many %s regions\r\n", type->name);
+            hangon();
+        }
+
+        for (k = type->cnt; k > i; k--)
+            type->regions[k] = type->regions[k-1];
+        type->cnt++;
+    } else {
+        /* Regions [i, j) are replaced by the merged one */
+        for (k = j; k < type->cnt; k++)
+            type->regions[k - (j - i - 1)] = type->regions[k];
+        type->cnt -= j - i - 1;
+    }
+
+    type->regions[i].base = base;
+    type->regions[i].size = end - base;
+}
+
+void memblock_add(uint64_t base, uint64_t size)
+{
+    memblock_insert(&memblock_memory, base, size);
+}
+
+void memblock_reserve(uint64_t base, uint64_t size)
+{
+    memblock_insert(&memblock_reserved, base, size);
+}
+
+/* Lowest address above base where size bytes fit between reserved regions */
+static uint64_t memblock_find(uint64_t base, uint64_t size, uint64_t align)
+{
+    MemblockRegion *r;
+
+    base = ALIGN(base, align);
+    for (uint32_t i = 0; i < memblock_reserved.cnt; i++) {
+        r = &memblock_reserved.regions[i];
+        if (region_end(r) <= base)
+            continue;
+        if (r->base >= base + size)
+            break;
+        base = ALIGN(region_end(r), align);
+    }
+
+    return base;
+}
+
+/* Bottom-up, so that the top of memory is left to the CMA region */
+/* Same as memblock_alloc() but not cleared, for callers which clear it later */
+void *memblock_alloc_raw(uint64_t size, uint64_t align)
+{
+    MemblockRegion *r;
+    uint64_t base;
+
+    size = ALIGN(size, 8);
+    for (uint32_t i = 0; i < memblock_memory.cnt; i++) {
+        r = &memblock_memory.regions[i];
+        base = memblock_find(r->base, size, align);
+        if (base + size > region_end(r) || base + size > phys_mem_end)
+            continue;
+
+        memblock_reserve(base, size);
+        return (void *)phys_to_virt(base);
+    }
+
+    #ifdef DEBUG_MM
+    printf("[DEBUG] memblock cannot allocate 0x%x bytes\r\n", size);
+    #endif /* DEBUG_MM */
+    return NULL;
+}
+
+void *memblock_alloc(uint64_t size, uint64_t align)
+{
+    void *ret = memblock_alloc_raw(size, align);
+
+    if (ret != NULL)
+        memset(ret, 0, ALIGN(size, 8));
+    return ret;
+}
+
+uint64_t memblock_start()
+{
+    return memblock_memory.cnt ? memblock_memory.regions[0].base : 0;
+}
+
+uint64_t memblock_end()
+{
+    return memblock_memory.cnt ? region_end(&memblock_memory.regions[memblock_memory.cnt-1]) : 0;
+}
+
+/* Some part of [base, base + size) is memory */
+bool memblock_is_memory(uint64_t base, uint64_t size)
+{
+    for (uint32_t i = 0; i < memblock_memory.cnt; i++)
+        if (memblock_memory.regions[i].base < base + size &&
+            base < region_end(&memblock_memory.regions[i]))
+            return 1;
+
+    return 0;
+}
+
+/* Whole [base, base + size) is memory and nothing of it is reserved */
+bool memblock_is_free(uint64_t base, uint64_t size)
+{
+    MemblockRegion *r;
+    bool in_memory = 0;
+
+    for (uint32_t i = 0; i < memblock_memory.cnt; i++) {
+        r = &memblock_memory.regions[i];
+        if (r->base <= base && base + size <= region_end(r))
+            in_memory = 1;
+    }
+
+    return in_memory && memblock_find(base, size, 1) == base;
+}
+
+void memblock_dump()
+{
+    MemblockType *types[] = { &memblock_memory, &memblock_reserved };
+
+    for (int t = 0; t < 2; t++)
+        for (uint32_t i = 0; i < types[t]->cnt; i++)
+            printf("[memblock] %s 0x%x - 0x%x\r\n", types[t]->name,
+                   types[t]->regions[i].base, region_end(&types[t]->regions[i]));
+}
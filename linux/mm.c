@@ -3,8 +3,12 @@
 #include <list.h>
 #include <types.h>
 #include <printf.h>
-
-#define FREEAREA_UND ((void *)0xffffffff)
+#include <irq.h>
+#include <sched.h>
+#include <vmalloc.h>
+#include <vm.h>
+#include <memblock.h>
+#include <swap.h>
 
 typedef struct _RsvdMem {
     uint64_t start;
@@ -14,132 +18,291 @@ typedef struct _RsvdMem {
 const RsvdMem user_rsvd_memory[] = {
     { spin_table_start, spin_table_end },
     { kern_start, kern_end },
-    { su_rsvd_start, su_rsvd_end },
 };
 
+/* Range covered by mem_map, set from memblock by page_init() */
 uint64_t phys_mem_start = 0, \
-         phys_mem_end = 0x3B400000;
+         phys_mem_end = PHYS_MEM_DEFAULT_END;
 
-FreeArea *free_area[PAGE_ORDER_MAX+1];
+FreeArea free_area[PAGE_ORDER_MAX+1];
+FreeArea cma_area[PAGE_ORDER_MAX+1];
+static PerCpuPages pcp_pages[NR_CPUS];
 Page *mem_map;
 uint64_t gb_pgcnt;
-SlabCache *slab_cache_ptr[SLAB_POOL_SIZE];
+KmemCache kmalloc_caches[SLAB_POOL_SIZE];
+static struct list_head kmem_cache_list = LIST_HEAD_INIT(kmem_cache_list);
 
 static bool buddy_lock = 0;
 static bool slab_lock = 0;
 
-#define is_page_rsvd(pg) (pg->flags & PAGE_FLAG_RSVD)
+/* Free pages in buddy system and the watermarks to start / stop reclaiming */
+uint64_t nr_free_pages;
+uint64_t wmark_low, wmark_high;
 
-/**
- * ============ startup allocator ============
- */
-static char *su_head = (char *)su_rsvd_start,
-            *su_tail = (char *)su_rsvd_end;
-char *startup_alloc(uint32_t sz)
-{
-    if (su_head + sz >= su_tail)
-        return NULL;
+/* CMA region is [cma_base, cma_base + cma_pgcnt) in pfn */
+uint64_t nr_free_cma;
+uint64_t cma_size = CMA_SIZE_DEFAULT;
+static uint32_t cma_base, cma_pgcnt;
+static uint64_t *cma_bitmap; /* Bit is set if the page is claimed by cma_alloc() */
+static bool cma_lock = 0;
 
-    char *ret = su_head;
-    su_head += sz;
+/* mem_map from deferred_pfn on is not initialized yet */
+static uint32_t deferred_pfn;
+static bool deferred_lock = 0;
 
-    return ret;
+static TaskStruct *kswapd_task = NULL;
+static struct list_head shrinker_list = LIST_HEAD_INIT(shrinker_list);
+
+#define is_page_rsvd(pg) ((pg)->flags & PAGE_FLAG_RSVD)
+#define pfn_free_area(pfn) (pfn_to_page(pfn)->cma ? cma_area : free_area)
+
+/* Mark physical [start, end) reserved in mem_map, clipped to pfn [lo, hi) */
+static void reserve_pages(uint64_t start, uint64_t end, uint32_t lo, uint32_t hi)
+{
+    start = MAX(_floor(start, PAGE_SHIFT), pfn_to_phys(lo));
+    end = MIN(_ceil(end, PAGE_SHIFT), pfn_to_phys(hi));
+
+    for (uint64_t pfn = phys_to_pfn(start); pfn < phys_to_pfn(end); pfn++) {
+        pfn_to_page(pfn)->flags = PAGE_FLAG_RSVD;
+        pfn_to_page(pfn)->order = PAGE_ORDER_UND;
+    }
 }
 
+/* memblock is filled from the DTB before, mem_map is set up by init_pages() later */
 void page_init()
 {
-    gb_pgcnt = (phys_mem_end - phys_mem_start) / PAGE_SIZE;
-    mem_map = (Page *)startup_alloc(sizeof(Page) * gb_pgcnt);
+    uint32_t map_sz;
 
-    for (int i = 0; i <= PAGE_ORDER_MAX; i++)
-        free_area[i] = (FreeArea *)FREEAREA_UND;
+    if (memblock_memory.cnt == 0)
+        memblock_add(0, PHYS_MEM_DEFAULT_END);
 
     for (int i = 0; i < sizeof(user_rsvd_memory) / sizeof(user_rsvd_memory[0]); i++)
-        register_mem_reserve( user_rsvd_memory[i].start, user_rsvd_memory[i].end );
+        memblock_reserve(virt_to_phys(user_rsvd_memory[i].start),
+                         user_rsvd_memory[i].end - user_rsvd_memory[i].start);
+
+    /* Buddies are paired by pfn, so pfn 0 is aligned to the largest block */
+    phys_mem_start = memblock_start() & ~((PAGE_SIZE << PAGE_ORDER_MAX) - 1);
+    phys_mem_end = MIN(memblock_end(), PHYS_MEM_MAX);
+
+    /* Not cleared here, each section is cleared when it is initialized */
+    gb_pgcnt = (phys_mem_end - phys_mem_start) / PAGE_SIZE;
+    mem_map = (Page *)memblock_alloc_raw(sizeof(Page) * gb_pgcnt, PAGE_SIZE);
+    if (mem_map == NULL) {
+        printf("[page_init] No memory for mem_map\r\n");
+        hangon();
+    }
+
+    for (int i = 0; i <= PAGE_ORDER_MAX; i++) {
+        map_sz = ALIGN((gb_pgcnt >> i) + 1, 64) / 8;
+        free_area[i].head = PFN_NONE;
+        free_area[i].nr_free = 0;
+        free_area[i].map = (uint64_t *)memblock_alloc(map_sz, 8);
+
+        /* Blocks never cross the region, so the bitmap is shared */
+        cma_area[i].head = PFN_NONE;
+        cma_area[i].nr_free = 0;
+        cma_area[i].map = free_area[i].map;
+    }
+
+    cma_pgcnt = MIN(cma_size >> PAGE_SHIFT, gb_pgcnt >> CMA_MAX_SHIFT);
+    cma_pgcnt &= ~(SECTION_PAGES - 1);
+    map_sz = ALIGN(cma_pgcnt + 1, 64) / 8;
+    cma_bitmap = (uint64_t *)memblock_alloc(map_sz, 8);
+
+    /* CMA region sits at the top of memory, aligned to the largest block and clear of reservations */
+    cma_base = (gb_pgcnt & ~(SECTION_PAGES - 1)) - cma_pgcnt;
+    while (cma_pgcnt && !memblock_is_free(pfn_to_phys(cma_base), (uint64_t)cma_pgcnt << PAGE_SHIFT)) {
+        if (cma_base < SECTION_PAGES) {
+            cma_pgcnt = 0;
+            break;
+        }
+        cma_base -= SECTION_PAGES;
+    }
+
+    #ifdef DEBUG_MM
+    printf("[DEBUG] CMA region 0x%x pages from pfn 0x%x\r\n", cma_pgcnt, cma_base);
+    memblock_dump();
+    #endif /* DEBUG_MM */
 }
 
+/* Virtual [start, end), pages not initialized yet pick it up from memblock */
 void register_mem_reserve(uint64_t start, uint64_t end)
 {
-    start = _floor(start, PAGE_SHIFT);
-    end = _ceil(end, PAGE_SHIFT);
-
-    Page *pg_iter = virt_to_page(start), \
-         *pg_end = virt_to_page(end);
+    memblock_reserve(virt_to_phys(start), end - start);
 
-    while (pg_iter != pg_end) {
-        pg_iter->flags = PAGE_FLAG_RSVD;
-        pg_iter->order = PAGE_ORDER_UND;
-        pg_iter++;
-    }
+    if (mem_map != NULL)
+        reserve_pages(virt_to_phys(start), virt_to_phys(end), 0, deferred_pfn);
 
     #ifdef DEBUG_MM
     printf("[DEBUG] Reserve memory from 0x%x to 0x%x\r\n", start, end);
     #endif /* DEBUG_MM */
 }
 
-static inline void del_fa(FreeArea *victim, int8_t order)
+static inline void fa_set_bit(int8_t order, uint32_t pfn)
 {
-    FreeArea *next = container_of(victim->list.next, FreeArea, list);
-    if (next == victim) {
-        free_area[order] = FREEAREA_UND;
-    } else if (free_area[order] == victim) {
-        free_area[order] = next;
-        list_del(&victim->list);
-    } else {
-        list_del(&victim->list);
-    }
+    free_area[order].map[(pfn >> order) >> 6] |= (1UL << ((pfn >> order) & 63));
+}
+
+static inline void fa_clear_bit(int8_t order, uint32_t pfn)
+{
+    free_area[order].map[(pfn >> order) >> 6] &= ~(1UL << ((pfn >> order) & 63));
+}
+
+static inline bool fa_test_bit(int8_t order, uint32_t pfn)
+{
+    return (free_area[order].map[(pfn >> order) >> 6] >> ((pfn >> order) & 63)) & 1;
+}
+
+/* Free list links are kept in mem_map, the free page itself is never touched */
+static inline void del_fa(uint32_t pfn, int8_t order)
+{
+    Page *pg = pfn_to_page(pfn);
+    FreeArea *area = &pfn_free_area(pfn)[order];
+
+    if (pg->prev == PFN_NONE)
+        area->head = pg->next;
+    else
+        pfn_to_page(pg->prev)->next = pg->next;
+
+    if (pg->next != PFN_NONE)
+        pfn_to_page(pg->next)->prev = pg->prev;
+
+    fa_clear_bit(order, pfn);
+    area->nr_free--;
+    if (pg->cma)
+        nr_free_cma -= (1 << order);
+    else
+        nr_free_pages -= (1 << order);
 }
 
-static inline void add_fa(FreeArea *fa, int8_t order)
+static inline void add_fa(uint32_t pfn, int8_t order)
 {
-    LIST_INIT(fa->list);
-    if (free_area[order] == FREEAREA_UND)
-        free_area[order] = fa;
+    Page *pg = pfn_to_page(pfn);
+    FreeArea *area = &pfn_free_area(pfn)[order];
+
+    pg->order = order;
+    pg->flags = PAGE_FLAG_FREED;
+    pg->prev = PFN_NONE;
+    pg->next = area->head;
+
+    if (pg->next != PFN_NONE)
+        pfn_to_page(pg->next)->prev = pfn;
+    area->head = pfn;
+
+    fa_set_bit(order, pfn);
+    area->nr_free++;
+    if (pg->cma)
+        nr_free_cma += (1 << order);
     else
-        list_add_tail(&fa->list, &free_area[order]->list);
+        nr_free_pages += (1 << order);
 }
 
-void buddy_init()
+/**
+ * Set up mem_map of pfn [start, end) from memblock and put the usable pages
+ * on free lists. Pages of the range are not visible to anyone before.
+ */
+static void init_pages(uint32_t start, uint32_t end)
 {
-    Page *pg_iter = mem_map, \
-         *pg_end  = mem_map + gb_pgcnt;
+    uint32_t pfn, run;
+    uint64_t prev_end;
+    MemblockRegion *r;
+    int8_t order;
+
+    memset(pfn_to_page(start), 0, sizeof(Page) * (end - start));
+    for (pfn = MAX(start, cma_base); pfn < MIN(end, cma_base + cma_pgcnt); pfn++)
+        pfn_to_page(pfn)->cma = 1;
+
+    /* Holes between memory regions, then everything reserved */
+    prev_end = phys_mem_start;
+    for (uint32_t i = 0; i < memblock_memory.cnt; i++) {
+        r = &memblock_memory.regions[i];
+        reserve_pages(prev_end, r->base, start, end);
+        prev_end = r->base + r->size;
+    }
+    reserve_pages(prev_end, phys_mem_end, start, end);
+
+    for (uint32_t i = 0; i < memblock_reserved.cnt; i++) {
+        r = &memblock_reserved.regions[i];
+        reserve_pages(r->base, r->base + r->size, start, end);
+    }
+
+    while (buddy_lock);
+    buddy_lock = 1;
 
-    while (1)
+    for (pfn = start; pfn != end; )
     {
-        while (is_page_rsvd(pg_iter) && pg_iter != pg_end)
-            pg_iter++;
+        while (pfn != end && is_page_rsvd(pfn_to_page(pfn)))
+            pfn++;
 
-        if (pg_iter == pg_end)
-            break;
-        
-        Page *start_pg = pg_iter;
-        int32_t pg_cnt;
-        int8_t order;
-
-        while (!is_page_rsvd(pg_iter) && pg_iter != pg_end) {
-            pg_iter->order = PAGE_ORDER_BODY;
-            pg_iter->flags = PAGE_FLAG_BODY;
-            pg_iter++;
+        for (run = pfn; pfn != end && !is_page_rsvd(pfn_to_page(pfn)); pfn++) {
+            pfn_to_page(pfn)->order = PAGE_ORDER_BODY;
+            pfn_to_page(pfn)->flags = PAGE_FLAG_BODY;
         }
 
-        pg_cnt = ((uint64_t)pg_iter - (uint64_t)start_pg) / sizeof(Page);
-        while (pg_cnt)
+        /* Split [run, pfn) into blocks aligned to their order */
+        while (run != pfn)
         {
-            order = log_2(pg_cnt);
+            order = log_2(pfn - run);
             order = (order > PAGE_ORDER_MAX) ? PAGE_ORDER_MAX : order;
-            start_pg->order = order;
-            start_pg->flags = PAGE_FLAG_FREED;
-
-            FreeArea *fa = (void *)page_to_virt(start_pg);
-            add_fa(fa, order);
+            while (run & ((1 << order) - 1))
+                order--;
 
-            start_pg += (1 << order);
-            pg_cnt -= (1 << order);
+            add_fa(run, order);
+            run += (1 << order);
         }
+    }
 
-        if (pg_iter == pg_end)
-            break;
+    buddy_lock = 0;
+}
+
+/* Only the first part of memory is initialized here, see deferred_init() */
+void buddy_init()
+{
+    deferred_pfn = MIN(ALIGN(DEFERRED_INIT_FIRST >> PAGE_SHIFT, SECTION_PAGES), gb_pgcnt);
+    init_pages(0, deferred_pfn);
+
+    for (int i = 0; i < NR_CPUS; i++) {
+        pcp_pages[i].head = PFN_NONE;
+        pcp_pages[i].count = 0;
+    }
+
+    /* Free pages are not known before deferred init ends, use all but CMA */
+    wmark_low = MAX((gb_pgcnt - cma_pgcnt) >> WMARK_LOW_SHIFT, WMARK_MIN_PAGES);
+    wmark_high = MAX((gb_pgcnt - cma_pgcnt) >> WMARK_HIGH_SHIFT, WMARK_MIN_PAGES * 2);
+}
+
+/* Initialize the next section of mem_map, 0 if there is none */
+bool deferred_init_section()
+{
+    uint32_t start;
+
+    while (deferred_lock);
+    deferred_lock = 1;
+
+    if (deferred_pfn == gb_pgcnt) {
+        deferred_lock = 0;
+        return 0;
     }
+
+    start = deferred_pfn;
+    init_pages(start, MIN(start + SECTION_PAGES, gb_pgcnt));
+    deferred_pfn = MIN(start + SECTION_PAGES, gb_pgcnt);
+
+    deferred_lock = 0;
+    return 1;
+}
+
+/* Kernel thread started by kernel(), a section at a time */
+void deferred_init()
+{
+    uint64_t start_time = read_sysreg(cntpct_el0);
+    uint32_t start_pfn = deferred_pfn;
+
+    while (deferred_init_section())
+        schedule();
+
+    printf("deferred_init_time: %x (0x%x pages)\r\n",
+           read_sysreg(cntpct_el0) - start_time, gb_pgcnt - start_pfn);
 }
 
 int32_t buddy_inc_refcnt(void *chk)
@@ -154,261 +317,1795 @@ int32_t buddy_inc_refcnt(void *chk)
     return 0;
 }
 
-void* buddy_alloc(uint32_t req_pgcnt)
+/* Owners of an allocated block, a page mapped by fork is shared by refcnt */
+uint32_t buddy_refcnt(void *chk)
 {
-    #ifdef DEBUG_MM
-    printf("[DEBUG] Allocate from buddy\r\n");
-    #endif /* DEBUG_MM */
-
-    req_pgcnt = ceiling_2(req_pgcnt);
-    int32_t order = log_2(req_pgcnt);
-
-    if (order > PAGE_ORDER_MAX)
-        return NULL;
-
-    while (buddy_lock);
-    buddy_lock = 1;
+    Page *pg = virt_to_page(chk);
+    return pg->flags == PAGE_FLAG_ALLOC ? pg->refcnt : 0;
+}
 
+/* Take a block of the order from free lists, buddy_lock must be held */
+static uint32_t rmqueue(FreeArea *area, int32_t order)
+{
     int32_t curr_order = order;
     while (curr_order <= PAGE_ORDER_MAX && \
-           free_area[curr_order] == FREEAREA_UND)
+           area[curr_order].head == PFN_NONE)
         curr_order++;
     
     /* Out of memory */
     if (curr_order > PAGE_ORDER_MAX) {
         #ifdef DEBUG_MM
-        printf("[DEBUG] Out of memory with request page count 0x%x\r\n", req_pgcnt);
+        printf("[DEBUG] Out of memory with request order 0x%x\r\n", order);
         #endif /* DEBUG_MM */
-        buddy_lock = 0;
-        return NULL;
+        return PFN_NONE;
     }
 
-    void *ret = free_area[curr_order];
-    del_fa(free_area[curr_order], curr_order);
-
-    Page *pg = virt_to_page(ret);
+    uint32_t pfn = area[curr_order].head;
+    del_fa(pfn, curr_order);
     
-    /* Need to split buddy */
+    /* Need to split buddy, the upper half goes back to free list */
     while (order < curr_order)
     {
         #ifdef DEBUG_MM
         printf("[DEBUG] No buddy 0x%x, split from order 0x%x\r\n", curr_order-1, curr_order);
         #endif /* DEBUG_MM */
         curr_order--;
+        add_fa(pfn + (1 << curr_order), curr_order);
+    }
+
+    return pfn;
+}
+
+/* Put a block back and merge it with its buddies, buddy_lock must be held */
+static void free_one(uint32_t pfn, int8_t order)
+{
+    uint32_t buddy_pfn;
+    Page *pg;
+
+    /* Buddy of a block is the one whose pfn differs only in bit "order" */
+    while (order < PAGE_ORDER_MAX)
+    {
+        buddy_pfn = pfn ^ (1 << order);
+        if (buddy_pfn >= gb_pgcnt || !fa_test_bit(order, buddy_pfn))
+            break;
 
-        Page *next_pg = pg + (1 << curr_order);
-        next_pg->order = curr_order;
+        #ifdef DEBUG_MM
+        printf("[DEBUG] Consolidate with buddy 0x%x, order 0x%x --> 0x%x\r\n", buddy_pfn, order, order+1);
+        #endif /* DEBUG_MM */
+        del_fa(buddy_pfn, order);
 
-        FreeArea *fa = (void *)page_to_virt(next_pg);
-        LIST_INIT(fa->list);
-        add_fa(fa, next_pg->order);
+        /* The higher one becomes body of the merged block */
+        pg = pfn_to_page(pfn | (1 << order));
+        pg->order = PAGE_ORDER_BODY;
+        pg->flags = PAGE_FLAG_BODY;
+
+        pfn &= ~(1 << order);
+        order++;
     }
 
-    pg->order = order;
-    pg->flags = PAGE_FLAG_ALLOC;
-    pg->refcnt = 1;
-    #ifdef DEBUG_MM
-    printf("[DEBUG] Req order 0x%x, ret order 0x%x\r\n", order, curr_order);
-    #endif /* DEBUG_MM */
-    
-    buddy_lock = 0;
-    return ret;
+    add_fa(pfn, order);
 }
 
-int32_t buddy_free(void *chk)
+/**
+ * ============ call site accounting ============
+ * Pages keep the site in Page.site and slab objects in SlabCache.sites[],
+ * so that the free path needs no lookup. Sites are never removed.
+ */
+#define _RET_IP_ ((uint64_t)__builtin_return_address(0))
+
+static AllocSite alloc_sites[ALLOC_SITE_MAX];
+static bool site_lock = 0;
+
+static uint16_t site_add(uint64_t ip, uint32_t sz)
 {
-    #ifdef DEBUG_MM
-    printf("[DEBUG] Free to buddy\r\n");
-    #endif /* DEBUG_MM */
-    
-    while (buddy_lock);
-    buddy_lock = 1;
+    uint64_t flags;
+    uint32_t idx = (ip >> 2) % (ALLOC_SITE_MAX - 1) + 1;
+    AllocSite *site;
 
-    Page *pg = virt_to_page(chk);
-    if ((pg->order == PAGE_ORDER_UND || pg->flags == PAGE_FLAG_RSVD)  || /* reserved memory */
-        (pg->order == PAGE_ORDER_BODY || pg->flags == PAGE_FLAG_BODY) || /* body */
-         pg->flags == PAGE_FLAG_FREED /* head has been freed */)
-    {
-        buddy_lock = 0;
-        return -1;
+    local_irq_save(flags);
+    while (site_lock);
+    site_lock = 1;
+
+    for (int i = 1; i < ALLOC_SITE_MAX; i++) {
+        if (alloc_sites[idx].ip == ip || alloc_sites[idx].ip == 0)
+            break;
+        idx = (idx == ALLOC_SITE_MAX - 1) ? 1 : idx + 1;
     }
 
-    pg->refcnt--;
-    if (pg->refcnt) {
-        buddy_lock = 0;
+    site = &alloc_sites[idx];
+    if (site->ip != ip && site->ip != 0) {
+        /* Table is full, leave it untracked */
+        site_lock = 0;
+        local_irq_restore(flags);
         return 0;
     }
 
-    Page *merged_chk;
-    /* Consolidate right */
-    while (pg->order < PAGE_ORDER_MAX)
-    {
-        merged_chk = pg + (1 << pg->order);
-        if (merged_chk->order != pg->order ||
-            merged_chk->flags != PAGE_FLAG_FREED)
-            break;
-        
-        #ifdef DEBUG_MM
-        printf("[DEBUG] Consolidate with right buddy 0x%x, order 0x%x --> 0x%x\r\n", pg->order, pg->order+1);
-        #endif /* DEBUG_MM */
-        del_fa((FreeArea *)page_to_virt(merged_chk), pg->order);
+    site->ip = ip;
+    site->live += sz;
+    site->nr_allocs++;
+    if (site->live > site->peak)
+        site->peak = site->live;
 
-        merged_chk->order = PAGE_ORDER_BODY;
-        merged_chk->flags = PAGE_FLAG_BODY;
-        pg->order++;
-    }
+    site_lock = 0;
+    local_irq_restore(flags);
+    return idx;
+}
 
-    uint8_t curr_order = pg->order;
-    Page *prev_merged_chk = pg;
-    /* Consolidate left */
-    while (curr_order < PAGE_ORDER_MAX)
-    {
-        merged_chk = pg - (1 << curr_order);
-        if (merged_chk->order != curr_order ||
-            merged_chk->flags != PAGE_FLAG_FREED)
-            break;
+static void site_sub(uint16_t idx, uint32_t sz)
+{
+    uint64_t flags;
 
-        #ifdef DEBUG_MM
-            printf("[DEBUG] Consolidate with left buddy, order 0x%x --> 0x%x\r\n", pg->order, pg->order+1);
-        #endif /* DEBUG_MM */
-        del_fa((FreeArea *)page_to_virt(merged_chk), curr_order);
+    if (idx == 0)
+        return;
 
-        prev_merged_chk->order = PAGE_ORDER_BODY;
-        prev_merged_chk->flags = PAGE_FLAG_BODY;
-        merged_chk->order++;
+    local_irq_save(flags);
+    while (site_lock);
+    site_lock = 1;
 
-        prev_merged_chk = merged_chk;
-        curr_order++;
-    }
+    alloc_sites[idx].live -= sz;
+    alloc_sites[idx].nr_frees++;
 
-    prev_merged_chk->flags = PAGE_FLAG_FREED;
-    add_fa((FreeArea *)page_to_virt(prev_merged_chk), curr_order);
+    site_lock = 0;
+    local_irq_restore(flags);
+}
 
-    buddy_lock = 0;
-    return 0;
+static inline SlabCache *slab_owner(void *chk)
+{
+    Page *pg = virt_to_page(chk);
+    if (!pg->slab)
+        return NULL;
+
+    return (SlabCache *)page_to_virt(pg - pg->slab_off);
 }
 
-SlabCache* slab_cache_new(uint32_t sz)
+/* Tag of a slab object or the head page of a buddy block */
+static uint16_t *site_of(void *chk)
 {
-    #define SLAB_PER_PAGECNT 64
-    
-    SlabCache *new_cache = buddy_alloc(SLAB_PER_PAGECNT);
-    new_cache->size = sz;
-    new_cache->start = (uint64_t)new_cache + sizeof(SlabCache);
-    new_cache->end = (uint64_t)new_cache + (SLAB_PER_PAGECNT * PAGE_SIZE);
-                        
-    LIST_INIT(new_cache->slab.list);
-    LIST_INIT(new_cache->cache_list);
-    new_cache->end -= (SLAB_PER_PAGECNT * PAGE_SIZE - sizeof(SlabCache)) % new_cache->size;
+    SlabCache *owner;
 
-    Slab *slab_chk = (Slab *)(new_cache + 1);
-    while ((uint64_t)slab_chk < new_cache->end)
-    {
-        LIST_INIT(slab_chk->list);
-        list_add_tail(&slab_chk->list, &new_cache->slab.list);
-        slab_chk = (Slab *)((char *)slab_chk + sz);
+    if ((owner = slab_owner(chk)) != NULL)
+        return &owner->sites[((uint64_t)chk - owner->start) / owner->size];
+
+    return &virt_to_page(chk)->site;
+}
+
+static inline void site_tag(void *chk, uint64_t ip)
+{
+    if (chk != NULL)
+        *site_of(chk) = site_add(ip, ksize(chk));
+}
+
+static inline void site_untag(void *chk)
+{
+    uint16_t *tag = site_of(chk);
+
+    site_sub(*tag, ksize(chk));
+    *tag = 0;
+}
+
+/* Charge a chunk from an inner allocator to the outer caller */
+static void *site_retag(void *chk, uint64_t ip)
+{
+    if (chk != NULL && !is_vmalloc_addr(chk)) {
+        site_untag(chk);
+        site_tag(chk, ip);
     }
 
-    return new_cache;
+    return chk;
 }
 
-void slab_init()
+static inline bool irqs_disabled()
 {
-    for (int i = 0; i < SLAB_POOL_SIZE; i++)
-        slab_cache_ptr[i] = slab_cache_new(slab_size_pool[i]);
+    uint64_t daif;
+    __asm__ volatile("mrs %0, daif" : "=r"(daif));
+    return (daif & DAIF_IRQ_BIT) != 0;
 }
 
-void *slab_alloc(uint32_t sz)
+/* With IRQ masked the holder may be the task we interrupted, so fail instead */
+static void* __buddy_alloc(int32_t order)
 {
-    while (slab_lock);
-    slab_lock = 1;
+    #ifdef DEBUG_MM
+    printf("[DEBUG] Allocate from buddy\r\n");
+    #endif /* DEBUG_MM */
 
-    for (int i = 0; i < SLAB_POOL_SIZE; i++) {
-        if (slab_size_pool[i] >= sz) {
-            SlabCache *curr_cache = slab_cache_ptr[i];
-            Slab *next_slab;
-
-            while (1)
-            {
-                next_slab = container_of(curr_cache->slab.list.next, Slab, list);
-                if (next_slab != &curr_cache->slab) {
-                    list_del(&next_slab->list);
-                    goto slab_alloc_ok;
-                }
-                
-                curr_cache = container_of(curr_cache->cache_list.next, SlabCache, cache_list);
-                if (curr_cache == slab_cache_ptr[i])
-                    break;
-            }
-
-            #ifdef DEBUG_MM
-            printf("[DEBUG] Create new slab cache\r\n");
-            #endif /* DEBUG_MM */
-            SlabCache *new_cache = slab_cache_new(slab_size_pool[i]);
-            list_add_tail(&new_cache->cache_list, &slab_cache_ptr[i]->cache_list);
-
-            next_slab = container_of(new_cache->slab.list.next, Slab, list);
-            list_del(&next_slab->list);
-
-        slab_alloc_ok:
-            #ifdef DEBUG_MM
-            printf("[DEBUG] Allocate from slab_cache with slab size 0x%x\r\n", slab_size_pool[i]);
-            #endif /* DEBUG_MM */
-            
-            slab_lock = 0;
-            return next_slab;
-        }
+    if (buddy_lock && irqs_disabled())
+        return NULL;
+    while (buddy_lock);
+    buddy_lock = 1;
+
+    uint32_t pfn = rmqueue(free_area, order);
+    if (pfn == PFN_NONE) {
+        buddy_lock = 0;
+        return NULL;
     }
+
+    Page *pg = pfn_to_page(pfn);
+    pg->order = order;
+    pg->flags = PAGE_FLAG_ALLOC;
+    pg->refcnt = 1;
+    pg->rmap = 0;
+    pg->site = 0;
     
-    slab_lock = 0;
-    return NULL;
+    buddy_lock = 0;
+    return (void *)pfn_to_virt(pfn);
 }
 
-int32_t slab_free(void *chk)
+/**
+ * ============ per-cpu pages ============
+ * Order-0 pages are cached per cpu and only touched with IRQ masked, so
+ * they need no lock. buddy_lock is only try-locked with IRQ masked, since
+ * the holder may be the task we interrupted. The same goes for allocations
+ * falling back to __buddy_alloc() with IRQ masked.
+ */
+static void pcp_refill(PerCpuPages *pcp)
 {
-    while (slab_lock);
-    slab_lock = 1;
+    uint32_t pfn;
 
-    for (int i = 0; i < SLAB_POOL_SIZE; i++) {
-        SlabCache *curr_cache = slab_cache_ptr[i];
+    if (buddy_lock)
+        return;
+    buddy_lock = 1;
 
-        while (1)
-        {
-            if ((uint64_t)chk >= curr_cache->start && (uint64_t)chk < curr_cache->end) {
-                Slab *tmp_slab = chk;
-                list_add_tail(&tmp_slab->list, &curr_cache->slab.list);
+    for (int i = 0; i < PCP_BATCH; i++) {
+        if ((pfn = rmqueue(free_area, 0)) == PFN_NONE)
+            break;
 
-                #ifdef DEBUG_MM
-                printf("[DEBUG] Free to 0x%x slab\r\n", slab_size_pool[i]);
-                #endif /* DEBUG_MM */
-                slab_lock = 0;
-                return 0;
-            }
-            
-            curr_cache = container_of(curr_cache->cache_list.next, SlabCache, cache_list);
-            if (curr_cache == slab_cache_ptr[i])
-                break;
-        }
+        pfn_to_page(pfn)->next = pcp->head;
+        pcp->head = pfn;
+        pcp->count++;
     }
 
-    slab_lock = 0;
-    return -1;
+    buddy_lock = 0;
 }
 
-void* kmalloc(uint32_t sz)
+/* Give back the coldest ones, which are at the tail of the list */
+static uint32_t pcp_drain(PerCpuPages *pcp, uint32_t nr)
 {
-    void *ret;
-    if ((ret = slab_alloc(sz)) != NULL)
-        return ret;
+    uint32_t pfn, keep, freed = 0;
+
+    if (buddy_lock || pcp->count == 0)
+        return 0;
+    buddy_lock = 1;
+
+    nr = MIN(nr, pcp->count);
+    keep = pcp->count - nr;
+
+    if (keep == 0) {
+        pfn = pcp->head;
+        pcp->head = PFN_NONE;
+    } else {
+        Page *last = pfn_to_page(pcp->head);
+        for (int i = 1; i < keep; i++)
+            last = pfn_to_page(last->next);
+        pfn = last->next;
+        last->next = PFN_NONE;
+    }
+
+    while (pfn != PFN_NONE) {
+        uint32_t next = pfn_to_page(pfn)->next;
+        free_one(pfn, 0);
+        pfn = next;
+        freed++;
+    }
+    pcp->count = keep;
 
-    uint32_t pg_cnt = (sz + PAGE_SIZE - 1) >> PAGE_SHIFT;
-    return buddy_alloc(pg_cnt);
+    buddy_lock = 0;
+    return freed;
 }
 
-int32_t kfree(void *chk)
+static void* pcp_alloc()
+{
+    uint64_t flags;
+    PerCpuPages *pcp;
+    Page *pg = NULL;
+
+    local_irq_save(flags);
+    pcp = &pcp_pages[smp_processor_id()];
+
+    if (pcp->count == 0)
+        pcp_refill(pcp);
+
+    if (pcp->count != 0) {
+        pg = pfn_to_page(pcp->head);
+        pcp->head = pg->next;
+        pcp->count--;
+
+        pg->order = 0;
+        pg->flags = PAGE_FLAG_ALLOC;
+        pg->refcnt = 1;
+        pg->rmap = 0;
+        pg->site = 0;
+    }
+    local_irq_restore(flags);
+
+    return pg ? (void *)page_to_virt(pg) : NULL;
+}
+
+static int32_t pcp_free(Page *pg)
 {
-    if (slab_free(chk) == 0)
+    uint64_t flags;
+    PerCpuPages *pcp;
+
+    local_irq_save(flags);
+    if (pg->flags != PAGE_FLAG_ALLOC || pg->order != 0) {
+        local_irq_restore(flags);
+        return -1;
+    }
+
+    if (--pg->refcnt) {
+        local_irq_restore(flags);
         return 0;
+    }
 
-    return buddy_free(chk);
+    site_sub(pg->site, PAGE_SIZE);
+
+    /* Freed flag keeps buddy_inc_refcnt() and double free away */
+    pg->flags = PAGE_FLAG_FREED;
+    pcp = &pcp_pages[smp_processor_id()];
+    pg->next = pcp->head;
+    pcp->head = page_to_pfn(pg);
+    pcp->count++;
+
+    if (pcp->count > PCP_HIGH)
+        pcp_drain(pcp, PCP_BATCH);
+    local_irq_restore(flags);
+
+    return 0;
+}
+
+static void* alloc_pages(uint32_t req_pgcnt)
+{
+    req_pgcnt = ceiling_2(req_pgcnt);
+    int32_t order = log_2(req_pgcnt);
+    void *ret = NULL;
+
+    if (order > PAGE_ORDER_MAX)
+        return NULL;
+
+    if (order == 0)
+        ret = pcp_alloc();
+
+    if (ret == NULL)
+        ret = __buddy_alloc(order);
+
+    /* Memory left to deferred_init() is cheaper than anything below */
+    while (ret == NULL && !irqs_disabled() && deferred_init_section())
+        ret = __buddy_alloc(order);
+
+    /* High order requests fail on fragmentation, move pages to make a block */
+    if (ret == NULL && order > 0 && !irqs_disabled() && compact_memory(order) >= 0)
+        ret = __buddy_alloc(order);
+
+    /**
+     * Reclaim directly instead of failing. Shrinkers may spin on locks
+     * which are released only after rescheduling, so skip it if IRQ is off.
+     */
+    if (ret == NULL && !irqs_disabled()) {
+        shrink_memory(MAX(wmark_high - MIN(nr_free_pages, wmark_high), req_pgcnt));
+        ret = __buddy_alloc(order);
+    }
+
+    if (nr_free_pages < wmark_low && kswapd_task != NULL)
+        thread_wake(kswapd_task);
+
+    return ret;
+}
+
+void* buddy_alloc(uint32_t req_pgcnt)
+{
+    void *ret = alloc_pages(req_pgcnt);
+
+    site_tag(ret, _RET_IP_);
+    return ret;
+}
+
+int32_t buddy_free(void *chk)
+{
+    #ifdef DEBUG_MM
+    printf("[DEBUG] Free to buddy\r\n");
+    #endif /* DEBUG_MM */
+
+    Page *pg = virt_to_page(chk);
+    if (pg->order == 0 && pg->flags == PAGE_FLAG_ALLOC && !pg->cma)
+        return pcp_free(pg);
+    
+    while (buddy_lock);
+    buddy_lock = 1;
+
+    if ((pg->order == PAGE_ORDER_UND || pg->flags == PAGE_FLAG_RSVD)  || /* reserved memory */
+        (pg->order == PAGE_ORDER_BODY || pg->flags == PAGE_FLAG_BODY) || /* body */
+         pg->flags == PAGE_FLAG_FREED /* head has been freed */)
+    {
+        buddy_lock = 0;
+        return -1;
+    }
+
+    pg->refcnt--;
+    if (pg->refcnt) {
+        buddy_lock = 0;
+        return 0;
+    }
+
+    site_sub(pg->site, PAGE_SIZE << pg->order);
+    free_one(page_to_pfn(pg), pg->order);
+
+    buddy_lock = 0;
+    return 0;
+}
+
+/* Grow an allocated block in place by absorbing the free buddies above it */
+static bool buddy_extend(void *chk, uint32_t new_sz)
+{
+    Page *pg = virt_to_page(chk);
+    uint32_t pfn = page_to_pfn(pg);
+    int8_t order, new_order = log_2(ceiling_2((new_sz + PAGE_SIZE - 1) >> PAGE_SHIFT));
+    bool ret = 0;
+
+    while (buddy_lock);
+    buddy_lock = 1;
+
+    if (pg->flags != PAGE_FLAG_ALLOC || pg->refcnt != 1 ||
+        new_order > PAGE_ORDER_MAX || (pfn & ((1 << new_order) - 1)))
+        goto out;
+
+    /* Each buddy on the way up has to be free as a whole */
+    for (order = pg->order; order < new_order; order++)
+        if (pfn + (1 << order) >= gb_pgcnt || !fa_test_bit(order, pfn + (1 << order)))
+            goto out;
+
+    for (order = pg->order; order < new_order; order++) {
+        del_fa(pfn + (1 << order), order);
+        pfn_to_page(pfn + (1 << order))->order = PAGE_ORDER_BODY;
+        pfn_to_page(pfn + (1 << order))->flags = PAGE_FLAG_BODY;
+    }
+    pg->order = new_order;
+    ret = 1;
+
+out:
+    buddy_lock = 0;
+    return ret;
+}
+
+/**
+ * ============ zeroed pages ============
+ * idle() clears pages ahead of time, so the fault and page table paths
+ * do not clear them on demand. The pool is only touched with IRQ masked.
+ */
+void *zero_page;
+static uint32_t zero_pool_head = PFN_NONE;
+static uint32_t zero_pool_count = 0;
+static bool zero_lock = 0;
+
+/* Page is aligned, clear it by double words instead of bytes */
+static inline void clear_page(void *page)
+{
+    uint64_t *p = page;
+
+    for (int i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 4) {
+        p[i] = 0;
+        p[i+1] = 0;
+        p[i+2] = 0;
+        p[i+3] = 0;
+    }
+}
+
+static Page *zero_pool_pop()
+{
+    uint64_t flags;
+    Page *pg = NULL;
+
+    local_irq_save(flags);
+    while (zero_lock);
+    zero_lock = 1;
+
+    if (zero_pool_count != 0) {
+        pg = pfn_to_page(zero_pool_head);
+        zero_pool_head = pg->next;
+        zero_pool_count--;
+        pg->rmap = 0;
+        pg->site = 0;
+    }
+
+    zero_lock = 0;
+    local_irq_restore(flags);
+    return pg;
+}
+
+static void *__get_zeroed_page()
+{
+    Page *pg = zero_pool_pop();
+    if (pg != NULL)
+        return (void *)page_to_virt(pg);
+
+    void *page = alloc_pages(1);
+    if (page != NULL)
+        clear_page(page);
+
+    return page;
+}
+
+void *get_zeroed_page()
+{
+    void *page = __get_zeroed_page();
+
+    site_tag(page, _RET_IP_);
+    return page;
+}
+
+/* Called by idle(), a batch at a time so that it yields soon */
+void zero_pool_fill()
+{
+    uint64_t flags;
+    void *page;
+    Page *pg;
+
+    for (int i = 0; i < ZERO_POOL_BATCH; i++) {
+        if (zero_pool_count >= ZERO_POOL_HIGH || nr_free_pages < wmark_high)
+            break;
+
+        if ((page = alloc_pages(1)) == NULL)
+            break;
+        clear_page(page);
+        pg = virt_to_page(page);
+
+        local_irq_save(flags);
+        while (zero_lock);
+        zero_lock = 1;
+
+        pg->next = zero_pool_head;
+        zero_pool_head = page_to_pfn(pg);
+        zero_pool_count++;
+
+        zero_lock = 0;
+        local_irq_restore(flags);
+    }
+}
+
+static uint64_t zero_pool_shrink(uint64_t nr_to_scan)
+{
+    uint64_t freed = 0;
+    Page *pg;
+
+    while (freed < nr_to_scan && (pg = zero_pool_pop()) != NULL) {
+        buddy_free((void *)page_to_virt(pg));
+        freed++;
+    }
+
+    return freed;
+}
+
+static Shrinker zero_pool_shrinker = {
+    .name = "zero",
+    .scan = zero_pool_shrink,
+};
+
+void zero_page_init()
+{
+    /* Shared by read faults on anonymous memory, reserved so it is never freed */
+    zero_page = buddy_alloc(1);
+    clear_page(zero_page);
+    virt_to_page(zero_page)->flags = PAGE_FLAG_RSVD;
+
+    register_shrinker(&zero_pool_shrinker);
+}
+
+/**
+ * ============ reverse map ============
+ * Each mapped page keeps the entries which map it, so that it can be moved
+ * by rewriting them. The list head is a physical address in Page.rmap, a
+ * page whose mappings are not all listed is never moved.
+ */
+static KmemCache *rmap_cachep;
+static bool rmap_lock = 0;
+
+#define page_rmap(pg) ((pg)->rmap ? (Rmap *)phys_to_virt((pg)->rmap) : NULL)
+
+void rmap_cache_init()
+{
+    rmap_cachep = kmem_cache_create("rmap", sizeof(Rmap), 0, NULL);
+}
+
+void rmap_add(void *page, uint64_t *pte, uint64_t va)
+{
+    Page *pg = virt_to_page(page);
+    Rmap *rmap = kmem_cache_alloc(rmap_cachep);
+    if (rmap == NULL)
+        return;
+
+    rmap->pte = pte;
+    rmap->va = va;
+
+    while (rmap_lock);
+    rmap_lock = 1;
+    rmap->next = page_rmap(pg);
+    pg->rmap = virt_to_phys(rmap);
+    rmap_lock = 0;
+}
+
+void rmap_del(void *page, uint64_t *pte)
+{
+    Page *pg = virt_to_page(page);
+    Rmap *rmap, *prev = NULL;
+
+    while (rmap_lock);
+    rmap_lock = 1;
+
+    for (rmap = page_rmap(pg); rmap != NULL; prev = rmap, rmap = rmap->next) {
+        if (rmap->pte != pte)
+            continue;
+
+        if (prev == NULL)
+            pg->rmap = rmap->next ? virt_to_phys(rmap->next) : 0;
+        else
+            prev->next = rmap->next;
+        break;
+    }
+
+    rmap_lock = 0;
+
+    if (rmap != NULL)
+        kmem_cache_free(rmap_cachep, rmap);
+}
+
+/* Every reference of the page comes from a listed mapping */
+static bool page_movable(Page *pg)
+{
+    uint32_t cnt = 0;
+
+    if (pg->flags != PAGE_FLAG_ALLOC || pg->order != 0 || pg->slab || !pg->rmap)
+        return 0;
+
+    for (Rmap *rmap = page_rmap(pg); rmap != NULL; rmap = rmap->next)
+        cnt++;
+
+    return cnt == pg->refcnt;
+}
+
+/**
+ * ============ page migration ============
+ * buddy_lock and rmap_lock must be held and IRQ masked, so that nobody
+ * touches a page while it is copied. migrate_lock() does all three.
+ */
+
+#define migrate_lock(flags) do { \
+    local_irq_save(flags);         \
+    while (rmap_lock);             \
+    rmap_lock = 1;                 \
+    while (buddy_lock);            \
+    buddy_lock = 1;                \
+} while (0)
+
+#define migrate_unlock(flags) do { \
+    buddy_lock = 0;                  \
+    rmap_lock = 0;                   \
+    local_irq_restore(flags);        \
+} while (0)
+
+/* Find the free block which covers pfn, its order is returned by *order */
+static uint32_t free_block_of(uint32_t pfn, int8_t *order)
+{
+    uint32_t head;
+
+    for (int8_t i = 0; i <= PAGE_ORDER_MAX; i++) {
+        head = pfn & ~((1 << i) - 1);
+        if (fa_test_bit(i, head) && pfn_to_page(head)->order == i) {
+            *order = i;
+            return head;
+        }
+    }
+
+    return PFN_NONE;
+}
+
+/* Copy the page to a free one from area, normal memory if area runs out */
+static int32_t migrate_page(uint32_t pfn, FreeArea *area)
+{
+    Page *pg = pfn_to_page(pfn), *new_pg;
+    uint32_t new_pfn;
+    bool exec = 0;
+
+    new_pfn = rmqueue(area, 0);
+    if (new_pfn == PFN_NONE && area != free_area)
+        new_pfn = rmqueue(free_area, 0);
+    if (new_pfn == PFN_NONE)
+        return -1;
+
+    memcpy((void *)pfn_to_virt(new_pfn), (void *)pfn_to_virt(pfn), PAGE_SIZE);
+
+    new_pg = pfn_to_page(new_pfn);
+    new_pg->order = 0;
+    new_pg->flags = PAGE_FLAG_ALLOC;
+    new_pg->refcnt = pg->refcnt;
+    new_pg->rmap = pg->rmap;
+    new_pg->site = pg->site;
+
+    /* Code moved by data stores has to reach instruction fetch before it runs */
+    for (Rmap *rmap = page_rmap(pg); rmap != NULL; rmap = rmap->next)
+        exec |= !(*rmap->pte & PTE_UXN);
+    if (exec)
+        sync_icache_range((void *)pfn_to_virt(new_pfn), PAGE_SIZE);
+
+    for (Rmap *rmap = page_rmap(pg); rmap != NULL; rmap = rmap->next) {
+        *rmap->pte = pfn_to_phys(new_pfn) | (*rmap->pte & ATTR_MASK);
+        flush_tlb_page(rmap->va);
+    }
+
+    pg->refcnt = 0;
+    pg->rmap = 0;
+    return 0;
+}
+
+/**
+ * Pull [start, end) out of the buddy system. Free blocks are split around
+ * the range before anything is migrated, so that no page is moved into it.
+ * Pulled pages are left allocated with refcnt 0.
+ */
+static int32_t isolate_range(uint32_t start, uint32_t end, FreeArea *area, uint32_t *moved)
+{
+    uint32_t pfn = start, head, p;
+    int8_t order;
+    Page *pg;
+
+    while (pfn < end)
+    {
+        if (page_movable(pfn_to_page(pfn))) {
+            pfn++;
+            continue;
+        }
+
+        if ((head = free_block_of(pfn, &order)) == PFN_NONE)
+            goto undo;
+
+        /* Pages of the block outside the range go back one by one */
+        del_fa(head, order);
+        for (p = head; p < start; p++)
+            free_one(p, 0);
+        for (p = end; p < head + (1 << order); p++)
+            free_one(p, 0);
+
+        for (p = MAX(head, start); p < MIN(head + (1 << order), end); p++) {
+            pg = pfn_to_page(p);
+            pg->order = 0;
+            pg->flags = PAGE_FLAG_ALLOC;
+            pg->refcnt = 0;
+        }
+        pfn = MIN(head + (1 << order), end);
+    }
+
+    for (pfn = start; pfn < end; pfn++) {
+        if (pfn_to_page(pfn)->refcnt == 0)
+            continue;
+        if (migrate_page(pfn, area) != 0)
+            goto undo;
+        (*moved)++;
+    }
+
+    return 0;
+
+undo:
+    for (p = start; p < end; p++) {
+        pg = pfn_to_page(p);
+        if (pg->flags == PAGE_FLAG_ALLOC && pg->order == 0 && pg->refcnt == 0)
+            free_one(p, 0);
+    }
+
+    return -1;
+}
+
+/* Movable pages in the block, or -1 if some page of it cannot be moved */
+static int32_t block_movable(uint32_t start, int32_t order)
+{
+    uint32_t pfn = start, end = start + (1 << order);
+    int32_t cnt = 0;
+    Page *pg;
+
+    while (pfn < end) {
+        pg = pfn_to_page(pfn);
+        if (pg->flags == PAGE_FLAG_FREED && pg->order <= PAGE_ORDER_MAX &&
+            fa_test_bit(pg->order, pfn)) {
+            pfn += (1 << pg->order);
+        } else if (page_movable(pg)) {
+            cnt++;
+            pfn++;
+        } else {
+            return -1;
+        }
+    }
+
+    return cnt;
+}
+
+/**
+ * Make a free block of the order by moving the pages out of the block which
+ * needs the fewest moves. Returns how many pages are moved, or -1.
+ */
+int32_t compact_memory(int32_t order)
+{
+    uint64_t flags;
+    uint32_t best = PFN_NONE, moved = 0;
+    int32_t cnt, best_cnt = (1 << order) + 1;
+    int32_t ret = -1;
+    #ifdef DEBUG_MM
+    uint64_t start_time = read_sysreg(cntpct_el0);
+    #endif /* DEBUG_MM */
+
+    /* Cached pages would pin the blocks they are in */
+    local_irq_save(flags);
+    pcp_drain(&pcp_pages[smp_processor_id()], PCP_HIGH);
+    local_irq_restore(flags);
+
+    /* Only a hint, IRQ handlers may use per-cpu pages meanwhile */
+    for (uint32_t pfn = 0; pfn + (1 << order) <= deferred_pfn && best_cnt; pfn += (1 << order)) {
+        if (pfn >= cma_base && pfn < cma_base + cma_pgcnt)
+            continue;
+
+        /* Locks are taken per block, so IRQ is not masked for the whole scan */
+        migrate_lock(flags);
+        cnt = block_movable(pfn, order);
+        migrate_unlock(flags);
+        if (cnt >= 0 && cnt < best_cnt) {
+            best = pfn;
+            best_cnt = cnt;
+        }
+    }
+
+    if (best != PFN_NONE) {
+        migrate_lock(flags);
+        /* Borrowing CMA keeps the normal memory for unmovable pages */
+        if (block_movable(best, order) >= 0 &&
+            isolate_range(best, best + (1 << order), cma_area, &moved) == 0) {
+            for (uint32_t pfn = best; pfn < best + (1 << order); pfn++)
+                free_one(pfn, 0);
+            ret = moved;
+        }
+        migrate_unlock(flags);
+    }
+
+    #ifdef DEBUG_MM
+    printf("[DEBUG] Compaction order 0x%x, moved 0x%x pages in %d us\r\n", order, moved,
+           (read_sysreg(cntpct_el0) - start_time) * 1000000 / read_sysreg(cntfrq_el0));
+    #endif /* DEBUG_MM */
+    return ret;
+}
+
+/**
+ * ============ anonymous page reclaim ============
+ * Second chance clock over mapped pages. Cortex-a53 does not set the access
+ * flag by itself, so a pass clears it and the next access faults to set it
+ * again (see do_page_fault()). Pages found without it go to swap.
+ */
+static uint32_t clock_hand;
+
+/* Test and clear the access flag of the entries which map the page */
+static bool page_referenced(Page *pg)
+{
+    bool ret = 0;
+
+    for (Rmap *rmap = page_rmap(pg); rmap != NULL; rmap = rmap->next) {
+        if (*rmap->pte & AF_ACCESS) {
+            *rmap->pte &= ~AF_ACCESS;
+            flush_tlb_page(rmap->va);
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
+
+/* Point the entries of the page to its slot, the detached Rmaps are returned */
+static Rmap *unmap_to_swap(Page *pg, uint64_t entry)
+{
+    Rmap *head = page_rmap(pg);
+
+    for (Rmap *rmap = head; rmap != NULL; rmap = rmap->next) {
+        *rmap->pte = entry;
+        flush_tlb_page(rmap->va);
+    }
+
+    pg->rmap = 0;
+    pg->refcnt = 1;
+    return head;
+}
+
+/* Page is mapped by the same entries and none has accessed it since the last check */
+static inline bool page_unchanged(Page *pg, uint32_t rmap, uint32_t cnt)
+{
+    return page_movable(pg) && pg->rmap == rmap && pg->refcnt == cnt && !page_referenced(pg);
+}
+
+/* Swap out up to nr_to_scan pages, at most two turns of the clock */
+uint64_t shrink_anon(uint64_t nr_to_scan)
+{
+    uint64_t flags, entry, freed = 0;
+    uint32_t head, cnt;
+    Rmap *rmap, *next;
+    Page *pg;
+
+    for (uint32_t scan = 0; scan < deferred_pfn * 2 && freed < nr_to_scan; scan++)
+    {
+        clock_hand = (clock_hand + 1 < deferred_pfn) ? clock_hand + 1 : 0;
+        pg = pfn_to_page(clock_hand);
+
+        /* Peek without the lock, most pages are not mapped by users */
+        if (pg->flags != PAGE_FLAG_ALLOC || !pg->rmap)
+            continue;
+
+        while (rmap_lock);
+        rmap_lock = 1;
+        local_irq_save(flags);
+
+        head = cnt = 0;
+        if (page_movable(pg) && !page_referenced(pg)) {
+            head = pg->rmap;
+            cnt = pg->refcnt;
+        }
+
+        local_irq_restore(flags);
+        rmap_lock = 0;
+
+        if (cnt == 0)
+            continue;
+
+        /**
+         * Write with IRQ on and no lock held. The access flag of the entries
+         * is clear now, so an owner touching the page meanwhile sets it again.
+         */
+        if ((entry = swap_out((void *)page_to_virt(pg), cnt)) == 0)
+            break; /* Swap is full */
+
+        /* Owners must not run before their entries point to the written slot */
+        while (rmap_lock);
+        rmap_lock = 1;
+        local_irq_save(flags);
+
+        rmap = NULL;
+        if (page_unchanged(pg, head, cnt))
+            rmap = unmap_to_swap(pg, entry);
+
+        local_irq_restore(flags);
+        rmap_lock = 0;
+
+        /* The slot holds stale data, drop every reference it was given */
+        if (rmap == NULL) {
+            for (uint32_t i = 0; i < cnt; i++)
+                swap_free(entry);
+            continue;
+        }
+
+        for (; rmap != NULL; rmap = next) {
+            next = rmap->next;
+            kmem_cache_free(rmap_cachep, rmap);
+        }
+        buddy_free((void *)page_to_virt(pg));
+        freed++;
+    }
+
+    return freed;
+}
+
+/**
+ * ============ contiguous memory allocator ============
+ * Free pages of the region are only handed to movable pages. cma_alloc()
+ * takes a range back by migrating them out.
+ */
+static Page *cma_borrow()
+{
+    uint32_t pfn;
+    Page *pg = NULL;
+
+    while (buddy_lock);
+    buddy_lock = 1;
+
+    if ((pfn = rmqueue(cma_area, 0)) != PFN_NONE) {
+        pg = pfn_to_page(pfn);
+        pg->order = 0;
+        pg->flags = PAGE_FLAG_ALLOC;
+        pg->refcnt = 1;
+        pg->rmap = 0;
+        pg->site = 0;
+    }
+
+    buddy_lock = 0;
+    return pg;
+}
+
+/* Page for user mappings, it may come from the CMA region */
+void *alloc_movable_page(bool zero)
+{
+    void *page;
+    Page *pg = NULL;
+
+    /* Prefer CMA once it holds most of free memory, like Linux does */
+    if (nr_free_cma > nr_free_pages || nr_free_pages < wmark_low)
+        pg = cma_borrow();
+
+    if (pg == NULL) {
+        page = zero ? __get_zeroed_page() : alloc_pages(1);
+    } else {
+        page = (void *)page_to_virt(pg);
+        if (zero)
+            clear_page(page);
+    }
+
+    site_tag(page, _RET_IP_);
+    return page;
+}
+
+/**
+ * Block for a 2MB mapping, only taken when one is free and memory is not
+ * short. It is neither swapped nor migrated until split_huge_page().
+ */
+void *alloc_huge_page(bool zero)
+{
+    void *page;
+
+    if (nr_free_pages < wmark_high + (1 << HPAGE_ORDER) ||
+        (page = __buddy_alloc(HPAGE_ORDER)) == NULL)
+        return NULL;
+
+    if (zero)
+        for (int i = 0; i < (1 << HPAGE_ORDER); i++)
+            clear_page((char *)page + i * PAGE_SIZE);
+
+    site_tag(page, _RET_IP_);
+    return page;
+}
+
+/* Turn an allocated block into order 0 pages, each one owned like the block */
+void split_huge_page(void *chk)
+{
+    Page *pg = virt_to_page(chk), *body;
+    uint32_t pfn = page_to_pfn(pg);
+
+    while (buddy_lock);
+    buddy_lock = 1;
+
+    for (uint32_t i = 1; i < (1 << pg->order); i++) {
+        body = pfn_to_page(pfn + i);
+        body->order = 0;
+        body->flags = PAGE_FLAG_ALLOC;
+        body->refcnt = pg->refcnt;
+        body->rmap = 0;
+        body->site = pg->site;
+    }
+    pg->order = 0;
+
+    buddy_lock = 0;
+}
+
+static inline bool cma_test_bit(uint32_t idx)
+{
+    return (cma_bitmap[idx >> 6] >> (idx & 63)) & 1;
+}
+
+static inline void cma_assign_bit(uint32_t idx, bool val)
+{
+    if (val)
+        cma_bitmap[idx >> 6] |= (1UL << (idx & 63));
+    else
+        cma_bitmap[idx >> 6] &= ~(1UL << (idx & 63));
+}
+
+static int32_t cma_isolate(uint32_t start, uint32_t end)
+{
+    uint64_t flags;
+    uint32_t moved = 0;
+    int32_t ret;
+    Page *pg;
+
+    while (rmap_lock);
+    rmap_lock = 1;
+    while (buddy_lock);
+    buddy_lock = 1;
+    local_irq_save(flags);
+
+    if ((ret = isolate_range(start, end, free_area, &moved)) == 0) {
+        pg = pfn_to_page(start);
+        pg->order = PAGE_ORDER_UND; /* Rejected by buddy_free() */
+        pg->refcnt = 1;
+        for (uint32_t pfn = start + 1; pfn < end; pfn++) {
+            pfn_to_page(pfn)->order = PAGE_ORDER_BODY;
+            pfn_to_page(pfn)->flags = PAGE_FLAG_BODY;
+        }
+    }
+
+    local_irq_restore(flags);
+    buddy_lock = 0;
+    rmap_lock = 0;
+
+    #ifdef DEBUG_MM
+    printf("[DEBUG] CMA isolate 0x%x pages, 0x%x moved\r\n", end - start, moved);
+    #endif /* DEBUG_MM */
+    return ret;
+}
+
+/* Contiguous pgcnt pages from the CMA region, aligned to align pages */
+void *cma_alloc(uint32_t pgcnt, uint32_t align)
+{
+    uint32_t start, i;
+    void *ret = NULL;
+
+    align = ceiling_2(MAX(align, 1));
+    if (pgcnt == 0 || pgcnt > cma_pgcnt)
+        return NULL;
+
+    /* The region is at the top, usually the last to be initialized */
+    while (deferred_pfn < cma_base + cma_pgcnt && deferred_init_section())
+        ;
+
+    while (cma_lock);
+    cma_lock = 1;
+
+    for (start = ALIGN(cma_base, align); start + pgcnt <= cma_base + cma_pgcnt; start += align)
+    {
+        for (i = 0; i < pgcnt && !cma_test_bit(start - cma_base + i); i++)
+            ;
+        if (i != pgcnt)
+            continue;
+
+        if (cma_isolate(start, start + pgcnt) == 0) {
+            for (i = 0; i < pgcnt; i++)
+                cma_assign_bit(start - cma_base + i, 1);
+            ret = (void *)pfn_to_virt(start);
+            break;
+        }
+    }
+
+    cma_lock = 0;
+
+    #ifdef DEBUG_MM
+    printf("[DEBUG] CMA allocate 0x%x pages at 0x%x\r\n", pgcnt, ret);
+    #endif /* DEBUG_MM */
+    return ret;
+}
+
+void cma_release(void *chk, uint32_t pgcnt)
+{
+    Page *pg = virt_to_page(chk);
+    uint32_t start = page_to_pfn(pg);
+
+    if (!pg->cma || pg->order != PAGE_ORDER_UND || pg->flags != PAGE_FLAG_ALLOC)
+        return;
+
+    while (cma_lock);
+    cma_lock = 1;
+    while (buddy_lock);
+    buddy_lock = 1;
+
+    for (uint32_t pfn = start; pfn < start + pgcnt; pfn++) {
+        cma_assign_bit(pfn - cma_base, 0);
+        free_one(pfn, 0);
+    }
+
+    buddy_lock = 0;
+    cma_lock = 0;
+}
+
+/**
+ * Pick the smallest slab order which holds at least SLAB_MIN_OBJS objects
+ * and wastes no more than 1/8 of the slab, the leftover is used for coloring.
+ */
+static inline uint32_t slab_hdr_size(KmemCache *cachep, uint32_t objs)
+{
+    return ALIGN(sizeof(SlabCache) + objs * sizeof(uint16_t), (uint64_t)cachep->align);
+}
+
+static void slab_geometry(KmemCache *cachep)
+{
+    uint32_t slab_sz, objs, left;
+
+    for (int order = 0; order <= SLAB_ORDER_MAX; order++) {
+        slab_sz = PAGE_SIZE << order;
+        objs = (slab_sz - sizeof(SlabCache)) / (cachep->size + sizeof(uint16_t));
+        while (slab_hdr_size(cachep, objs) + objs * cachep->size > slab_sz)
+            objs--;
+        left = slab_sz - slab_hdr_size(cachep, objs) - objs * cachep->size;
+
+        cachep->order = order;
+        cachep->objs_per_slab = objs;
+        cachep->colour = left / SLAB_COLOUR_SIZE;
+
+        if (objs >= SLAB_MIN_OBJS && left <= (slab_sz >> 3))
+            break;
+    }
+
+    cachep->colour_next = 0;
+}
+
+SlabCache* slab_cache_new(KmemCache *cachep)
+{
+    uint32_t pgcnt = 1 << cachep->order;
+    SlabCache *new_cache = alloc_pages(pgcnt);
+    if (new_cache == NULL)
+        return NULL;
+
+    Page *pg = virt_to_page(new_cache);
+    uint32_t sz = cachep->size;
+    uint32_t hdr_sz = slab_hdr_size(cachep, cachep->objs_per_slab);
+
+    /* Record the owner so that slab_free() needs not search for it */
+    for (int i = 0; i < pgcnt; i++) {
+        pg[i].slab = 1;
+        pg[i].slab_off = i;
+    }
+
+    /* Shift each slab by a different colour so that objects do not alias */
+    uint64_t colour_off = cachep->colour_next * SLAB_COLOUR_SIZE;
+    if (++cachep->colour_next > cachep->colour)
+        cachep->colour_next = 0;
+
+    new_cache->size = sz;
+    new_cache->kmem_cache = cachep;
+    new_cache->sites = (uint16_t *)(new_cache + 1);
+    memset(new_cache->sites, 0, cachep->objs_per_slab * sizeof(uint16_t));
+    new_cache->start = ALIGN((uint64_t)new_cache + hdr_sz + colour_off, (uint64_t)cachep->align);
+    new_cache->end = new_cache->start + cachep->objs_per_slab * sz;
+    if (new_cache->end > (uint64_t)new_cache + (pgcnt << PAGE_SHIFT)) {
+        /* Alignment ate the colour, fall back to no colour */
+        new_cache->start = (uint64_t)new_cache + hdr_sz;
+        new_cache->end = new_cache->start + cachep->objs_per_slab * sz;
+    }
+
+    new_cache->inuse = 0;
+    new_cache->total = cachep->objs_per_slab;
+    LIST_INIT(new_cache->slab.list);
+    LIST_INIT(new_cache->cache_list);
+
+    Slab *slab_chk = (Slab *)new_cache->start;
+    while ((uint64_t)slab_chk < new_cache->end)
+    {
+        list_add_tail(&slab_chk->list, &new_cache->slab.list);
+        slab_chk = (Slab *)((char *)slab_chk + sz);
+    }
+
+    return new_cache;
+}
+
+static void slab_cache_destroy(SlabCache *slab_cache)
+{
+    uint32_t pgcnt = 1 << slab_cache->kmem_cache->order;
+    Page *pg = virt_to_page(slab_cache);
+
+    for (int i = 0; i < pgcnt; i++) {
+        pg[i].slab = 0;
+        pg[i].slab_off = 0;
+    }
+
+    buddy_free(slab_cache);
+}
+
+static void kmem_cache_setup(KmemCache *cachep, const char *name, uint32_t size,
+                             uint32_t align, void (*ctor)(void *))
+{
+    if (align < sizeof(uint64_t))
+        align = sizeof(uint64_t);
+
+    cachep->name = name;
+    cachep->align = align;
+    /* Free object is linked by Slab, so it cannot be smaller than that */
+    cachep->size = ALIGN(MAX(size, sizeof(Slab)), align);
+    cachep->ctor = ctor;
+    cachep->active_objs = 0;
+    cachep->total_objs = 0;
+    LIST_INIT(cachep->slabs_partial);
+    LIST_INIT(cachep->slabs_full);
+    LIST_INIT(cachep->slabs_empty);
+    slab_geometry(cachep);
+
+    /* Big objects pin more memory in magazines, keep fewer of them */
+    cachep->mag_limit = cachep->size > PAGE_SIZE ? 2 : (cachep->size > 0x400 ? 8 : MAG_SIZE);
+    cachep->mag_batch = (cachep->mag_limit + 1) / 2;
+    for (int i = 0; i < NR_CPUS; i++)
+        cachep->mag[i].count = 0;
+
+    LIST_INIT(cachep->list);
+    list_add_tail(&cachep->list, &kmem_cache_list);
+}
+
+/* Take an object from partial or empty slabs, slab_lock must be held */
+static void *slab_take(KmemCache *cachep)
+{
+    SlabCache *curr_cache;
+    Slab *next_slab;
+
+    if (!list_empty(&cachep->slabs_partial)) {
+        curr_cache = container_of(cachep->slabs_partial.next, SlabCache, cache_list);
+    } else if (!list_empty(&cachep->slabs_empty)) {
+        curr_cache = container_of(cachep->slabs_empty.next, SlabCache, cache_list);
+        list_move(&curr_cache->cache_list, &cachep->slabs_partial);
+    } else {
+        return NULL;
+    }
+
+    next_slab = container_of(curr_cache->slab.list.next, Slab, list);
+    list_del(&next_slab->list);
+
+    if (++curr_cache->inuse == curr_cache->total)
+        list_move(&curr_cache->cache_list, &cachep->slabs_full);
+
+    #ifdef DEBUG_MM
+    printf("[DEBUG] Allocate from slab_cache with slab size 0x%x\r\n", cachep->size);
+    #endif /* DEBUG_MM */
+    cachep->active_objs++;
+
+    return next_slab;
+}
+
+/* Give an object back to its slab, slab_lock must be held */
+static void slab_put(SlabCache *curr_cache, void *chk)
+{
+    KmemCache *cachep = curr_cache->kmem_cache;
+
+    /* LIFO, the object just freed is likely still in the data cache */
+    Slab *tmp_slab = chk;
+    list_add(&tmp_slab->list, &curr_cache->slab.list);
+
+    if (curr_cache->inuse-- == curr_cache->total)
+        list_move(&curr_cache->cache_list, &cachep->slabs_partial);
+    if (curr_cache->inuse == 0)
+        list_move(&curr_cache->cache_list, &cachep->slabs_empty);
+    cachep->active_objs--;
+
+    #ifdef DEBUG_MM
+    printf("[DEBUG] Free to 0x%x slab\r\n", curr_cache->size);
+    #endif /* DEBUG_MM */
+}
+
+/**
+ * Like __buddy_alloc(), fail on a busy lock with IRQ masked. The lock is
+ * then kept across slab_cache_new(), which does not reclaim with IRQ masked.
+ */
+static void *__slab_alloc(KmemCache *cachep)
+{
+    SlabCache *new_cache;
+    bool irq_off = irqs_disabled();
+    void *obj;
+
+    if (slab_lock && irq_off)
+        return NULL;
+    while (slab_lock);
+    slab_lock = 1;
+
+    if ((obj = slab_take(cachep)) == NULL) {
+        #ifdef DEBUG_MM
+        printf("[DEBUG] Create new slab cache\r\n");
+        #endif /* DEBUG_MM */
+        /* buddy_alloc() may reclaim slabs, so do not hold the lock */
+        if (!irq_off)
+            slab_lock = 0;
+        new_cache = slab_cache_new(cachep);
+        if (new_cache == NULL) {
+            if (irq_off)
+                slab_lock = 0;
+            return NULL;
+        }
+
+        while (!irq_off && slab_lock);
+        slab_lock = 1;
+        cachep->total_objs += new_cache->total;
+        list_add(&new_cache->cache_list, &cachep->slabs_empty);
+        obj = slab_take(cachep);
+    }
+
+    slab_lock = 0;
+    return obj;
+}
+
+/**
+ * ============ per-cpu magazines ============
+ * Same rule as per-cpu pages, a magazine is only touched by its cpu with
+ * IRQ masked, and slab_lock is try-locked to move objects in batches.
+ */
+static void mag_refill(KmemCache *cachep, Magazine *mag)
+{
+    void *obj;
+
+    if (slab_lock)
+        return;
+    slab_lock = 1;
+
+    while (mag->count < cachep->mag_batch && (obj = slab_take(cachep)) != NULL)
+        mag->objs[mag->count++] = obj;
+
+    slab_lock = 0;
+}
+
+/* Bottom of the stack is the coldest one */
+static uint32_t mag_drain(KmemCache *cachep, Magazine *mag, uint32_t nr)
+{
+    if (slab_lock || mag->count == 0)
+        return 0;
+    slab_lock = 1;
+
+    nr = MIN(nr, mag->count);
+    for (int i = 0; i < nr; i++)
+        slab_put(slab_owner(mag->objs[i]), mag->objs[i]);
+
+    for (int i = nr; i < mag->count; i++)
+        mag->objs[i - nr] = mag->objs[i];
+    mag->count -= nr;
+
+    slab_lock = 0;
+    return nr;
+}
+
+static void *cache_alloc(KmemCache *cachep)
+{
+    uint64_t flags;
+    Magazine *mag;
+    void *obj = NULL;
+
+    local_irq_save(flags);
+    mag = &cachep->mag[smp_processor_id()];
+
+    if (mag->count == 0)
+        mag_refill(cachep, mag);
+
+    if (mag->count != 0)
+        obj = mag->objs[--mag->count];
+    local_irq_restore(flags);
+
+    return obj ? obj : __slab_alloc(cachep);
+}
+
+static void cache_free(SlabCache *curr_cache, void *chk)
+{
+    KmemCache *cachep = curr_cache->kmem_cache;
+    uint64_t flags;
+    Magazine *mag;
+
+    local_irq_save(flags);
+    mag = &cachep->mag[smp_processor_id()];
+
+    if (mag->count == cachep->mag_limit)
+        mag_drain(cachep, mag, cachep->mag_batch);
+
+    if (mag->count < cachep->mag_limit) {
+        mag->objs[mag->count++] = chk;
+        local_irq_restore(flags);
+        return;
+    }
+    local_irq_restore(flags);
+
+    while (slab_lock);
+    slab_lock = 1;
+    slab_put(curr_cache, chk);
+    slab_lock = 0;
+}
+
+/* Give the empty slabs of every cache back to the buddy system */
+static uint64_t slab_shrink(uint64_t nr_to_scan)
+{
+    struct list_head *pos;
+    KmemCache *cachep;
+    SlabCache *victim;
+    uint64_t flags, freed = 0;
+    uint32_t cpu;
+
+    /* Objects in this cpu's magazines may be the last ones of a slab */
+    local_irq_save(flags);
+    cpu = smp_processor_id();
+    for (pos = kmem_cache_list.next; pos != &kmem_cache_list; pos = pos->next) {
+        cachep = container_of(pos, KmemCache, list);
+        mag_drain(cachep, &cachep->mag[cpu], MAG_SIZE);
+    }
+    local_irq_restore(flags);
+
+    if (slab_lock)
+        return 0;
+    slab_lock = 1;
+
+    for (pos = kmem_cache_list.next; pos != &kmem_cache_list && freed < nr_to_scan; pos = pos->next) {
+        cachep = container_of(pos, KmemCache, list);
+
+        while (!list_empty(&cachep->slabs_empty) && freed < nr_to_scan) {
+            victim = container_of(cachep->slabs_empty.next, SlabCache, cache_list);
+            list_del(&victim->cache_list);
+            cachep->total_objs -= victim->total;
+
+            slab_cache_destroy(victim);
+            freed += 1 << cachep->order;
+        }
+    }
+
+    slab_lock = 0;
+    return freed;
+}
+
+/* Hot pages of the cpu running the reclaim, including the released slabs */
+static uint64_t pcp_shrink(uint64_t nr_to_scan)
+{
+    uint64_t flags, freed;
+
+    local_irq_save(flags);
+    freed = pcp_drain(&pcp_pages[smp_processor_id()], PCP_HIGH + PCP_BATCH);
+    local_irq_restore(flags);
+
+    return freed;
+}
+
+static Shrinker slab_shrinker = {
+    .name = "slab",
+    .scan = slab_shrink,
+};
+
+static Shrinker pcp_shrinker = {
+    .name = "pcp",
+    .scan = pcp_shrink,
+};
+
+void slab_init()
+{
+    for (int i = 0; i < SLAB_POOL_SIZE; i++)
+        kmem_cache_setup(&kmalloc_caches[i], "kmalloc", slab_size_pool[i], 0, NULL);
+
+    /* Empty slabs are released before hot pages are flushed */
+    register_shrinker(&pcp_shrinker);
+    register_shrinker(&slab_shrinker);
+}
+
+void *slab_alloc(uint32_t sz)
+{
+    int32_t idx = kmalloc_index(sz);
+    if (idx < 0)
+        return NULL;
+
+    return cache_alloc(&kmalloc_caches[idx]);
+}
+
+int32_t slab_free(void *chk)
+{
+    SlabCache *curr_cache = slab_owner(chk);
+    if (curr_cache == NULL)
+        return -1;
+
+    if ((uint64_t)chk < curr_cache->start || (uint64_t)chk >= curr_cache->end)
+        return -1;
+
+    site_untag(chk);
+    cache_free(curr_cache, chk);
+    return 0;
+}
+
+/**
+ * ============ object cache ============
+ */
+KmemCache *kmem_cache_create(const char *name, uint32_t size, uint32_t align,
+                             void (*ctor)(void *))
+{
+    KmemCache *cachep = kmalloc(sizeof(KmemCache));
+    if (cachep == NULL)
+        return NULL;
+
+    kmem_cache_setup(cachep, name, size, align, ctor);
+    return cachep;
+}
+
+void *kmem_cache_alloc(KmemCache *cachep)
+{
+    void *obj = cache_alloc(cachep);
+
+    site_tag(obj, _RET_IP_);
+
+    /* Free list overwrites the object, construct it on every allocation */
+    if (obj != NULL && cachep->ctor != NULL)
+        cachep->ctor(obj);
+
+    return obj;
+}
+
+int32_t kmem_cache_free(KmemCache *cachep, void *obj)
+{
+    SlabCache *owner = slab_owner(obj);
+    if (owner == NULL || owner->kmem_cache != cachep)
+        return -1;
+
+    return slab_free(obj);
+}
+
+void kmem_cache_report()
+{
+    KmemCache *iter;
+    struct list_head *pos = kmem_cache_list.next;
+
+    printf("name             objsize   order   active    total\r\n");
+    while (pos != &kmem_cache_list) {
+        iter = container_of(pos, KmemCache, list);
+        printf("%s\t\t 0x%x\t   %u\t   %u\t     %u\r\n", iter->name, iter->size,
+               iter->order, iter->active_objs, iter->total_objs);
+        pos = pos->next;
+    }
+}
+
+/* Sites holding the most live bytes, largest first */
+void alloc_site_report(uint32_t top_n)
+{
+    bool shown[ALLOC_SITE_MAX] = {0};
+    AllocSite *site;
+    int32_t best;
+
+    printf("site                 live       peak     allocs    frees\r\n");
+    for (uint32_t n = 0; n < top_n; n++) {
+        best = -1;
+        for (int i = 0; i < ALLOC_SITE_MAX; i++)
+            if (!shown[i] && alloc_sites[i].ip != 0 &&
+                (best < 0 || alloc_sites[i].live > alloc_sites[best].live))
+                best = i;
+
+        if (best < 0)
+            break;
+
+        shown[best] = 1;
+        site = &alloc_sites[best];
+        printf("0x%lx\t 0x%lx\t 0x%lx\t %u\t %u\r\n", site->ip, site->live,
+               site->peak, site->nr_allocs, site->nr_frees);
+    }
+}
+
+/* Report of the allocators for user programs, with top_n call sites at most */
+int32_t svc_memstat(uint32_t top_n)
+{
+    printf("free pages 0x%lx, cma 0x%lx\r\n", nr_free_pages, nr_free_cma);
+    kmem_cache_report();
+    alloc_site_report(MIN(top_n, ALLOC_SITE_MAX));
+    return 0;
+}
+
+void* __kmalloc(uint32_t sz)
+{
+    void *ret;
+    if ((ret = slab_alloc(sz)) == NULL)
+        ret = alloc_pages((sz + PAGE_SIZE - 1) >> PAGE_SHIFT);
+
+    site_tag(ret, _RET_IP_);
+    return ret;
+}
+
+int32_t kfree(void *chk)
+{
+    if (is_vmalloc_addr(chk)) {
+        vfree(chk);
+        return 0;
+    }
+
+    if (virt_to_page(chk)->slab)
+        return slab_free(chk);
+
+    return buddy_free(chk);
+}
+
+/* Usable size of a chunk, which is its slab class, buddy block or vmalloc area */
+uint32_t ksize(void *chk)
+{
+    if (is_vmalloc_addr(chk))
+        return vsize(chk);
+
+    Page *pg = virt_to_page(chk);
+    if (pg->slab)
+        return slab_owner(chk)->kmem_cache->size;
+
+    return PAGE_SIZE << pg->order;
+}
+
+void *krealloc(void *chk, uint32_t new_sz)
+{
+    uint32_t old_sz;
+    void *ret;
+
+    if (chk == NULL)
+        return site_retag(kvmalloc(new_sz), _RET_IP_);
+
+    if (new_sz == 0) {
+        kfree(chk);
+        return NULL;
+    }
+
+    /* Fits in the slack of the slab class or buddy block */
+    old_sz = ksize(chk);
+    if (new_sz <= old_sz)
+        return chk;
+
+    if (!is_vmalloc_addr(chk) && !virt_to_page(chk)->slab && buddy_extend(chk, new_sz)) {
+        site_sub(virt_to_page(chk)->site, old_sz);
+        site_tag(chk, _RET_IP_);
+        return chk;
+    }
+
+    /* Grow geometrically so that repeated appends copy O(n) in total */
+    if ((ret = kvmalloc(MAX(new_sz, old_sz * 2))) == NULL &&
+        (ret = kvmalloc(new_sz)) == NULL)
+        return NULL;
+
+    memcpy(ret, chk, old_sz);
+    kfree(chk);
+    return site_retag(ret, _RET_IP_);
+}
+
+/**
+ * ============ arena ============
+ * Chunks are buddy pages, a request larger than a page gets a chunk of its own.
+ */
+void *arena_alloc(Arena *arena, uint32_t sz)
+{
+    uint32_t off = ALIGN(arena->off, ARENA_ALIGN);
+    uint32_t chunk_sz;
+    void *chunk;
+
+    if (arena->chunk == NULL || off + sz > arena->size) {
+        chunk_sz = PAGE_SIZE * ceiling_2(PAGE_ROUNDUP(sz + ARENA_ALIGN) >> PAGE_SHIFT);
+        chunk = buddy_alloc(chunk_sz >> PAGE_SHIFT);
+        if (chunk == NULL)
+            return NULL;
+
+        *(void **)chunk = arena->chunk;
+        arena->chunk = chunk;
+        arena->size = chunk_sz;
+        arena->nr_chunks++;
+        off = ARENA_ALIGN;
+    }
+
+    arena->off = off + sz;
+    return (char *)arena->chunk + off;
+}
+
+void arena_release(Arena *arena)
+{
+    void *chunk = arena->chunk, *prev;
+
+    while (chunk != NULL) {
+        prev = *(void **)chunk;
+        buddy_free(chunk);
+        chunk = prev;
+    }
+
+    #ifdef DEBUG_MM
+    printf("[DEBUG] Arena release 0x%x chunks\r\n", arena->nr_chunks);
+    #endif /* DEBUG_MM */
+    memset(arena, 0, sizeof(Arena));
+}
+
+/**
+ * ============ memory reclaim ============
+ */
+void register_shrinker(Shrinker *shrinker)
+{
+    /* Shrinker registered later runs first, slab is the last one to run */
+    LIST_INIT(shrinker->list);
+    list_add(&shrinker->list, &shrinker_list);
+}
+
+uint64_t shrink_memory(uint64_t nr_pages)
+{
+    struct list_head *pos;
+    Shrinker *shrinker;
+    uint64_t freed = 0;
+
+    for (pos = shrinker_list.next; pos != &shrinker_list && freed < nr_pages; pos = pos->next) {
+        shrinker = container_of(pos, Shrinker, list);
+        freed += shrinker->scan(nr_pages - freed);
+
+        #ifdef DEBUG_MM
+        printf("[DEBUG] Shrinker %s, free pages 0x%lx\r\n", shrinker->name, nr_free_pages);
+        #endif /* DEBUG_MM */
+    }
+
+    return freed;
+}
+
+void kswapd()
+{
+    uint64_t flags, freed;
+
+    kswapd_task = current;
+    while (1) {
+        /* Stop once above high watermark or nothing can be reclaimed */
+        freed = 1;
+        while (nr_free_pages < wmark_high &&
+               (freed = shrink_memory(wmark_high - nr_free_pages)) != 0);
+
+        /* Check again with IRQ masked so a wakeup in between is not lost */
+        local_irq_save(flags);
+        if (nr_free_pages >= wmark_low || freed == 0)
+            thread_sleep();
+        local_irq_restore(flags);
+    }
 }
\ No newline at end of file
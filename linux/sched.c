@@ -7,6 +7,7 @@
 #include <types.h>
 #include <initramfs.h>
 #include <fs.h>
+#include <printf.h>
 
 static inline void update_timer()
 {
@@ -14,13 +15,13 @@ static inline void update_timer()
     enable_timer();
 }
 
-pgd_t *next_pgd;
-
 /* Thread 0 is main thread */
 TaskStruct *main_task;
 TaskQueue rq, eq;
 
 static uint64_t _currpid = 1;
+static KmemCache *task_cachep;
+static Shrinker zombie_shrinker;
 
 void task_queue_init()
 {
@@ -33,17 +34,149 @@ void task_queue_init()
 
     eq.list = LIST_HEAD_INIT(eq.list);
     eq.len = eq.lock = 0;
+
+    register_shrinker(&zombie_shrinker);
+}
+
+void task_cache_init()
+{
+    task_cachep = kmem_cache_create("task_struct", sizeof(TaskStruct), 0, NULL);
 }
 
 TaskStruct *new_task()
 {
-    TaskStruct *task = kmalloc(sizeof(TaskStruct));
+    TaskStruct *task = kmem_cache_alloc(task_cachep);
+    if (task == NULL)
+        return NULL;
+
     memset(task, 0, sizeof(TaskStruct));
     LIST_INIT(task->list);
     task->time = 1;
     return task;
 }
 
+static mm_struct *new_mm(TaskStruct *task)
+{
+    mm_struct *mm = arena_alloc(&task->arena, sizeof(mm_struct));
+    if (mm == NULL)
+        return NULL;
+
+    memset(mm, 0, sizeof(mm_struct));
+    mm->arena = &task->arena;
+    return mm;
+}
+
+static struct fdt_struct *new_fdt(TaskStruct *task)
+{
+    struct fdt_struct *fdt = arena_alloc(&task->arena, sizeof(struct fdt_struct));
+    if (fdt == NULL)
+        return NULL;
+
+    memset(fdt, 0, sizeof(struct fdt_struct));
+    return fdt;
+}
+
+/**
+ * ASIDs are handed out until they run out, then the generation is bumped
+ * and the TLB is flushed once. ASID 0 goes with the empty table loaded for
+ * kernel threads. The scheduler runs with IRQ masked, so no lock is needed.
+ */
+static mm_struct *active_mm; /* Whose tables are in TTBR0 */
+static uint64_t asid_generation = NR_ASIDS;
+static uint8_t asid_map[NR_ASIDS];
+static uint32_t asid_next = 1;
+
+static inline void load_ttbr0(uint64_t ttbr)
+{
+    __asm__ volatile(
+        "dsb ish\n"
+        "msr ttbr0_el1, %0\n"
+        "isb\n"
+        :: "r"(ttbr));
+}
+
+static void new_asid(mm_struct *mm)
+{
+    while (asid_next < NR_ASIDS && asid_map[asid_next])
+        asid_next++;
+
+    if (asid_next == NR_ASIDS) {
+        asid_generation += NR_ASIDS;
+        memset(asid_map, 0, sizeof(asid_map));
+        asid_map[0] = 1;
+
+        /* Loaded tables keep their ASID, a lazy kernel thread may walk them */
+        if (active_mm != NULL) {
+            active_mm->asid = asid_generation | (active_mm->asid & ASID_MASK);
+            asid_map[active_mm->asid & ASID_MASK] = 1;
+        }
+
+        __asm__ volatile(
+            "dsb ishst\n"
+            "tlbi vmalle1is\n"
+            "dsb ish\n"
+            "isb\n");
+
+        for (asid_next = 1; asid_map[asid_next]; asid_next++);
+    }
+
+    asid_map[asid_next] = 1;
+    mm->asid = asid_generation | asid_next;
+}
+
+/**
+ * TTBR0 for the next task, 0 if what is loaded serves it. Kernel threads
+ * never touch the lower half, so they run on the tables of whoever ran before.
+ */
+static uint64_t switch_mm(mm_struct *mm)
+{
+    if ((uint64_t)mm->pgd == spin_table_start || mm == active_mm)
+        return 0;
+
+    if ((mm->asid & ~(uint64_t)ASID_MASK) != asid_generation)
+        new_asid(mm);
+
+    active_mm = mm;
+    return virt_to_phys(mm->pgd) | (mm->asid & ASID_MASK) << TTBR_ASID_SHIFT;
+}
+
+/* Tables of mm are about to be freed, stop walking them lazily */
+static void drop_mm(mm_struct *mm)
+{
+    uint64_t flags;
+
+    local_irq_save(flags);
+    if (mm == active_mm) {
+        load_ttbr0(virt_to_phys(zero_page));
+        active_mm = NULL;
+    }
+    local_irq_restore(flags);
+}
+
+/* Also takes a task which is only partly set up, e.g. by a failed fork */
+static void task_free(TaskStruct *task)
+{
+    if (task->kern_stack != NULL)
+        kfree(task->kern_stack);
+
+    if (task->mm != NULL && task->mm->pgd != NULL &&
+        (uint64_t)task->mm->pgd != spin_table_start) {
+        drop_mm(task->mm);
+        release_pgtable(task->mm->pgd, 0);
+        kfree(task->mm->pgd);
+    }
+
+    if (task->fdt) {
+        for (int i = 0; i < FDT_SIZE; i++)
+            if (task->fdt->files[i] != NULL)
+                task->fdt->files[i]->f_ops->close(task->fdt->files[i]);
+    }
+
+    /* mm, VMAs, fdt and signal handlers */
+    arena_release(&task->arena);
+    kmem_cache_free(task_cachep, task);
+}
+
 void schedule()
 {
     disable_intr();
@@ -59,7 +192,7 @@ void schedule()
         next = container_of(next->list.next, TaskStruct, list);
 
     update_timer();
-    switch_to(current, next, virt_to_phys(next->mm->pgd));
+    switch_to(current, next, switch_mm(next->mm));
 }
 
 void try_schedule()
@@ -80,9 +213,10 @@ void main_thread_init()
     main_task->status = RUNNING;
     main_task->prio = 1;
     main_task->kern_stack = (void *)kern_end;
-    main_task->mm = kmalloc(sizeof(mm_struct));
+    main_task->mm = new_mm(main_task);
+    if (main_task->mm == NULL)
+        hangon();
     main_task->mm->pgd = (pgd_t *)spin_table_start;
-    main_task->mm->mmap = NULL;
 
     LIST_INIT(main_task->list);
     
@@ -92,6 +226,16 @@ void main_thread_init()
     enable_intr();
 
     write_sysreg(tpidr_el1, main_task);
+
+    /**
+     * Boot tables map the lower half by global entries, which would hit for
+     * any ASID. Load the empty table in their place and drop them once.
+     */
+    load_ttbr0(virt_to_phys(zero_page));
+    __asm__ volatile(
+        "tlbi vmalle1is\n"
+        "dsb ish\n"
+        "isb\n");
     update_timer();
 }
 
@@ -130,12 +274,45 @@ void thread_release(TaskStruct *target, int16_t ec)
     if (target == current) {
         disable_intr();
         update_timer();
-        next_pgd = (pgd_t *)virt_to_phys(next->mm->pgd);
-        switch_to(current, next, virt_to_phys(next->mm->pgd));
+        switch_to(current, next, switch_mm(next->mm));
     }
     /* Never reach */
 }
 
+/* Take current off the run queue until thread_wake() puts it back */
+void thread_sleep()
+{
+    uint64_t flags;
+    TaskStruct *next;
+
+    local_irq_save(flags);
+    next = container_of(current->list.next, TaskStruct, list);
+    while (&next->list == &rq.list || next == current)
+        next = container_of(next->list.next, TaskStruct, list);
+
+    current->status = WAITING;
+    list_del(&current->list);
+    rq.len--;
+
+    update_timer();
+    switch_to(current, next, switch_mm(next->mm));
+    local_irq_restore(flags);
+}
+
+/* Safe with IRQ masked, does nothing unless target is sleeping */
+void thread_wake(TaskStruct *target)
+{
+    uint64_t flags;
+
+    local_irq_save(flags);
+    if (target->status == WAITING) {
+        target->status = RUNNING;
+        list_add_tail(&target->list, &rq.list);
+        rq.len++;
+    }
+    local_irq_restore(flags);
+}
+
 void thread_trampoline(void(*func)(), void *arg)
 {
     func(arg);
@@ -145,11 +322,17 @@ void thread_trampoline(void(*func)(), void *arg)
 uint32_t create_kern_task(void(*func)(), void *arg)
 {
     TaskStruct *task = new_task();
-    ThreadInfo *thread_info = &task->thread_info;
-    
-    task->mm = kmalloc(sizeof(mm_struct));
-    memset(task->mm, 0, sizeof(mm_struct));
+    ThreadInfo *thread_info;
+
+    if (task == NULL)
+        return 1;
 
+    thread_info = &task->thread_info;
+    task->mm = new_mm(task);
+    if (task->mm == NULL) {
+        task_free(task);
+        return 1;
+    }
     task->mm->pgd = (pgd_t *)spin_table_start;
 
     task->pid = 0;
@@ -159,9 +342,12 @@ uint32_t create_kern_task(void(*func)(), void *arg)
     thread_info->x19 = (uint64_t)func;
     thread_info->x20 = (uint64_t)arg;
     
-    thread_info->sp = (uint64_t)buddy_alloc(4);
-    task->kern_stack = (void *)thread_info->sp;
-    thread_info->sp += THREAD_STACK_SIZE - 0x10;
+    task->kern_stack = buddy_alloc(4);
+    if (task->kern_stack == NULL) {
+        task_free(task);
+        return 1;
+    }
+    thread_info->sp = (uint64_t)task->kern_stack + THREAD_STACK_SIZE - 0x10;
     thread_info->fp = thread_info->sp;
 
     thread_info->lr = (uint64_t)__thread_trampoline;
@@ -186,53 +372,67 @@ uint32_t create_user_task(const char *pathname)
         return 1;
 
     TaskStruct *task = new_task();
-    ThreadInfo *thread_info = &task->thread_info;
+    ThreadInfo *thread_info;
     mm_struct *mm;
     vm_area_struct *vma;
-    
+
+    if (task == NULL)
+        return 1;
+
+    thread_info = &task->thread_info;
     task->workdir = rootfs->root;
     
-    mm = kmalloc(sizeof(mm_struct));
-    memset(mm, 0, sizeof(mm_struct));
-
-    task->fdt = kmalloc(sizeof(struct fdt_struct));
-    memset(task->fdt, 0, sizeof(struct fdt_struct));
+    mm = new_mm(task);
+    task->fdt = new_fdt(task);
+    if (mm == NULL || task->fdt == NULL) {
+        task_free(task);
+        return 1;
+    }
     
-    mm->pgd = buddy_alloc(1);
-    memset(mm->pgd, 0, PAGE_SIZE);
-
     task->mm = mm;
+    if ((mm->pgd = get_zeroed_page()) == NULL) {
+        task_free(task);
+        return 1;
+    }
+
     task->pid = _currpid++;
     task->status = STOPPED;
     task->prio = 2;
 
     vma = mmap_internal(task->mm, (void *)0, PAGE_ROUNDUP(vnode->size), PROT_READ | PROT_EXEC, 0);
+    if (vma == NULL ||
+        mmap_internal(task->mm, (void *)USER_THREAD_BASE_ADDR, THREAD_STACK_SIZE, PROT_READ | PROT_WRITE, 0) == NULL) {
+        task_free(task);
+        return 1;
+    }
     vma->data = (const char *)vnode->internal.mem;
     thread_info->x19 = 0; /* User code at 0x0 */
     
-    vma = mmap_internal(task->mm, (void *)USER_THREAD_BASE_ADDR, THREAD_STACK_SIZE, PROT_READ | PROT_WRITE, 0);
     thread_info->x20 = USER_THREAD_BASE_ADDR + THREAD_STACK_SIZE - 0x10;
 
     /**
      * Kernel space need not demand paging
      */
-    thread_info->sp = (uint64_t)buddy_alloc(4);
-    task->kern_stack = (void *)thread_info->sp;
-    thread_info->sp += THREAD_STACK_SIZE - 0x10;
+    task->kern_stack = buddy_alloc(4);
+    if (task->kern_stack == NULL) {
+        task_free(task);
+        return 1;
+    }
+    thread_info->sp = (uint64_t)task->kern_stack + THREAD_STACK_SIZE - 0x10;
     thread_info->fp = thread_info->sp;
 
     thread_info->lr = (uint64_t)from_el1_to_el0;
 
-    struct file *stdin, *stdout, *stderr;
+    /* stdin, stdout and stderr, task_free() closes the ones opened */
+    for (int i = 0; i < 3; i++) {
+        struct file *file;
 
-    if (__vfs_open_wrapper("/dev/uart", 0, &stdin)  != 0 ||
-        __vfs_open_wrapper("/dev/uart", 0, &stdout) != 0 ||
-        __vfs_open_wrapper("/dev/uart", 0, &stderr) != 0)
-        return -1;
-    
-    task->fdt->files[0] = stdin;
-    task->fdt->files[1] = stdout;
-    task->fdt->files[2] = stderr;
+        if (__vfs_open_wrapper("/dev/uart", 0, &file) != 0) {
+            task_free(task);
+            return 1;
+        }
+        task->fdt->files[i] = file;
+    }
 
     disable_intr();
     list_add_tail(&task->list, &rq.list);
@@ -255,45 +455,45 @@ void kill_zombies()
 
     while (eq.len)
     {
-        if (iter->signal != NULL)
-        {
-            Signal *sig_iter = iter->signal;
-            Signal *sig_next;
-            do {
-                sig_next = container_of(sig_iter->list.next, Signal, list);
-                kfree(sig_iter);
-                sig_iter = sig_next;
-            } while (sig_iter != sig_next);
-        }
-
         prev = iter;
         iter = container_of(iter->list.next, TaskStruct, list);
 
         list_del(&prev->list);
-        kfree(prev->kern_stack);
 
-        if ((uint64_t)prev->mm->pgd != spin_table_start)
-            release_pgtable(prev->mm->pgd, 0);
+        #ifdef DEBUG_MM
+        printf("[DEBUG] Process %d took 0x%x page faults\r\n", prev->pid, prev->nr_faults);
+        #endif /* DEBUG_MM */
 
-        if (prev->mm->mmap) {
-            /* TODO */
-        }
-        kfree(prev->mm);
-
-        if (prev->fdt)
-            kfree(prev->fdt);
-        
-        kfree(prev);
+        task_free(prev);
         eq.len--;
     }
 
     eq.lock = 0;
 }
 
+/* Reap exited tasks when memory is short instead of waiting for idle() */
+static uint64_t zombie_shrink(uint64_t nr_to_scan)
+{
+    uint64_t nr_free = nr_free_pages;
+
+    /* Never spin on eq in reclaim path */
+    if (IS_EQ_EMPTY || eq.lock)
+        return 0;
+
+    kill_zombies();
+    return nr_free_pages > nr_free ? nr_free_pages - nr_free : 0;
+}
+
+static Shrinker zombie_shrinker = {
+    .name = "zombie",
+    .scan = zombie_shrink,
+};
+
 void idle()
 {
     while (1) {
         kill_zombies();
+        zero_pool_fill();
         schedule();
     }
 }
@@ -304,32 +504,44 @@ int32_t svc_fork()
     TaskStruct *task = new_task();
     mm_struct *mm;
 
+    if (task == NULL)
+        return -1;
+
     task->workdir = current->workdir;
 
-    task->fdt = kmalloc(sizeof(struct fdt_struct));
-    memset(task->fdt, 0, sizeof(struct fdt_struct));
+    task->fdt = new_fdt(task);
+    task->mm = mm = new_mm(task);
+    if (task->fdt == NULL || mm == NULL)
+        goto fail;
 
     for (int i = 0; i < FDT_SIZE; i++) {
         if (current->fdt->files[i] != NULL) {
-            task->fdt->files[i] = kmalloc(sizeof(struct file));
+            task->fdt->files[i] = new_file(current->fdt->files[i]->vnode, 0);
+            if (task->fdt->files[i] == NULL)
+                goto fail;
             memcpy(task->fdt->files[i], current->fdt->files[i], sizeof(struct file));
         }
     }
 
-    mm = kmalloc(sizeof(mm_struct));
-    memset(mm, 0, sizeof(mm_struct));
-    dup_vma(current->mm, mm);
+    if (dup_vma(current->mm, mm) != 0)
+        goto fail;
 
-    mm->pgd = buddy_alloc(1);
-    memset(mm->pgd, 0, PAGE_SIZE);
-    dup_pages(current->mm->pgd, mm->pgd, 0);
+    mm->pgd = get_zeroed_page();
+    task->kern_stack = buddy_alloc(4);
+    if (mm->pgd == NULL || task->kern_stack == NULL)
+        goto fail;
+
+    /* Parent entries are read only now, drop the writable ones it cached */
+    if (dup_pages(current->mm->pgd, mm->pgd, 0) != 0) {
+        flush_tlb_asid(current->mm->asid);
+        goto fail;
+    }
+    flush_tlb_asid(current->mm->asid);
 
-    task->mm = mm;
     task->pid = _currpid++;
     task->prio = current->prio;
     task->status = RUNNING;
 
-    task->kern_stack = buddy_alloc(4);
     memcpy(task->kern_stack, current->kern_stack, THREAD_STACK_SIZE);
 
     uint64_t tf_offset = (uint64_t)tf - (uint64_t)current->kern_stack;
@@ -343,7 +555,10 @@ int32_t svc_fork()
     {
         Signal *iter = current->signal;
         do {
-            Signal *new_sig = new_signal(iter->signo, iter->handler);
+            Signal *new_sig = new_signal(&task->arena, iter->signo, iter->handler);
+            if (new_sig == NULL)
+                goto fail;
+
             if (task->signal == NULL) {
                 task->signal = new_sig;
             } else {
@@ -360,6 +575,10 @@ int32_t svc_fork()
 
     tf->x0 = task->pid;
     return task->pid;
+
+fail:
+    task_free(task);
+    return -1;
 }
 
 int32_t svc_exec(const char *name, char *const argv[])
@@ -376,14 +595,17 @@ int32_t svc_exec(const char *name, char *const argv[])
     if (__vfs_lookup(name, component_name, &prev, &vnode) != 0)
         return 1;
 
-    if (vnode == NULL)
+    if (vnode == NULL || vnode->size == 0)
         return 1;
     
     release_vma(current->mm);
     vma = mmap_internal(current->mm, (void *)0, PAGE_ROUNDUP(vnode->size), PROT_READ | PROT_EXEC, 0);
-    vma = mmap_internal(current->mm, (void *)USER_THREAD_BASE_ADDR, THREAD_STACK_SIZE, PROT_READ | PROT_WRITE, 0);
-
+    /* The old program is gone, nothing to return to */
+    if (vma == NULL ||
+        mmap_internal(current->mm, (void *)USER_THREAD_BASE_ADDR, THREAD_STACK_SIZE, PROT_READ | PROT_WRITE, 0) == NULL)
+        thread_release(current, EXIT_CODE_KILL);
     vma->data = (const char *)vnode->internal.mem;
+
     current->workdir = rootfs->root;
     current->pid = _currpid++;
 
@@ -15,9 +15,13 @@ void (*default_sighand[])(int) = \
     svc_kill,
 };
 
-Signal *new_signal(int SIGNAL, void (*handler)())
+/* Handlers are kept until the task exits, so they live in its arena */
+Signal *new_signal(Arena *arena, int SIGNAL, void (*handler)())
 {
-    Signal *signal = kmalloc(sizeof(Signal));
+    Signal *signal = arena_alloc(arena, sizeof(Signal));
+    if (signal == NULL)
+        return NULL;
+
     signal->signo = SIGNAL;
     signal->handler = handler;
     LIST_INIT(signal->list);
@@ -103,14 +107,18 @@ void svc_sigreturn()
     current->signal_ctx = NULL;
 }
 
-void svc_signal(int SIGNAL, void (*handler)())
+int32_t svc_signal(int SIGNAL, void (*handler)())
 {
-    Signal *signal = new_signal(SIGNAL, handler);
+    Signal *signal = new_signal(&current->arena, SIGNAL, handler);
+
+    if (signal == NULL)
+        return -1;
     
     if (current->signal == NULL)
         current->signal = signal;
     else
         list_add(&signal->list, &current->signal->list);
+    return 0;
 }
 
 void svc_sigkill(int pid, int SIGNAL)
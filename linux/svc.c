@@ -39,6 +39,10 @@ void *svc_table[] =
     svc_ioctl, // 19
     svc_sync,
     svc_sigreturn, // 21
+    svc_munmap, // 22
+    svc_mprotect, // 23
+    svc_mremap, // 24
+    svc_memstat, // 25
 };
 
 #define SVC_NUM (sizeof(svc_table) / sizeof(svc_table[0]))
@@ -0,0 +1,168 @@
+#include <swap.h>
+#include <zram.h>
+#include <mm.h>
+#include <vm.h>
+#include <fat32.h>
+#include <sdhost.h>
+#include <vmalloc.h>
+#include <util.h>
+#include <printf.h>
+#include <irq.h>
+
+static uint32_t swap_start;   /* First sector of the partition */
+static uint32_t nr_slots;
+static uint32_t nr_free_slots;
+static uint32_t slot_hint;    /* Search for a free slot starts here */
+static swap_cnt_t *swap_map; /* Entries referring to each slot, 0 if free */
+static bool swap_lock = 0;  /* Taken with IRQ masked, swap_free() may run in any context */
+
+static uint64_t swap_shrink(uint64_t nr_to_scan)
+{
+    uint64_t freed;
+
+    if (nr_free_slots == 0 && zram_full())
+        return 0;
+
+    freed = shrink_anon(nr_to_scan);
+
+    #ifdef DEBUG_MM
+    zram_report();
+    #endif /* DEBUG_MM */
+    return freed;
+}
+
+static Shrinker swap_shrinker = {
+    .name = "swap",
+    .scan = swap_shrink,
+};
+
+/* zram is always there, the partition is found in MBR */
+void swap_init()
+{
+    PartitionDesc *part_desc_ptr;
+    char buf[BLOCK_SIZE];
+    int i;
+
+    zram_init();
+    register_shrinker(&swap_shrinker);
+
+    read_block(MBR_SECTOR, buf);
+    if (buf[510] != 0x55 || buf[511] != 0xaa)
+        return;
+
+    part_desc_ptr = (PartitionDesc *)&buf[446];
+    for (i = 0; i < 4; i++)
+        if ((part_desc_ptr + i)->partition_type_desc == SWAP_PART_TYPE)
+            break;
+
+    if (i == 4) {
+        printf("[swap] No swap partition\r\n");
+        return;
+    }
+
+    swap_start = (part_desc_ptr + i)->start_sector;
+    nr_slots = MIN((part_desc_ptr + i)->partition_size / SECTORS_PER_SLOT, SWAP_MAX_SLOTS);
+    if (nr_slots < 2 || (swap_map = vmalloc(nr_slots * sizeof(swap_cnt_t))) == NULL)
+        return;
+    memset(swap_map, 0, nr_slots * sizeof(swap_cnt_t));
+
+    /* Slot 0 holds the mkswap header, leave it alone */
+    swap_map[0] = 1;
+    slot_hint = 1;
+    nr_free_slots = nr_slots - 1;
+
+    printf("[swap] 0x%x slots from sector 0x%x\r\n", nr_slots, swap_start);
+}
+
+/* Store the page to a slot referred by cnt entries, 0 if swap is full */
+uint64_t swap_out(void *page, uint32_t cnt)
+{
+    uint64_t entry, flags;
+    uint32_t slot;
+
+    if ((entry = zram_store(page, cnt)) != 0)
+        return entry;
+
+    local_irq_save(flags);
+    while (swap_lock);
+    swap_lock = 1;
+
+    if (nr_free_slots == 0) {
+        swap_lock = 0;
+        local_irq_restore(flags);
+        return 0;
+    }
+
+    for (slot = slot_hint; swap_map[slot]; )
+        slot = (slot + 1 == nr_slots) ? 1 : slot + 1;
+
+    swap_map[slot] = cnt;
+    slot_hint = slot;
+    nr_free_slots--;
+
+    swap_lock = 0;
+    local_irq_restore(flags);
+
+    for (int i = 0; i < SECTORS_PER_SLOT; i++)
+        write_block(swap_start + slot * SECTORS_PER_SLOT + i, (char *)page + i * BLOCK_SIZE);
+
+    #ifdef DEBUG_MM
+    printf("[DEBUG] Swap out 0x%x to slot 0x%x\r\n", page, slot);
+    #endif /* DEBUG_MM */
+    return swp_entry(slot);
+}
+
+void swap_in(uint64_t entry, void *page)
+{
+    uint32_t slot = swp_slot(entry);
+
+    if (is_zram_entry(entry)) {
+        zram_load(entry, page);
+        return;
+    }
+
+    for (int i = 0; i < SECTORS_PER_SLOT; i++)
+        read_block(swap_start + slot * SECTORS_PER_SLOT + i, (char *)page + i * BLOCK_SIZE);
+
+    #ifdef DEBUG_MM
+    printf("[DEBUG] Swap in 0x%x from slot 0x%x\r\n", page, slot);
+    #endif /* DEBUG_MM */
+}
+
+/* Entry is copied by fork */
+void swap_dup(uint64_t entry)
+{
+    uint64_t flags;
+
+    if (is_zram_entry(entry)) {
+        zram_dup(entry);
+        return;
+    }
+
+    local_irq_save(flags);
+    while (swap_lock);
+    swap_lock = 1;
+    swap_map[swp_slot(entry)]++;
+    swap_lock = 0;
+    local_irq_restore(flags);
+}
+
+/* Entry is dropped, the slot is free when no entry refers to it */
+void swap_free(uint64_t entry)
+{
+    uint32_t slot = swp_slot(entry);
+    uint64_t flags;
+
+    if (is_zram_entry(entry)) {
+        zram_free(entry);
+        return;
+    }
+
+    local_irq_save(flags);
+    while (swap_lock);
+    swap_lock = 1;
+    if (--swap_map[slot] == 0)
+        nr_free_slots++;
+    swap_lock = 0;
+    local_irq_restore(flags);
+}
@@ -4,14 +4,67 @@
 #include <mm.h>
 #include <sched.h>
 #include <printf.h>
+#include <memblock.h>
+#include <swap.h>
+#include <initramfs.h>
 
 #define MMAP_MAX_SIZE 0x10000
 #define MMAP_DEFAULT_BASE 0x8787000
+#define USER_VA_END (1UL << (PGD_BIT + GRANULE_SIZE))
 
-static inline vm_area_struct *new_vma(uint64_t vm_start, uint64_t vm_end,
+/* Boot code maps the first GB by 2MB blocks in the PMD at 0x2000 */
+#define BOOT_PMD ((uint64_t *)(spin_table_start + 0x2000))
+#define PMD_RAM_ATTR   (AF_ACCESS | PTE_SH_INNER | (MAIR_IDX_NORMAL_WB << 2) | PD_BLOCK)
+#define PMD_PERIF_ATTR (AF_ACCESS | (MAIR_IDX_DEVICE_nGnRnE << 2) | PD_BLOCK)
+
+/* Boot maps RAM up to a fixed address, remap the blocks by what the board reports */
+void linear_map_init()
+{
+    uint64_t base;
+
+    for (int i = 0; i < 512; i++) {
+        base = (uint64_t)i << PMD_BIT;
+        if (base >= PHYS_MEM_MAX)
+            break;
+
+        if (memblock_is_memory(base, 1 << PMD_BIT))
+            BOOT_PMD[i] = base | PMD_RAM_ATTR;
+        else
+            BOOT_PMD[i] = base | PMD_PERIF_ATTR;
+    }
+
+    __asm__ volatile(
+        "dsb ishst\n"
+        "tlbi vmalle1is\n"
+        "dsb ish\n"
+        "isb\n");
+}
+
+/* VMAs live in the arena of the owner, released ones are reused by the mm */
+static vm_area_struct *alloc_vma(mm_struct *mm)
+{
+    vm_area_struct *vma = mm->free_vma;
+
+    if (vma != NULL) {
+        mm->free_vma = *(vm_area_struct **)vma;
+        return vma;
+    }
+    return arena_alloc(mm->arena, sizeof(vm_area_struct));
+}
+
+static inline void free_vma(mm_struct *mm, vm_area_struct *vma)
+{
+    *(vm_area_struct **)vma = mm->free_vma;
+    mm->free_vma = vma;
+}
+
+static inline vm_area_struct *new_vma(mm_struct *mm, uint64_t vm_start, uint64_t vm_end,
                                       int flags, uint64_t prot, uint64_t attr)
 {
-    vm_area_struct *vma = kmalloc(sizeof(vm_area_struct));
+    vm_area_struct *vma = alloc_vma(mm);
+    if (vma == NULL)
+        return NULL;
+
     vma->vm_start = vm_start;
     vma->vm_end = vm_end;
     vma->flags = flags;
@@ -22,52 +75,302 @@ static inline vm_area_struct *new_vma(uint64_t vm_start, uint64_t vm_end,
     return vma;
 }
 
+/**
+ * ============ VMA tree ============
+ */
+#define vma_height(vma)   ((vma) ? (vma)->height : 0)
+#define vma_max_gap(vma)  ((vma) ? (vma)->max_gap : 0)
+#define vma_prev_end(vma) ((vma)->vm_start - (vma)->gap)
+
+static inline void vma_update(vm_area_struct *vma)
+{
+    vma->height = MAX(vma_height(vma->left), vma_height(vma->right)) + 1;
+    vma->max_gap = MAX(vma->gap, MAX(vma_max_gap(vma->left), vma_max_gap(vma->right)));
+}
+
+static vm_area_struct *vma_rotate_left(vm_area_struct *vma)
+{
+    vm_area_struct *right = vma->right;
+
+    vma->right = right->left;
+    right->left = vma;
+    vma_update(vma);
+    vma_update(right);
+    return right;
+}
+
+static vm_area_struct *vma_rotate_right(vm_area_struct *vma)
+{
+    vm_area_struct *left = vma->left;
+
+    vma->left = left->right;
+    left->right = vma;
+    vma_update(vma);
+    vma_update(left);
+    return left;
+}
+
+/* Children are balanced, return the new root of the subtree */
+static vm_area_struct *vma_balance(vm_area_struct *vma)
+{
+    int32_t bf;
+
+    vma_update(vma);
+    bf = vma_height(vma->left) - vma_height(vma->right);
+
+    if (bf > 1) {
+        if (vma_height(vma->left->left) < vma_height(vma->left->right))
+            vma->left = vma_rotate_left(vma->left);
+        return vma_rotate_right(vma);
+    }
+
+    if (bf < -1) {
+        if (vma_height(vma->right->right) < vma_height(vma->right->left))
+            vma->right = vma_rotate_right(vma->right);
+        return vma_rotate_left(vma);
+    }
+
+    return vma;
+}
+
+static vm_area_struct *vma_tree_insert(vm_area_struct *root, vm_area_struct *vma)
+{
+    if (root == NULL) {
+        vma->left = vma->right = NULL;
+        vma_update(vma);
+        return vma;
+    }
+
+    if (vma->vm_start < root->vm_start)
+        root->left = vma_tree_insert(root->left, vma);
+    else
+        root->right = vma_tree_insert(root->right, vma);
+    return vma_balance(root);
+}
+
+static vm_area_struct *vma_tree_remove_min(vm_area_struct *root, vm_area_struct **min)
+{
+    if (root->left == NULL) {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = vma_tree_remove_min(root->left, min);
+    return vma_balance(root);
+}
+
+static vm_area_struct *vma_tree_remove(vm_area_struct *root, vm_area_struct *vma)
+{
+    vm_area_struct *succ;
+
+    if (root == vma) {
+        if (vma->right == NULL)
+            return vma->left;
+
+        /* Successor takes the place of vma */
+        succ = NULL;
+        vma->right = vma_tree_remove_min(vma->right, &succ);
+        succ->left = vma->left;
+        succ->right = vma->right;
+        return vma_balance(succ);
+    }
+
+    if (vma->vm_start < root->vm_start)
+        root->left = vma_tree_remove(root->left, vma);
+    else
+        root->right = vma_tree_remove(root->right, vma);
+    return vma_balance(root);
+}
+
+/* Gap of vma has changed, recompute the subtrees down to it */
+static void vma_tree_update(vm_area_struct *root, vm_area_struct *vma)
+{
+    if (root != vma)
+        vma_tree_update(vma->vm_start < root->vm_start ? root->left : root->right, vma);
+    vma_update(root);
+}
+
+/* Last VMA starting below addr, NULL if none */
+static vm_area_struct *vma_tree_prev(vm_area_struct *root, uint64_t addr)
+{
+    vm_area_struct *prev = NULL;
+
+    while (root != NULL) {
+        if (root->vm_start < addr) {
+            prev = root;
+            root = root->right;
+        } else {
+            root = root->left;
+        }
+    }
+    return prev;
+}
+
+/* First VMA ending above addr, NULL if none */
+static vm_area_struct *vma_tree_next(vm_area_struct *root, uint64_t addr)
+{
+    vm_area_struct *next = NULL;
+
+    while (root != NULL) {
+        if (root->vm_end > addr) {
+            next = root;
+            root = root->left;
+        } else {
+            root = root->right;
+        }
+    }
+    return next;
+}
+
+/**
+ * Lowest VMA whose gap holds [addr, addr + len) for some addr >= lo.
+ * A VMA starting below lo + len cannot, neither can its left subtree.
+ */
+static vm_area_struct *vma_gap_find(vm_area_struct *root, uint64_t lo, uint64_t len)
+{
+    vm_area_struct *vma;
+
+    if (root == NULL || root->max_gap < len)
+        return NULL;
+
+    if (root->vm_start >= lo + len) {
+        if ((vma = vma_gap_find(root->left, lo, len)) != NULL)
+            return vma;
+        if (root->vm_start - MAX(vma_prev_end(root), lo) >= len)
+            return root;
+    }
+    return vma_gap_find(root->right, lo, len);
+}
+
+static inline vm_area_struct *vma_next(mm_struct *mm, vm_area_struct *vma)
+{
+    vm_area_struct *next = container_of(vma->list.next, vm_area_struct, list);
+    return next == mm->mmap ? NULL : next;
+}
+
+static inline vm_area_struct *vma_prev(mm_struct *mm, vm_area_struct *vma)
+{
+    if (vma == mm->mmap)
+        return NULL;
+    return container_of(vma->list.prev, vm_area_struct, list);
+}
+
 static vm_area_struct *insert_vma(mm_struct *mm, uint64_t start, uint64_t end,
                                   int flags, uint64_t prot, uint64_t attr)
 {
-    vm_area_struct *vma = new_vma(start, end, flags, prot, attr);
+    vm_area_struct *vma = new_vma(mm, start, end, flags, prot, attr);
+    vm_area_struct *prev = vma_tree_prev(mm->vma_root, start);
+    vm_area_struct *next;
+
+    if (vma == NULL)
+        return NULL;
+
     if (mm->mmap == NULL) {
         mm->mmap = vma;
-        goto insert_vma_success;
+        next = NULL;
+    } else if (prev == NULL) {
+        list_add_tail(&vma->list, &mm->mmap->list);
+        next = mm->mmap;
+        mm->mmap = vma;
+    } else {
+        list_add(&vma->list, &prev->list);
+        next = vma_next(mm, vma);
     }
 
-    vm_area_struct *final_vma = container_of(mm->mmap->list.prev, vm_area_struct, list);
-    vm_area_struct *vma_iter = final_vma;
+    vma->gap = start - (prev ? prev->vm_end : 0);
+    mm->vma_root = vma_tree_insert(mm->vma_root, vma);
 
-    do {
-        if (vma->vm_start >= vma_iter->vm_end) {
-            list_add(&vma->list, &vma_iter->list);
-            goto insert_vma_success;
-        }
-        
-        vma_iter = container_of(vma_iter->list.prev, vm_area_struct, list);
-    } while (vma_iter != final_vma);
+    if (next != NULL) {
+        next->gap = next->vm_start - end;
+        vma_tree_update(mm->vma_root, next);
+    }
+    return vma;
+}
+
+/* Drop vma from the list and the tree, the pages are left to the caller */
+static void unlink_vma(mm_struct *mm, vm_area_struct *vma)
+{
+    vm_area_struct *prev = vma_prev(mm, vma);
+    vm_area_struct *next = vma_next(mm, vma);
 
-    list_add_tail(&vma->list, &mm->mmap->list);
-    mm->mmap = vma;
+    mm->vma_root = vma_tree_remove(mm->vma_root, vma);
+    if (mm->mmap == vma)
+        mm->mmap = next;
+    list_del(&vma->list);
 
-insert_vma_success:
-    return vma;
+    if (next != NULL) {
+        next->gap = next->vm_start - (prev ? prev->vm_end : 0);
+        vma_tree_update(mm->vma_root, next);
+    }
+
+    if (mm->vmacache == vma)
+        mm->vmacache = NULL;
+    free_vma(mm, vma);
 }
 
-void release_vma(mm_struct *mm)
+/* vma ends at addr, the new VMA after it is returned */
+static vm_area_struct *split_vma(mm_struct *mm, vm_area_struct *vma, uint64_t addr)
 {
-    vm_area_struct *first_vma = mm->mmap;
-    vm_area_struct *vma_iter = container_of(first_vma->list.next, vm_area_struct, list);
-    vm_area_struct *prev_vma;
+    vm_area_struct *new;
+    uint64_t end = vma->vm_end;
 
-    while (vma_iter != first_vma) {
-        prev_vma = vma_iter;
-        vma_iter = container_of(vma_iter->list.next, vm_area_struct, list);
-        list_del(&prev_vma->list);
-        kfree(prev_vma);
+    vma->vm_end = addr;
+    if ((new = insert_vma(mm, addr, end, vma->flags, vma->prot, vma->attr)) == NULL) {
+        vma->vm_end = end;
+        return NULL;
     }
 
-    kfree(first_vma);
-    mm->mmap = NULL;
+    if (vma->data != NULL)
+        new->data = vma->data + (addr - vma->vm_start);
+    return new;
+}
+
+static inline bool vma_mergeable(vm_area_struct *vma, vm_area_struct *next)
+{
+    if (vma->vm_end != next->vm_start || vma->prot != next->prot ||
+        vma->attr != next->attr || vma->flags != next->flags)
+        return 0;
+
+    if (vma->data == NULL || next->data == NULL)
+        return vma->data == next->data;
+    return vma->data + (vma->vm_end - vma->vm_start) == next->data;
+}
+
+/* Join the VMAs touching [start, end) with their neighbours where they match */
+static void merge_vmas(mm_struct *mm, uint64_t start, uint64_t end)
+{
+    vm_area_struct *vma = vma_tree_prev(mm->vma_root, start);
+    vm_area_struct *next;
+
+    if (vma == NULL && (vma = mm->mmap) == NULL)
+        return;
+
+    while ((next = vma_next(mm, vma)) != NULL && next->vm_start <= end) {
+        if (!vma_mergeable(vma, next)) {
+            vma = next;
+            continue;
+        }
+
+        vma->vm_end = next->vm_end;
+        unlink_vma(mm, next);
+    }
+}
+
+static bool zap_range(uint64_t *table, int level, uint64_t base, uint64_t start, uint64_t end);
+
+void release_vma(mm_struct *mm)
+{
+    vm_area_struct *vma;
+
+    /* Pages go with their VMAs, exec() maps the new program at the same addresses */
+    while ((vma = mm->mmap) != NULL) {
+        zap_range(mm->pgd, 0, 0, vma->vm_start, vma->vm_end);
+        unlink_vma(mm, vma);
+    }
+    flush_tlb_asid(mm->asid);
 }
 
-void mappages(void *pgd, uint64_t va, uint64_t size, uint64_t pa, uint64_t attr)
+int32_t mappages(void *pgd, uint64_t va, uint64_t size, uint64_t pa, uint64_t attr)
 {
     va &= ~MM_VIRT_KERN_START;
     if (va & PAGE_OFFSET_MASK)
@@ -86,24 +389,49 @@ void mappages(void *pgd, uint64_t va, uint64_t size, uint64_t pa, uint64_t attr)
     pgtables[0] = pgd;
     for (int level = 0; level < 3; level++) {
         if (*((uint64_t *)pgtables[level] + pgtable_idx[level]) == 0) {
-            page = buddy_alloc(1);
-            memset(page, 0, PAGE_SIZE);
+            page = get_zeroed_page();
+            if (page == NULL)
+                return -1;
             *((uint64_t *)pgtables[level] + pgtable_idx[level]) = virt_to_phys(page) | PD_TABLE;
+        } else if (pmd_huge(*((uint64_t *)pgtables[level] + pgtable_idx[level]))) {
+            return -1;
         }
         pgtables[level+1] = (void *)phys_to_virt(*((uint64_t *)pgtables[level] + pgtable_idx[level]) & ~ATTR_MASK);
     }
     
     uint8_t update;
-    uint64_t pte_pa;
+    uint64_t pte_pa, *pte;
+    /* Only user pages are tracked, kernel ones are never moved or swapped */
+    bool user = (uint64_t)pgd != spin_table_start;
     do {
-        pte_pa = *((uint64_t *)pgtables[3] + pgtable_idx[3]) & ~ATTR_MASK;
-        if (pte_pa) {
+        pte = (uint64_t *)pgtables[3] + pgtable_idx[3];
+        pte_pa = *pte & ~ATTR_MASK;
+        if (is_swap_pte(*pte)) {
+            /* Swapped out content is read back in place of the copy */
+            if (!is_zero_page(phys_to_virt(pa))) {
+                swap_in(*pte, (void *)phys_to_virt(pa));
+                if (!(attr & PTE_UXN))
+                    sync_icache_range((void *)phys_to_virt(pa), PAGE_SIZE);
+            }
+            swap_free(*pte);
+        } else if (pte_pa && !is_zero_page(phys_to_virt(pte_pa))) {
+            /* Zero page is neither copied nor freed, the new page is zeroed already */
             memcpy((void *)phys_to_virt(pa), (void *)phys_to_virt(pte_pa), PAGE_SIZE);
+            rmap_del((void *)phys_to_virt(pte_pa), pte);
             buddy_free((void *)phys_to_virt(pte_pa));
+            if (!(attr & PTE_UXN))
+                sync_icache_range((void *)phys_to_virt(pa), PAGE_SIZE);
         }
 
-        *((uint64_t *)pgtables[3] + pgtable_idx[3]) = pa | BASE_PTE_ATTR | attr;
+        *pte = pa | BASE_PTE_ATTR | attr | (user ? PTE_NG : 0);
+        /* Old entry may be cached under the ASID, which is kept across switches */
+        if (pte_pa)
+            flush_tlb_page(va);
+        /* Zero page and initramfs are reserved, neither tracked nor freed */
+        if (user && buddy_refcnt((void *)phys_to_virt(pa)))
+            rmap_add((void *)phys_to_virt(pa), pte, va);
         update = 0;
+        va += PAGE_SIZE;
         pa += PAGE_SIZE;
         pgcnt--;
         pgtable_idx[3]++;
@@ -119,13 +447,18 @@ void mappages(void *pgd, uint64_t va, uint64_t size, uint64_t pa, uint64_t attr)
 
         for (int level = 0; level < 3 && update; level++) {
             if (*((uint64_t *)pgtables[level] + pgtable_idx[level]) == 0) {
-                page = buddy_alloc(1);
-                memset(page, 0, PAGE_SIZE);
+                page = get_zeroed_page();
+                if (page == NULL)
+                    return -1;
                 *((uint64_t *)pgtables[level] + pgtable_idx[level]) = virt_to_phys(page) | PD_TABLE;
+            } else if (pmd_huge(*((uint64_t *)pgtables[level] + pgtable_idx[level]))) {
+                return -1;
             }
             pgtables[level+1] = (void *) phys_to_virt(*((uint64_t *)pgtables[level] + pgtable_idx[level]) & ~ATTR_MASK);
         }
     } while (1);
+
+    return 0;
 }
 
 pte_t *walk(void *pagetable, uint64_t va)
@@ -154,66 +487,285 @@ pte_t *walk(void *pagetable, uint64_t va)
     return *((pte_t **)pagetable + pgtable_idx[3]);
 }
 
+/* Entry of the last level table for va, NULL if it is not mapped by pages */
+static uint64_t *pte_offset(void *pagetable, uint64_t va)
+{
+    va &= ~MM_VIRT_KERN_START;
+
+    uint32_t pgtable_idx[4] = {
+        va >> PGD_BIT,
+        va >> PUD_BIT & ((1 << GRANULE_SIZE) - 1),
+        va >> PMD_BIT & ((1 << GRANULE_SIZE) - 1),
+        va >> PTE_BIT & ((1 << GRANULE_SIZE) - 1),
+    };
+
+    uint64_t ent;
+    for (int level = 0; level < 3; level++) {
+        ent = *((uint64_t *)pagetable + pgtable_idx[level]);
+        if (ent == NULL || (ent & 0b11) == PD_BLOCK)
+            return NULL;
+
+        pagetable = (void *)phys_to_virt(ent & ~ATTR_MASK);
+    }
+
+    return (uint64_t *)pagetable + pgtable_idx[3];
+}
+
+/* Entry of the middle level table for va, which may be a block, NULL if there is no table */
+static uint64_t *pmd_offset(void *pagetable, uint64_t va)
+{
+    va &= ~MM_VIRT_KERN_START;
+
+    uint32_t pgtable_idx[3] = {
+        va >> PGD_BIT,
+        va >> PUD_BIT & ((1 << GRANULE_SIZE) - 1),
+        va >> PMD_BIT & ((1 << GRANULE_SIZE) - 1),
+    };
+
+    uint64_t ent;
+    for (int level = 0; level < 2; level++) {
+        ent = *((uint64_t *)pagetable + pgtable_idx[level]);
+        if (ent == NULL || pmd_huge(ent))
+            return NULL;
+
+        pagetable = (void *)phys_to_virt(ent & ~ATTR_MASK);
+    }
+
+    return (uint64_t *)pagetable + pgtable_idx[2];
+}
+
+/* Entry of the table at level for va, missing tables above it are allocated */
+static uint64_t *pte_alloc(void *pagetable, uint64_t va, int level)
+{
+    va &= ~MM_VIRT_KERN_START;
+
+    uint32_t pgtable_idx[4] = {
+        va >> PGD_BIT,
+        va >> PUD_BIT & ((1 << GRANULE_SIZE) - 1),
+        va >> PMD_BIT & ((1 << GRANULE_SIZE) - 1),
+        va >> PTE_BIT & ((1 << GRANULE_SIZE) - 1),
+    };
+
+    uint64_t *ent;
+    void *page;
+    for (int i = 0; i < level; i++) {
+        ent = (uint64_t *)pagetable + pgtable_idx[i];
+        if (*ent == NULL) {
+            if ((page = get_zeroed_page()) == NULL)
+                return NULL;
+            *ent = virt_to_phys(page) | PD_TABLE;
+        } else if (pmd_huge(*ent)) {
+            return NULL;
+        }
+
+        pagetable = (void *)phys_to_virt(*ent & ~ATTR_MASK);
+    }
+
+    return (uint64_t *)pagetable + pgtable_idx[level];
+}
+
+/**
+ * Clear the entries of [start, end) under a table mapping from base and free
+ * the pages. Tables left empty are freed too, returns 1 if this one is.
+ */
+static bool zap_range(uint64_t *table, int level, uint64_t base, uint64_t start, uint64_t end)
+{
+    uint32_t shift = PGD_BIT - GRANULE_SIZE * level;
+    uint32_t first = (MAX(start, base) - base) >> shift;
+    uint32_t last = (MIN(end, base + (512UL << shift)) - 1 - base) >> shift;
+    void *page;
+
+    for (uint32_t i = first; i <= last; i++) {
+        if (table[i] == NULL)
+            continue;
+
+        if (level == 3 && is_swap_pte(table[i])) {
+            swap_free(table[i]);
+            table[i] = 0;
+            continue;
+        }
+
+        page = (void *)phys_to_virt(table[i] & ~ATTR_MASK);
+        if (level == 2 && pmd_huge(table[i])) {
+            /* Blocks across the ends are split by the caller */
+            if (base + ((uint64_t)i << shift) >= start && base + ((uint64_t)(i + 1) << shift) <= end) {
+                table[i] = 0;
+                buddy_free(page);
+            }
+        } else if (level == 3) {
+            table[i] = 0;
+            rmap_del(page, &table[i]);
+            buddy_free(page);
+        } else if (zap_range(page, level + 1, base + ((uint64_t)i << shift), start, end)) {
+            table[i] = 0;
+            kfree(page);
+        }
+    }
+
+    for (int i = 0; i < 512; i++)
+        if (table[i] != NULL)
+            return 0;
+    return 1;
+}
+
+/* Clear the entries of [va, va + size) and free the pages, tables are kept */
+void unmappages(void *pgd, uint64_t va, uint64_t size)
+{
+    uint64_t *pte, pa;
+    uint64_t end = va + size;
+
+    for (; va < end; va += PAGE_SIZE) {
+        pte = pte_offset(pgd, va);
+        if (pte == NULL || *pte == NULL)
+            continue;
+
+        if (is_swap_pte(*pte)) {
+            swap_free(*pte);
+            *pte = 0;
+            continue;
+        }
+
+        pa = *pte & ~ATTR_MASK;
+        *pte = 0;
+        flush_tlb_page(va);
+        rmap_del((void *)phys_to_virt(pa), pte);
+        buddy_free((void *)phys_to_virt(pa));
+    }
+}
+
+/**
+ * ============ 2MB blocks ============
+ * Blocks are never shared by fork() and have no rmap. They are mapped by
+ * pages again before a range may start or end inside of them.
+ */
+#define vma_huge(vma, va) ((vma)->data == NULL && ((vma)->prot & PROT_WRITE) &&             \
+                           ((va) & ~(HPAGE_SIZE - 1)) >= (vma)->vm_start &&                 \
+                           ((va) & ~(HPAGE_SIZE - 1)) + HPAGE_SIZE <= (vma)->vm_end)
+
+/* Map [va, va + HPAGE_SIZE) by a zeroed block, -1 if no block is free or a table is there */
+static int32_t map_huge(mm_struct *mm, uint64_t va, uint64_t attr)
+{
+    uint64_t *pmd;
+    void *page;
+
+    if ((page = alloc_huge_page(1)) == NULL)
+        return -1;
+
+    if ((pmd = pte_alloc(mm->pgd, va, 2)) == NULL || *pmd != NULL) {
+        buddy_free(page);
+        return -1;
+    }
+
+    if (!(attr & PTE_UXN))
+        sync_icache_range(page, HPAGE_SIZE);
+    *pmd = virt_to_phys(page) | BASE_PMD_ATTR | attr | PTE_NG;
+    return 0;
+}
+
+/* Map the block at va by a table of pages, which are then freed and swapped one by one */
+static int32_t split_huge_pmd(mm_struct *mm, uint64_t *pmd, uint64_t va)
+{
+    uint64_t old = *pmd, pa = old & ~ATTR_MASK;
+    uint64_t *table = get_zeroed_page();
+
+    if (table == NULL)
+        return -1;
+
+    split_huge_page((void *)phys_to_virt(pa));
+    for (int i = 0; i < 512; i++) {
+        table[i] = (pa + ((uint64_t)i << PTE_BIT)) | (old & ATTR_MASK & ~0b11) | PD_TABLE_ENT;
+        rmap_add((void *)phys_to_virt(pa + ((uint64_t)i << PTE_BIT)), &table[i], va + ((uint64_t)i << PTE_BIT));
+    }
+
+    /* Break before make, the block and the pages must not be in the TLB at once */
+    *pmd = 0;
+    flush_tlb_range(va, va + HPAGE_SIZE, mm->asid);
+    *pmd = virt_to_phys(table) | PD_TABLE;
+    return 0;
+}
+
+static int32_t split_huge_range(mm_struct *mm, uint64_t start, uint64_t end)
+{
+    uint64_t *pmd;
+
+    for (uint64_t va = start & ~(HPAGE_SIZE - 1); va < end; va += HPAGE_SIZE) {
+        pmd = pmd_offset(mm->pgd, va);
+        if (pmd != NULL && pmd_huge(*pmd) && split_huge_pmd(mm, pmd, va) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* So that a range may start or end at addr */
+static inline int32_t split_huge_boundary(mm_struct *mm, uint64_t addr)
+{
+    if ((addr & (HPAGE_SIZE - 1)) == 0)
+        return 0;
+    return split_huge_range(mm, addr, addr + 1);
+}
+
 void release_pgtable(void *pagetable, int level)
 {
     for (int i = 0; i < 512; i++) {
+        if (level == 3 && is_swap_pte(*((uint64_t *)pagetable + i))) {
+            swap_free(*((uint64_t *)pagetable + i));
+            continue;
+        }
+
         if (*((uint64_t *)pagetable + i) != NULL) {
             void *page = (void *)phys_to_virt(*((uint64_t *)pagetable + i) & ~ATTR_MASK);
+            if (level == 2 && pmd_huge(*((uint64_t *)pagetable + i))) {
+                buddy_free(page);
+                continue;
+            }
             if (level != 3)
                 release_pgtable(page, level+1);
+            else
+                rmap_del(page, (uint64_t *)pagetable + i);
             kfree(page);
         }
     }
 }
 
+/* Lowest free range of len bytes from addr on */
 uint64_t find_vma_start_addr(mm_struct *mm, uint64_t addr, uint64_t len)
 {
-    vm_area_struct *first_vma = mm->mmap;
-    if (first_vma == NULL)
-        return addr;
-
-    vm_area_struct *prev_vma = first_vma;
-    vm_area_struct *curr_vma = container_of(first_vma->list.next, vm_area_struct, list);
+    vm_area_struct *vma;
 
-    while (curr_vma != first_vma) {
-        if (addr >= prev_vma->vm_end) {
-            if (addr + len < curr_vma->vm_start)
-                return addr;
-            
-            if (addr < curr_vma->vm_end)
-                addr = curr_vma->vm_end;
-        }
-        
-        prev_vma = curr_vma;
-        curr_vma = container_of(curr_vma->list.next, vm_area_struct, list);
-    }
+    if (mm->mmap == NULL)
+        return addr;
 
-    /* Overlap with first vma */
-    if (addr <= first_vma->vm_end && addr + len >= first_vma->vm_start)
-        addr = first_vma->vm_end;
+    if ((vma = vma_gap_find(mm->vma_root, addr, len)) != NULL)
+        return MAX(addr, vma_prev_end(vma));
 
-    return addr;
+    /* Above the last VMA */
+    vma = container_of(mm->mmap->list.prev, vm_area_struct, list);
+    return MAX(addr, vma->vm_end);
 }
 
 vm_area_struct *find_vma(mm_struct *mm, uint64_t addr)
 {
-    vm_area_struct *first_vma = mm->mmap;
-    vm_area_struct *vma_iter = first_vma;
+    vm_area_struct *vma = mm->vmacache;
 
-    do {
-        if (addr >= vma_iter->vm_start && addr < vma_iter->vm_end)
-            return vma_iter;
-        
-        vma_iter = container_of(vma_iter->list.next, vm_area_struct, list);
-    } while (vma_iter != first_vma);
+    /* Faults tend to hit the same VMA in a row */
+    if (vma != NULL && addr >= vma->vm_start && addr < vma->vm_end)
+        return vma;
 
+    for (vma = mm->vma_root; vma != NULL; ) {
+        if (addr < vma->vm_start) {
+            vma = vma->left;
+        } else if (addr >= vma->vm_end) {
+            vma = vma->right;
+        } else {
+            mm->vmacache = vma;
+            return vma;
+        }
+    }
     return NULL;
 }
 
-vm_area_struct *mmap_internal(mm_struct *mm, void* addr, uint64_t len, int prot, int flags)
+static uint64_t prot_to_attr(int prot)
 {
-    vm_area_struct *vma;
-    uint64_t _addr;
     uint64_t attr;
 
     attr = PTE_PXN; 
@@ -226,6 +778,19 @@ vm_area_struct *mmap_internal(mm_struct *mm, void* addr, uint64_t len, int prot,
     else
         attr |= PTE_AP_NOACCESS;
 
+    return attr;
+}
+
+vm_area_struct *mmap_internal(mm_struct *mm, void* addr, uint64_t len, int prot, int flags)
+{
+    vm_area_struct *vma;
+    uint64_t _addr;
+    uint64_t attr = prot_to_attr(prot);
+
+    /* An empty VMA would share its key with the next one */
+    if (len == 0 || len > USER_VA_END)
+        return NULL;
+
     _addr = (((uint64_t)addr + PAGE_SIZE - 1) & ~PAGE_OFFSET_MASK);
     len = (len + PAGE_SIZE - 1) & ~PAGE_OFFSET_MASK;
 
@@ -234,13 +799,25 @@ vm_area_struct *mmap_internal(mm_struct *mm, void* addr, uint64_t len, int prot,
     else
         _addr = find_vma_start_addr(mm, (uint64_t)addr, len);
 
-    vma = insert_vma(mm, _addr, _addr + len, flags, prot, attr);
+    if ((vma = insert_vma(mm, _addr, _addr + len, flags, prot, attr)) == NULL)
+        return NULL;
 
     if (flags & MAP_POPULATE) {
-        for (int i = 0; i < len; i += 0x1000) {
-            void *pa = buddy_alloc(1);
-            memset(pa, 0, PAGE_SIZE);
-            mappages(mm->pgd, vma->vm_start + i, PAGE_SIZE, (uint64_t)pa, attr);
+        for (uint64_t i = 0; i < len; i += 0x1000) {
+            /* Aligned 2MB goes in one block when there is a free one */
+            if (((vma->vm_start + i) & (HPAGE_SIZE - 1)) == 0 && vma_huge(vma, vma->vm_start + i) &&
+                map_huge(mm, vma->vm_start + i, attr) == 0) {
+                i += HPAGE_SIZE - 0x1000;
+                continue;
+            }
+
+            void *pa = alloc_movable_page(1);
+            if (pa == NULL)
+                break;
+            if (mappages(mm->pgd, vma->vm_start + i, PAGE_SIZE, virt_to_phys(pa), attr) != 0) {
+                buddy_free(pa);
+                break;
+            }
         }
     }
 
@@ -250,7 +827,200 @@ vm_area_struct *mmap_internal(mm_struct *mm, void* addr, uint64_t len, int prot,
 void *svc_mmap(void* addr, uint64_t len, int prot, int flags, int fd, int file_offset)
 {
     vm_area_struct *vma = mmap_internal(current->mm, addr, len, prot, flags);
-    return (void *)vma->vm_start;
+    return vma ? (void *)vma->vm_start : NULL;
+}
+
+static int32_t do_munmap(mm_struct *mm, uint64_t start, uint64_t end)
+{
+    vm_area_struct *vma, *next;
+
+    if (split_huge_boundary(mm, start) != 0 || split_huge_boundary(mm, end) != 0)
+        return -1;
+
+    for (vma = vma_tree_next(mm->vma_root, start); vma != NULL && vma->vm_start < end; vma = next) {
+        if (vma->vm_start < start && (vma = split_vma(mm, vma, start)) == NULL)
+            return -1;
+        if (vma->vm_end > end && split_vma(mm, vma, end) == NULL)
+            return -1;
+
+        next = vma_next(mm, vma);
+        unlink_vma(mm, vma);
+    }
+
+    zap_range(mm->pgd, 0, 0, start, end);
+    flush_tlb_range(start, end, mm->asid);
+    return 0;
+}
+
+int32_t svc_munmap(void *addr, uint64_t len)
+{
+    uint64_t start = (uint64_t)addr;
+
+    if ((start & PAGE_OFFSET_MASK) || len == 0 || len > USER_VA_END - start)
+        return -1;
+    return do_munmap(current->mm, start, start + PAGE_ROUNDUP(len));
+}
+
+/**
+ * Rewrite the entries of vma by its new attr. A writable entry is mapped read
+ * only unless it was writable already, the write fault copies a shared page.
+ */
+static void change_protection(mm_struct *mm, vm_area_struct *vma)
+{
+    uint64_t *pte, ap, size;
+
+    for (uint64_t va = vma->vm_start; va < vma->vm_end; va += size) {
+        /* Ends of the VMA are split, so a block lies inside of it */
+        pte = pmd_offset(mm->pgd, va);
+        if (pte != NULL && pmd_huge(*pte)) {
+            size = HPAGE_SIZE;
+        } else {
+            size = PAGE_SIZE;
+            pte = pte_offset(mm->pgd, va);
+        }
+
+        if (pte == NULL || *pte == NULL || is_swap_pte(*pte))
+            continue;
+
+        ap = vma->attr & PTE_AP_MASK;
+        if (ap == PTE_AP_RDWR && (*pte & PTE_AP_MASK) != PTE_AP_RDWR)
+            ap = PTE_AP_RDONLY;
+
+        *pte = (*pte & ~(PTE_AP_MASK | PTE_UXN)) | ap | (vma->attr & PTE_UXN);
+        if (vma->prot & PROT_EXEC)
+            sync_icache_range((void *)phys_to_virt(*pte & ~ATTR_MASK), size);
+    }
+}
+
+int32_t svc_mprotect(void *addr, uint64_t len, int prot)
+{
+    mm_struct *mm = current->mm;
+    uint64_t start = (uint64_t)addr;
+    uint64_t end = start + PAGE_ROUNDUP(len);
+    vm_area_struct *vma;
+
+    if ((start & PAGE_OFFSET_MASK) || len > USER_VA_END - start)
+        return -1;
+
+    /* Splitting at start twice would leave an empty VMA */
+    if (end == start)
+        return 0;
+
+    /* The whole range is mapped */
+    for (uint64_t va = start; va < end; va = vma->vm_end)
+        if ((vma = find_vma(mm, va)) == NULL)
+            return -1;
+
+    if (split_huge_boundary(mm, start) != 0 || split_huge_boundary(mm, end) != 0)
+        return -1;
+
+    for (vma = find_vma(mm, start); vma != NULL && vma->vm_start < end; vma = vma_next(mm, vma)) {
+        if (vma->vm_start < start && (vma = split_vma(mm, vma, start)) == NULL)
+            return -1;
+        if (vma->vm_end > end && split_vma(mm, vma, end) == NULL)
+            return -1;
+
+        vma->prot = prot;
+        vma->attr = prot_to_attr(prot);
+        change_protection(mm, vma);
+    }
+
+    merge_vmas(mm, start, end);
+    flush_tlb_range(start, end, mm->asid);
+    return 0;
+}
+
+/* Entries of [old, old + len) go to new, the pages stay where they are */
+static int32_t move_ptes(mm_struct *mm, uint64_t old, uint64_t new, uint64_t len)
+{
+    uint64_t *src, *dst;
+    void *page;
+
+    /* Tables first, nothing is moved if one cannot be allocated */
+    for (uint64_t off = 0; off < len; off += PAGE_SIZE) {
+        src = pte_offset(mm->pgd, old + off);
+        if (src != NULL && *src != NULL && pte_alloc(mm->pgd, new + off, 3) == NULL) {
+            zap_range(mm->pgd, 0, 0, new, new + len);
+            return -1;
+        }
+    }
+
+    for (uint64_t off = 0; off < len; off += PAGE_SIZE) {
+        src = pte_offset(mm->pgd, old + off);
+        if (src == NULL || *src == NULL)
+            continue;
+
+        dst = pte_offset(mm->pgd, new + off);
+        *dst = *src;
+        *src = 0;
+
+        page = (void *)phys_to_virt(*dst & ~ATTR_MASK);
+        if (!is_swap_pte(*dst) && buddy_refcnt(page)) {
+            rmap_del(page, src);
+            rmap_add(page, dst, new + off);
+        }
+    }
+
+    flush_tlb_range(old, old + len, mm->asid);
+    return 0;
+}
+
+void *svc_mremap(void *old_addr, uint64_t old_len, uint64_t new_len, int flags)
+{
+    mm_struct *mm = current->mm;
+    uint64_t old = (uint64_t)old_addr, new;
+    vm_area_struct *vma, *next, *new_vma;
+
+    if ((old & PAGE_OFFSET_MASK) || old_len == 0 || new_len == 0 || new_len > USER_VA_END)
+        return NULL;
+    old_len = PAGE_ROUNDUP(old_len);
+    new_len = PAGE_ROUNDUP(new_len);
+
+    /* Old range lies in one VMA */
+    if ((vma = find_vma(mm, old)) == NULL || old_len > vma->vm_end - old)
+        return NULL;
+
+    if (new_len <= old_len) {
+        if (new_len < old_len && do_munmap(mm, old + new_len, old + old_len) != 0)
+            return NULL;
+        return old_addr;
+    }
+
+    /* Grow in place when the range ends the VMA and nothing follows closely */
+    next = vma_next(mm, vma);
+    if (old + old_len == vma->vm_end && old + new_len <= USER_VA_END &&
+        (next == NULL || next->vm_start >= old + new_len)) {
+        vma->vm_end = old + new_len;
+        if (next != NULL) {
+            next->gap = next->vm_start - vma->vm_end;
+            vma_tree_update(mm->vma_root, next);
+        }
+        return old_addr;
+    }
+
+    if (!(flags & MREMAP_MAYMOVE))
+        return NULL;
+
+    /* Entries are moved by pages, the new range is rarely aligned to a block */
+    if (split_huge_range(mm, old, old + old_len) != 0)
+        return NULL;
+
+    new = find_vma_start_addr(mm, MMAP_DEFAULT_BASE, new_len);
+    if (new + new_len > USER_VA_END)
+        return NULL;
+    if ((new_vma = insert_vma(mm, new, new + new_len, vma->flags, vma->prot, vma->attr)) == NULL)
+        return NULL;
+    if (vma->data != NULL)
+        new_vma->data = vma->data + (old - vma->vm_start);
+
+    if (move_ptes(mm, old, new, old_len) != 0) {
+        unlink_vma(mm, new_vma);
+        return NULL;
+    }
+
+    /* Entries are gone already, this drops the VMA and the empty tables */
+    do_munmap(mm, old, old + old_len);
+    return (void *)new;
 }
 
 #define EC_EL0_INSN_FAULT 0b100000
@@ -264,16 +1034,122 @@ void *svc_mmap(void* addr, uint64_t len, int prot, int flags, int fd, int file_o
 #define ISS_WNR_BIT (1 << 6)
 #define ISS_WNR_IS_WRITE(ESR) (ESR & ISS_WNR_BIT)
 #define ISS_WNR_IS_READ(ESR) (!(ESR & ISS_WNR_BIT))
+#define ISS_FSC_MASK 0b111111
+#define ISS_FSC_IS_ACCESS(ESR) (((ESR) & ISS_FSC_MASK & ~0b11) == 0b001000)
+#define ISS_FSC_IS_PERM(ESR)   (((ESR) & ISS_FSC_MASK & ~0b11) == 0b001100)
 #define TRAN_FAULT_L0 0b000101
 #define PERM_FAULT_L1 0b001101
 
+/**
+ * Read only segments which are page aligned in initramfs are mapped in
+ * place, initramfs is reserved so that its pages are never freed.
+ */
+#define vma_xip(vma) (!((vma)->prot & PROT_WRITE) &&                            \
+                      ((uint64_t)(vma)->data & PAGE_OFFSET_MASK) == 0 &&         \
+                      (uint64_t)(vma)->data >= cpio_start && (uint64_t)(vma)->data < cpio_end)
+
+/* Page holding the file content at va, NULL if out of memory */
+static void *get_file_page(vm_area_struct *vma, uint64_t va)
+{
+    const char *data = vma->data + (va - vma->vm_start);
+    void *page;
+
+    if (vma_xip(vma))
+        return (void *)data;
+
+    if ((page = alloc_movable_page(0)) == NULL)
+        return NULL;
+
+    memcpy(page, data, PAGE_SIZE);
+    if (vma->prot & PROT_EXEC)
+        sync_icache_range(page, PAGE_SIZE);
+    return page;
+}
+
+static inline void put_file_page(vm_area_struct *vma, void *page)
+{
+    if (!vma_xip(vma))
+        buddy_free(page);
+}
+
+/* Map the rest of the aligned window around a file page, so a program loads in a few faults */
+static void fault_around(mm_struct *mm, vm_area_struct *vma, uint64_t addr)
+{
+    uint64_t start = addr & ~(FAULT_AROUND_PAGES * PAGE_SIZE - 1);
+    uint64_t end = MIN(start + FAULT_AROUND_PAGES * PAGE_SIZE, vma->vm_end);
+    uint64_t *pte;
+    void *page;
+
+    for (uint64_t va = MAX(start, vma->vm_start); va < end; va += PAGE_SIZE) {
+        pte = pte_offset(mm->pgd, va);
+        if (va == addr || (pte != NULL && *pte != 0))
+            continue;
+
+        /* Best effort, the faulting page is mapped already */
+        if ((page = get_file_page(vma, va)) == NULL)
+            return;
+        if (mappages(mm->pgd, va, PAGE_SIZE, virt_to_phys(page), vma->attr) != 0) {
+            put_file_page(vma, page);
+            return;
+        }
+    }
+}
+
+/**
+ * Write to a read only entry of a writable VMA, which is a page shared by
+ * fork or the zero page. The last sharer takes the page over without a copy.
+ */
+static int32_t do_wp_page(mm_struct *mm, vm_area_struct *vma, uint64_t addr, uint64_t *pte)
+{
+    uint64_t old = *pte;
+    void *page = (void *)phys_to_virt(old & ~ATTR_MASK), *new_page;
+    bool zero = is_zero_page(page);
+
+    if (!zero && buddy_refcnt(page) == 1) {
+        *pte = (old & ~PTE_AP_RDONLY) | PTE_AP_RDWR;
+        flush_tlb_page_local(addr, mm->asid);
+        return 0;
+    }
+
+    if ((new_page = alloc_movable_page(zero)) == NULL)
+        return -1;
+
+    /* Reclaim or compaction took the page meanwhile, fault on it again */
+    if (*pte != old) {
+        buddy_free(new_page);
+        return 0;
+    }
+
+    if (!zero) {
+        memcpy(new_page, page, PAGE_SIZE);
+        if (vma->prot & PROT_EXEC)
+            sync_icache_range(new_page, PAGE_SIZE);
+    }
+
+    /* Break before make, the output address changes */
+    *pte = 0;
+    flush_tlb_page_local(addr, mm->asid);
+    *pte = virt_to_phys(new_page) | BASE_PTE_ATTR | vma->attr | PTE_NG;
+    rmap_add(new_page, pte, addr);
+
+    if (!zero) {
+        rmap_del(page, pte);
+        buddy_free(page);
+    }
+    return 0;
+}
+
 void do_page_fault(uint64_t far, uint32_t esr)
 {
     void *pa;
+    uint64_t pte_pa, *pte, *pmd;
     mm_struct *mm = current->mm;
     uint64_t addr = far;
     vm_area_struct *vma = find_vma(mm, addr);
 
+    /* Counted instead of printed, the console is far slower than the fault */
+    current->nr_faults++;
+
     /* Illegal virtual address */
     if (vma == NULL)
         goto segfault;
@@ -287,34 +1163,115 @@ void do_page_fault(uint64_t far, uint32_t esr)
     } else if (ISS_EC_INSN_ABORT(esr) && !(vma->prot & PROT_EXEC))
         goto segfault;
 
-    printf("[Translation fault]: %lx\r\n", addr);
-
     addr &= ~PAGE_OFFSET_MASK;
-    pa = buddy_alloc(1);
-    mappages(mm->pgd, addr, PAGE_SIZE, virt_to_phys(pa), vma->attr);
+    pmd = pmd_offset(mm->pgd, addr);
+    pte = pte_offset(mm->pgd, addr);
 
     /**
-     * If the memory is .text, we need to copy
-     * code into memory 
+     * Write to a block made read only by mprotect(), or an access flag fault.
+     * Blocks are not shared, the only owner takes it back in place.
      */
-    if (vma->data != NULL)
-        memcpy(pa, vma->data + (addr - vma->vm_start), PAGE_SIZE);
+    if (pmd != NULL && pmd_huge(*pmd)) {
+        if (ISS_FSC_IS_PERM(esr) && ISS_EC_DATA_ABORT(esr) && ISS_WNR_IS_WRITE(esr))
+            *pmd = (*pmd & ~PTE_AP_MASK) | PTE_AP_RDWR;
+        *pmd |= AF_ACCESS;
+        flush_tlb_page_local(addr, mm->asid);
+        return;
+    }
+
+    /* Access flag was cleared by the swap clock, the page is still there */
+    if (ISS_FSC_IS_ACCESS(esr) && pte != NULL && (*pte & PD_TABLE_ENT) == PD_TABLE_ENT) {
+        *pte |= AF_ACCESS;
+        flush_tlb_page(addr);
+        return;
+    }
+
+    /* Copy on write, VMA permission is checked above so read only mappings never get here */
+    if (ISS_FSC_IS_PERM(esr) && ISS_EC_DATA_ABORT(esr) && ISS_WNR_IS_WRITE(esr) &&
+        pte != NULL && (*pte & PD_TABLE_ENT) == PD_TABLE_ENT) {
+        if (do_wp_page(mm, vma, addr, pte) != 0)
+            goto oom;
+        return;
+    }
+
+    /* mappages() reads a swapped out page back */
+    if (pte != NULL && is_swap_pte(*pte)) {
+        if ((pa = alloc_movable_page(0)) == NULL)
+            goto oom;
+        if (mappages(mm->pgd, addr, PAGE_SIZE, virt_to_phys(pa), vma->attr) != 0) {
+            buddy_free(pa);
+            goto oom;
+        }
+        return;
+    }
+
+    /* Anonymous memory covering an aligned 2MB range takes a block when there is a free one */
+    if ((pmd == NULL || *pmd == NULL) && vma_huge(vma, addr) &&
+        map_huge(mm, addr & ~(HPAGE_SIZE - 1), vma->attr) == 0)
+        return;
+
+    /* Read on anonymous memory maps the shared zero page until the first write */
+    if (vma->data == NULL && ISS_EC_DATA_ABORT(esr) && ISS_WNR_IS_READ(esr)) {
+        if (mappages(mm->pgd, addr, PAGE_SIZE, virt_to_phys(zero_page), vma->attr | PTE_AP_RDONLY) != 0)
+            goto oom;
+        return;
+    }
+
+    /* .text is copied into a new page or mapped in place */
+    if (vma->data != NULL) {
+        if ((pa = get_file_page(vma, addr)) == NULL)
+            goto oom;
+        if (mappages(mm->pgd, addr, PAGE_SIZE, virt_to_phys(pa), vma->attr) != 0) {
+            put_file_page(vma, pa);
+            goto oom;
+        }
+        fault_around(mm, vma, addr);
+        return;
+    }
+
+    /* Old content is copied over the page, no need to zero it */
+    pte_pa = (uint64_t)walk(mm->pgd, addr) & ~ATTR_MASK;
+    if (pte_pa && !is_zero_page(phys_to_virt(pte_pa)))
+        pa = alloc_movable_page(0);
+    else
+        pa = alloc_movable_page(1);
+    if (pa == NULL)
+        goto oom;
+
+    if (mappages(mm->pgd, addr, PAGE_SIZE, virt_to_phys(pa), vma->attr) != 0) {
+        buddy_free(pa);
+        goto oom;
+    }
     return;
 
+oom:
+    printf("[Out of memory]: Kill Process %d\r\n", current->pid);
+    thread_release(current, EXIT_CODE_KILL);
+    hangon();
+
 segfault:
     printf("[Segmentation fault]: Kill Process %d\r\n", current->pid);
     thread_release(current, EXIT_CODE_KILL);
     hangon();
 }
 
-void dup_vma(mm_struct *parent_mm, mm_struct *child_mm)
+/* -1 if out of memory, VMAs copied so far go with the arena of the child */
+int32_t dup_vma(mm_struct *parent_mm, mm_struct *child_mm)
 {
     vm_area_struct *first_vma = parent_mm->mmap;
     vm_area_struct *vma_iter = first_vma;
     vm_area_struct *vma;
 
+    if (first_vma == NULL)
+        return 0;
+
     do {
-        vma = kmalloc(sizeof(vm_area_struct));
+        /* Pages are shared by 4KB copy on write, blocks are not */
+        if (vma_iter->data == NULL && split_huge_range(parent_mm, vma_iter->vm_start, vma_iter->vm_end) != 0)
+            return -1;
+
+        if ((vma = alloc_vma(child_mm)) == NULL)
+            return -1;
         memcpy(vma, vma_iter, sizeof(vm_area_struct));
         LIST_INIT(vma->list);
 
@@ -322,32 +1279,60 @@ void dup_vma(mm_struct *parent_mm, mm_struct *child_mm)
             child_mm->mmap = vma;
         else
             list_add_tail(&vma->list, &child_mm->mmap->list);
+        /* Gaps are the same as the parent's */
+        child_mm->vma_root = vma_tree_insert(child_mm->vma_root, vma);
         
         vma_iter = container_of(vma_iter->list.next, vm_area_struct, list);
     } while (vma_iter != first_vma);
+
+    return 0;
 }
 
-void dup_pages(void *parent, void *child, int level)
+/* -1 on failure, the entries copied so far are released with the child table */
+static int32_t __dup_pages(void *parent, void *child, int level, uint64_t va)
 {
     void *page;
     void *parent_page;
+    uint64_t ent_va;
 
     for (int i = 0; i < 512; i++) {
+        if (level == 3 && is_swap_pte(*((uint64_t *)parent + i))) {
+            swap_dup(*((uint64_t *)parent + i));
+            *((uint64_t *)child + i) = *((uint64_t *)parent + i);
+            continue;
+        }
+
         if (*((uint64_t *)parent + i) != NULL) {
             parent_page = (void *)phys_to_virt(*((uint64_t *)parent + i) & ~ATTR_MASK);
+            ent_va = va | ((uint64_t)i << (PGD_BIT - GRANULE_SIZE * level));
             if (level == 3) {
                 /* Page table entry */
+                if (buddy_refcnt(parent_page)) {
+                    if (buddy_inc_refcnt(parent_page))
+                        return -1;
+                    rmap_add(parent_page, (uint64_t *)child + i, ent_va);
+                }
                 *((uint64_t *)child + i) = *((uint64_t *)parent + i);
                 *((uint64_t *)parent + i) |= PTE_AP_RDONLY;
                 *((uint64_t *)child + i)  |= PTE_AP_RDONLY; /* Set page to read only */
-                if (buddy_inc_refcnt(parent_page))
-                    hangon();
             } else {
-                page = buddy_alloc(1);
-                memset(page, 0, PAGE_SIZE);
+                /* dup_vma() has split the blocks */
+                if (pmd_huge(*((uint64_t *)parent + i)))
+                    return -1;
+
+                if ((page = get_zeroed_page()) == NULL)
+                    return -1;
                 *((uint64_t *)child + i) = virt_to_phys(page) | PD_TABLE;
-                dup_pages(parent_page, page, level + 1);
+                if (__dup_pages(parent_page, page, level + 1, ent_va))
+                    return -1;
             }
         }
     }
+
+    return 0;
+}
+
+int32_t dup_pages(void *parent, void *child, int level)
+{
+    return __dup_pages(parent, child, level, 0);
 }
\ No newline at end of file
@@ -0,0 +1,134 @@
+#include <vmalloc.h>
+#include <mm.h>
+#include <vm.h>
+#include <util.h>
+#include <list.h>
+#include <printf.h>
+
+/* EL1 read / write only, never executable */
+#define VMALLOC_ATTR (PTE_UXN | PTE_PXN | PTE_AP_NOACCESS)
+
+#define kern_pgd ((void *)spin_table_start)
+
+/* Areas sorted by address */
+static struct list_head vmap_list = LIST_HEAD_INIT(vmap_list);
+static bool vmap_lock = 0;
+
+/* First fit in the gaps between areas */
+static VmArea *get_vm_area(uint64_t size)
+{
+    VmArea *area, *iter;
+    struct list_head *pos;
+    uint64_t addr = VMALLOC_START;
+
+    if ((area = kmalloc(sizeof(VmArea))) == NULL)
+        return NULL;
+
+    while (vmap_lock);
+    vmap_lock = 1;
+
+    for (pos = vmap_list.next; pos != &vmap_list; pos = pos->next) {
+        iter = container_of(pos, VmArea, list);
+        if (addr + size + PAGE_SIZE <= iter->addr)
+            break;
+        addr = iter->addr + iter->size + PAGE_SIZE;
+    }
+
+    if (addr + size + PAGE_SIZE > VMALLOC_END) {
+        vmap_lock = 0;
+        kfree(area);
+        return NULL;
+    }
+
+    area->addr = addr;
+    area->size = size;
+    list_add_tail(&area->list, pos);
+
+    vmap_lock = 0;
+    return area;
+}
+
+static VmArea *find_vm_area(void *addr)
+{
+    VmArea *iter, *area = NULL;
+    struct list_head *pos;
+
+    while (vmap_lock);
+    vmap_lock = 1;
+
+    for (pos = vmap_list.next; pos != &vmap_list; pos = pos->next) {
+        iter = container_of(pos, VmArea, list);
+        if (iter->addr == (uint64_t)addr) {
+            area = iter;
+            break;
+        }
+    }
+
+    vmap_lock = 0;
+    return area;
+}
+
+static void free_vm_area(VmArea *area)
+{
+    while (vmap_lock);
+    vmap_lock = 1;
+    list_del(&area->list);
+    vmap_lock = 0;
+
+    kfree(area);
+}
+
+void *vmalloc(uint64_t size)
+{
+    VmArea *area;
+    void *page;
+
+    size = PAGE_ROUNDUP(size);
+    if (size == 0 || (area = get_vm_area(size)) == NULL)
+        return NULL;
+
+    /* Pages need not be contiguous, take them one by one */
+    for (uint64_t off = 0; off < size; off += PAGE_SIZE) {
+        page = buddy_alloc(1);
+        if (page == NULL ||
+            mappages(kern_pgd, area->addr + off, PAGE_SIZE, virt_to_phys(page), VMALLOC_ATTR) != 0) {
+            #ifdef DEBUG_MM
+            printf("[DEBUG] vmalloc 0x%lx bytes failed\r\n", size);
+            #endif /* DEBUG_MM */
+            if (page != NULL)
+                buddy_free(page);
+            unmappages(kern_pgd, area->addr, off);
+            free_vm_area(area);
+            return NULL;
+        }
+    }
+
+    return (void *)area->addr;
+}
+
+void vfree(void *addr)
+{
+    VmArea *area = find_vm_area(addr);
+    if (area == NULL)
+        return;
+
+    unmappages(kern_pgd, area->addr, area->size);
+    free_vm_area(area);
+}
+
+uint64_t vsize(void *addr)
+{
+    VmArea *area = find_vm_area(addr);
+    return area ? area->size : 0;
+}
+
+/* Physically contiguous if possible, kfree() releases either kind */
+void *kvmalloc(uint64_t size)
+{
+    void *ret = NULL;
+
+    if (size <= (PAGE_SIZE << PAGE_ORDER_MAX))
+        ret = __kmalloc(size);
+
+    return ret ? ret : vmalloc(size);
+}
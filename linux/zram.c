@@ -0,0 +1,161 @@
+#include <zram.h>
+#include <swap.h>
+#include <lz.h>
+#include <mm.h>
+#include <vmalloc.h>
+#include <util.h>
+#include <printf.h>
+#include <irq.h>
+
+static ZramSlot *zram_table;
+static uint32_t nr_free_zslots;
+static uint32_t zslot_hint;
+static bool zram_lock = 0; /* Taken with IRQ masked, zram_free() may run in any context */
+
+/* Scratch of the codec, a store finding it busy leaves the page to the partition */
+static bool zbuf_busy = 0;
+static uint16_t lz_dict[1 << LZ_HASH_BITS];
+static uint8_t zbuf[ZRAM_MAX_OBJ];
+
+/* Stats for zram_report() */
+static uint64_t nr_stored, nr_rejected;
+static uint64_t orig_bytes, compr_bytes, pool_bytes;
+static uint64_t nr_loads, load_ticks;
+
+void zram_init()
+{
+    zram_table = vmalloc(sizeof(ZramSlot) * ZRAM_MAX_SLOTS);
+    if (zram_table == NULL)
+        return;
+
+    memset(zram_table, 0, sizeof(ZramSlot) * ZRAM_MAX_SLOTS);
+    nr_free_zslots = ZRAM_MAX_SLOTS;
+}
+
+bool zram_full()
+{
+    return nr_free_zslots == 0;
+}
+
+/* Compress the page into a slot referred by cnt entries, 0 if it does not pay */
+uint64_t zram_store(void *page, uint32_t cnt)
+{
+    uint64_t flags;
+    uint32_t slot, size;
+    void *obj = NULL;
+
+    local_irq_save(flags);
+    if (nr_free_zslots == 0 || zbuf_busy) {
+        local_irq_restore(flags);
+        return 0;
+    }
+    zbuf_busy = 1;
+    local_irq_restore(flags);
+
+    /* Compress and allocate with no lock held */
+    size = lz_compress(page, PAGE_SIZE, zbuf, ZRAM_MAX_OBJ, lz_dict);
+    if (size != 0 && (obj = kmalloc(size)) != NULL)
+        memcpy(obj, zbuf, size);
+    zbuf_busy = 0;
+
+    if (obj == NULL) {
+        nr_rejected++;
+        return 0;
+    }
+
+    local_irq_save(flags);
+    while (zram_lock);
+    zram_lock = 1;
+
+    /* Taken by another store meanwhile */
+    if (nr_free_zslots == 0) {
+        zram_lock = 0;
+        local_irq_restore(flags);
+        kfree(obj);
+        return 0;
+    }
+
+    for (slot = zslot_hint; zram_table[slot].obj != NULL; )
+        slot = (slot + 1) % ZRAM_MAX_SLOTS;
+
+    zram_table[slot].obj = obj;
+    zram_table[slot].size = size;
+    zram_table[slot].cnt = cnt;
+    zslot_hint = slot;
+    nr_free_zslots--;
+
+    nr_stored++;
+    orig_bytes += PAGE_SIZE;
+    compr_bytes += size;
+    pool_bytes += ksize(obj);
+
+    zram_lock = 0;
+    local_irq_restore(flags);
+    return swp_entry(slot) | PTE_SWAP_ZRAM;
+}
+
+void zram_load(uint64_t entry, void *page)
+{
+    uint64_t start = read_sysreg(cntpct_el0);
+    ZramSlot *zslot = &zram_table[swp_slot(entry)];
+
+    /* The slot stays until its last entry is freed, no lock is needed */
+    if (lz_decompress(zslot->obj, zslot->size, page, PAGE_SIZE) != PAGE_SIZE) {
+        printf("[zram] Corrupted slot 0x%x\r\n", swp_slot(entry));
+        hangon();
+    }
+
+    nr_loads++;
+    load_ticks += read_sysreg(cntpct_el0) - start;
+}
+
+void zram_dup(uint64_t entry)
+{
+    uint64_t flags;
+
+    local_irq_save(flags);
+    while (zram_lock);
+    zram_lock = 1;
+    zram_table[swp_slot(entry)].cnt++;
+    zram_lock = 0;
+    local_irq_restore(flags);
+}
+
+void zram_free(uint64_t entry)
+{
+    ZramSlot *zslot = &zram_table[swp_slot(entry)];
+    void *obj = NULL;
+    uint64_t flags;
+
+    local_irq_save(flags);
+    while (zram_lock);
+    zram_lock = 1;
+
+    if (--zslot->cnt == 0) {
+        obj = zslot->obj;
+        orig_bytes -= PAGE_SIZE;
+        compr_bytes -= zslot->size;
+        pool_bytes -= ksize(obj);
+        zslot->obj = NULL;
+        nr_free_zslots++;
+    }
+
+    zram_lock = 0;
+    local_irq_restore(flags);
+
+    if (obj != NULL)
+        kfree(obj);
+}
+
+void zram_report()
+{
+    uint64_t freq = read_sysreg(cntfrq_el0);
+
+    printf("[zram] stored 0x%lx, rejected 0x%lx, in use 0x%x slots\r\n",
+           nr_stored, nr_rejected, ZRAM_MAX_SLOTS - nr_free_zslots);
+    if (orig_bytes)
+        printf("[zram] 0x%lx bytes in 0x%lx (%lu%%), pool 0x%lx (%lu%%)\r\n", orig_bytes,
+               compr_bytes, compr_bytes * 100 / orig_bytes, pool_bytes, pool_bytes * 100 / orig_bytes);
+    if (nr_loads)
+        printf("[zram] 0x%lx loads, %lu ns each\r\n", nr_loads, load_ticks * 1000000000 / freq / nr_loads);
+}
@@ -0,0 +1,90 @@
+#include <mm.h>
+#include "harness.h"
+
+/**
+ * Latency of the allocation paths: kmalloc / kfree of each size class with
+ * a warm cache, kfree with a growing number of caches, then buddy_alloc /
+ * buddy_free of small orders.
+ */
+#define RAM_SIZE (256UL << 20)
+#define NR_OBJS  4096
+#define NR_ROUND 64
+#define MAX_CACHES 512
+
+static void *obj[NR_OBJS];
+
+static void bench_kmalloc(uint32_t size)
+{
+    uint64_t alloc_ns = 0, free_ns = 0, t;
+
+    for (uint32_t r = 0; r < NR_ROUND; r++) {
+        t = harness_ns();
+        for (uint32_t i = 0; i < NR_OBJS; i++)
+            obj[i] = __kmalloc(size);
+        alloc_ns += harness_ns() - t;
+
+        t = harness_ns();
+        for (uint32_t i = 0; i < NR_OBJS; i++)
+            kfree(obj[i]);
+        free_ns += harness_ns() - t;
+    }
+    printf("kmalloc %5d: alloc %4lu ns, free %4lu ns\n", size,
+           alloc_ns / (NR_OBJS * NR_ROUND), free_ns / (NR_OBJS * NR_ROUND));
+}
+
+/* kfree() finds the owner through mem_map, so it should not grow with the caches */
+static void bench_caches(uint32_t nr_caches)
+{
+    static KmemCache *caches[MAX_CACHES];
+    static uint32_t nr_created;
+    uint64_t free_ns = 0, t;
+
+    for (; nr_created < nr_caches; nr_created++)
+        caches[nr_created] = kmem_cache_create("bench", 96, 0, NULL);
+
+    for (uint32_t r = 0; r < NR_ROUND; r++) {
+        for (uint32_t i = 0; i < NR_OBJS; i++)
+            obj[i] = kmem_cache_alloc(caches[i % nr_caches]);
+
+        t = harness_ns();
+        for (uint32_t i = 0; i < NR_OBJS; i++)
+            kfree(obj[i]);
+        free_ns += harness_ns() - t;
+    }
+    printf("caches  %5d: free %4lu ns\n", nr_caches, free_ns / (NR_OBJS * NR_ROUND));
+}
+
+static void bench_buddy(uint32_t pgcnt)
+{
+    uint64_t alloc_ns = 0, free_ns = 0, t;
+    uint32_t nr = NR_OBJS / pgcnt;
+
+    for (uint32_t r = 0; r < NR_ROUND; r++) {
+        t = harness_ns();
+        for (uint32_t i = 0; i < nr; i++)
+            obj[i] = buddy_alloc(pgcnt);
+        alloc_ns += harness_ns() - t;
+
+        t = harness_ns();
+        for (uint32_t i = 0; i < nr; i++)
+            buddy_free(obj[i]);
+        free_ns += harness_ns() - t;
+    }
+    printf("buddy   %5d: alloc %4lu ns, free %4lu ns\n", pgcnt,
+           alloc_ns / (nr * NR_ROUND), free_ns / (nr * NR_ROUND));
+}
+
+int main()
+{
+    harness_init(RAM_SIZE);
+
+    for (uint32_t size = 16; size <= 2048; size <<= 1)
+        bench_kmalloc(size);
+    for (uint32_t nr = 1; nr <= MAX_CACHES; nr <<= 3)
+        bench_caches(nr);
+    for (uint32_t pgcnt = 1; pgcnt <= 16; pgcnt <<= 1)
+        bench_buddy(pgcnt);
+
+    harness_check();
+    return 0;
+}
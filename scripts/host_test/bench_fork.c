@@ -0,0 +1,114 @@
+#include <mm.h>
+#include <vm.h>
+#include <fs.h>
+#include <sched.h>
+#include <signal.h>
+#include "harness.h"
+
+/**
+ * What fork and exit cost in allocations. The objects a task owns come
+ * from its arena and go at once, compared with one kmem_cache per type
+ * freed object by object. Then whole cycles of dup_vma() / dup_pages()
+ * and release of the child.
+ */
+#define RAM_SIZE   (64UL << 20)
+#define NR_VMAS    16
+#define NR_SIGNALS 8
+#define NR_ROUND   20000
+
+static KmemCache *mm_cachep, *fdt_cachep, *vma_cachep, *signal_cachep;
+static void *objs[2 + NR_VMAS + NR_SIGNALS];
+
+static void task_objs_arena(Arena *arena)
+{
+    arena_alloc(arena, sizeof(mm_struct));
+    arena_alloc(arena, sizeof(struct fdt_struct));
+    for (uint32_t i = 0; i < NR_VMAS; i++)
+        arena_alloc(arena, sizeof(vm_area_struct));
+    for (uint32_t i = 0; i < NR_SIGNALS; i++)
+        arena_alloc(arena, sizeof(Signal));
+    arena_release(arena);
+}
+
+static void task_objs_caches()
+{
+    uint32_t n = 0;
+
+    objs[n++] = kmem_cache_alloc(mm_cachep);
+    objs[n++] = kmem_cache_alloc(fdt_cachep);
+    for (uint32_t i = 0; i < NR_VMAS; i++)
+        objs[n++] = kmem_cache_alloc(vma_cachep);
+    for (uint32_t i = 0; i < NR_SIGNALS; i++)
+        objs[n++] = kmem_cache_alloc(signal_cachep);
+
+    kmem_cache_free(mm_cachep, objs[0]);
+    kmem_cache_free(fdt_cachep, objs[1]);
+    for (uint32_t i = 2; i < 2 + NR_VMAS; i++)
+        kmem_cache_free(vma_cachep, objs[i]);
+    for (uint32_t i = 2 + NR_VMAS; i < n; i++)
+        kmem_cache_free(signal_cachep, objs[i]);
+}
+
+/* Child of mm like svc_fork() makes it, released like kill_zombies() */
+static void fork_exit(mm_struct *mm)
+{
+    static TaskStruct child;
+    mm_struct *cm;
+
+    memset(&child, 0, sizeof(child));
+    cm = arena_alloc(&child.arena, sizeof(mm_struct));
+    memset(cm, 0, sizeof(mm_struct));
+    cm->arena = &child.arena;
+    cm->pgd = get_zeroed_page();
+
+    CHECK(dup_vma(mm, cm) == 0);
+    CHECK(dup_pages(mm->pgd, cm->pgd, 0) == 0);
+
+    release_pgtable(cm->pgd, 0);
+    kfree(cm->pgd);
+    arena_release(&child.arena);
+}
+
+int main()
+{
+    uint64_t t, arena_ns, caches_ns, fork_ns;
+    Arena arena = {0};
+    mm_struct *mm;
+
+    harness_init(RAM_SIZE);
+    mm_cachep = kmem_cache_create("mm_struct", sizeof(mm_struct), 0, NULL);
+    fdt_cachep = kmem_cache_create("fdt", sizeof(struct fdt_struct), 0, NULL);
+    vma_cachep = kmem_cache_create("vm_area_struct", sizeof(vm_area_struct), 0, NULL);
+    signal_cachep = kmem_cache_create("signal", sizeof(Signal), 0, NULL);
+
+    t = harness_ns();
+    for (uint32_t r = 0; r < NR_ROUND; r++)
+        task_objs_arena(&arena);
+    arena_ns = harness_ns() - t;
+
+    t = harness_ns();
+    for (uint32_t r = 0; r < NR_ROUND; r++)
+        task_objs_caches();
+    caches_ns = harness_ns() - t;
+
+    printf("objects of a task: arena %5lu ns, caches %5lu ns\n",
+           arena_ns / NR_ROUND, caches_ns / NR_ROUND);
+
+    /* Parent with a few pages in each VMA, split by a hole so none merge */
+    mm = harness_user_mm();
+    for (uint32_t i = 0; i < NR_VMAS; i++) {
+        CHECK(svc_mmap((void *)((2UL * i + 1) << 20), 4 * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_POPULATE, 0, 0) != NULL);
+    }
+
+    t = harness_ns();
+    for (uint32_t r = 0; r < NR_ROUND; r++)
+        fork_exit(mm);
+    fork_ns = harness_ns() - t;
+    printf("fork + exit, %d VMAs: %lu ns, %lu per second\n", NR_VMAS,
+           fork_ns / NR_ROUND, NR_ROUND * 1000000000UL / fork_ns);
+
+    CHECK(svc_munmap(NULL, 1UL << 40) == 0);
+    harness_check();
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include <mm.h>
+#include "harness.h"
+
+/**
+ * Random buddy and kmalloc traffic like stress_buddy, run through the
+ * current allocator and the one the buddy rewrite replaced. Prints ops/s
+ * and how much of the free memory is left in large blocks, while the
+ * traffic holds memory and after everything is freed.
+ */
+#define RAM_SIZE   (96UL << 20)
+#define NR_SLOTS   4096
+#define NR_STEPS   2000000
+#define BIG_ORDER  9
+
+void base_harness_init(uint64_t size);
+void base_harness_free_blocks(uint64_t *nr);
+void *base_buddy_alloc(uint32_t req_pgcnt);
+int32_t base_buddy_free(void *chk);
+void *base_kmalloc(uint32_t sz);
+int32_t base_kfree(void *chk);
+
+typedef struct _Allocator {
+    const char *name;
+    void (*init)(uint64_t size);
+    void (*free_blocks)(uint64_t *nr);
+    void *(*page_alloc)(uint32_t req_pgcnt);
+    int32_t (*page_free)(void *chk);
+    void *(*obj_alloc)(uint32_t sz);
+    int32_t (*obj_free)(void *chk);
+} Allocator;
+
+static const Allocator allocators[] = {
+    { "current",  harness_init, harness_free_blocks, buddy_alloc, buddy_free, __kmalloc, kfree },
+    { "baseline", base_harness_init, base_harness_free_blocks, base_buddy_alloc, base_buddy_free,
+      base_kmalloc, base_kfree },
+};
+
+static void *slot[NR_SLOTS];
+static bool is_page[NR_SLOTS];
+
+/* Free pages, the share of them in blocks of BIG_ORDER and up, and the largest order */
+static void print_frag(const Allocator *a, const char *when)
+{
+    uint64_t nr[PAGE_ORDER_MAX + 1], total = 0, big = 0;
+    int32_t max_order = -1;
+
+    a->free_blocks(nr);
+    for (int32_t order = 0; order <= PAGE_ORDER_MAX; order++) {
+        total += nr[order] << order;
+        if (order >= BIG_ORDER)
+            big += nr[order] << order;
+        if (nr[order])
+            max_order = order;
+    }
+    printf("%-8s %-6s free 0x%05lx, %3lu%% in order >= %d, max order %2d\n",
+           a->name, when, total, total ? big * 100 / total : 0, BIG_ORDER, max_order);
+}
+
+static void run(const Allocator *a)
+{
+    uint64_t start, ns, nr_fail = 0;
+
+    a->init(RAM_SIZE);
+    print_frag(a, "start");
+
+    srand(1);
+    start = harness_ns();
+    for (uint32_t step = 0; step < NR_STEPS; step++) {
+        uint32_t i = rand() % NR_SLOTS;
+
+        if (slot[i] != NULL) {
+            if (is_page[i])
+                a->page_free(slot[i]);
+            else
+                a->obj_free(slot[i]);
+            slot[i] = NULL;
+        } else {
+            is_page[i] = rand() % 3 == 0;
+            slot[i] = is_page[i] ? a->page_alloc(1 << (rand() % 5)) : a->obj_alloc(1 + rand() % 0x9000);
+            if (slot[i] == NULL)
+                nr_fail++;
+        }
+    }
+    ns = harness_ns() - start;
+    printf("%-8s %lu kops/s, 0x%lx failed\n", a->name, NR_STEPS * 1000000UL / ns, nr_fail);
+    print_frag(a, "busy");
+
+    for (uint32_t i = 0; i < NR_SLOTS; i++) {
+        if (slot[i] == NULL)
+            continue;
+        if (is_page[i])
+            a->page_free(slot[i]);
+        else
+            a->obj_free(slot[i]);
+        slot[i] = NULL;
+    }
+    print_frag(a, "idle");
+}
+
+int main()
+{
+    for (uint32_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++)
+        run(&allocators[i]);
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include <mm.h>
+#include <vm.h>
+#include "harness.h"
+
+/**
+ * Faulting in anonymous memory by 2MB blocks against 4K pages. The host
+ * has no TLB to count misses on, so the entries needed to map the range
+ * stand for the TLB entries, next to the faults taken and the time spent.
+ */
+#define RAM_SIZE (128UL << 20)
+#define NR_HPAGE 8
+#define ESR_WRITE_TRAN ((0b100100U << 26) | (1 << 6) | 0b000110)
+
+static mm_struct *mm;
+
+/* Write all free RAM once, so that host page faults do not count in the first run */
+static void warm_ram()
+{
+    void *chk, *head = NULL;
+
+    while ((chk = buddy_alloc(1 << HPAGE_ORDER)) != NULL) {
+        memset(chk, 0, HPAGE_SIZE);
+        *(void **)chk = head;
+        head = chk;
+    }
+    while (head != NULL) {
+        chk = *(void **)head;
+        buddy_free(head);
+        head = chk;
+    }
+}
+
+/* Touch every page of [start, end) as a write would, faulting where unmapped */
+static uint32_t touch(uint64_t start, uint64_t end)
+{
+    uint32_t nr_faults = 0;
+
+    for (uint64_t va = start; va < end; va += PAGE_SIZE) {
+        if (walk(mm->pgd, va) == 0) {
+            do_page_fault(va, ESR_WRITE_TRAN);
+            nr_faults++;
+        }
+        CHECK(walk(mm->pgd, va) != 0);
+    }
+    return nr_faults;
+}
+
+/* Leaf entries over [start, end), a block counts once */
+static uint32_t nr_entries(uint64_t start, uint64_t end)
+{
+    uint32_t n = 0;
+
+    for (uint64_t va = start; va < end; ) {
+        uint64_t ent = (uint64_t)walk(mm->pgd, va);
+
+        n++;
+        va += pmd_huge(ent) ? HPAGE_SIZE - (va & (HPAGE_SIZE - 1)) : PAGE_SIZE;
+    }
+    return n;
+}
+
+static void bench(const char *name, uint64_t *starts, uint64_t len)
+{
+    uint64_t t, ns = 0;
+    uint32_t nr_faults = 0, n = 0;
+
+    t = harness_ns();
+    for (uint32_t i = 0; i < NR_HPAGE; i++)
+        nr_faults += touch(starts[i], starts[i] + len);
+    ns = harness_ns() - t;
+
+    for (uint32_t i = 0; i < NR_HPAGE; i++)
+        n += nr_entries(starts[i], starts[i] + len);
+
+    printf("%-6s %5d faults, %5d entries, %6lu us for %lu KB\n", name, nr_faults, n,
+           ns / 1000, NR_HPAGE * len >> 10);
+    CHECK(svc_munmap(NULL, 1UL << 40) == 0);
+}
+
+int main()
+{
+    uint64_t starts[NR_HPAGE], base;
+
+    harness_init(RAM_SIZE);
+    mm = harness_user_mm();
+
+    warm_ram();
+
+    /* One VMA over aligned 2MB ranges is mapped by blocks */
+    base = 64 * HPAGE_SIZE;
+    CHECK(svc_mmap((void *)base, NR_HPAGE * HPAGE_SIZE, PROT_READ | PROT_WRITE, 0, 0, 0) != NULL);
+    for (uint32_t i = 0; i < NR_HPAGE; i++)
+        starts[i] = base + i * HPAGE_SIZE;
+    bench("blocks", starts, HPAGE_SIZE);
+
+    /* A page short of 2MB each, no VMA covers an aligned block */
+    for (uint32_t i = 0; i < NR_HPAGE; i++) {
+        starts[i] = base + i * HPAGE_SIZE + PAGE_SIZE;
+        CHECK(svc_mmap((void *)starts[i], HPAGE_SIZE - PAGE_SIZE, PROT_READ | PROT_WRITE, 0, 0, 0) != NULL);
+    }
+    bench("pages", starts, HPAGE_SIZE - PAGE_SIZE);
+
+    shrink_memory(~0UL);
+    harness_check();
+    return 0;
+}
@@ -0,0 +1,109 @@
+#include <mm.h>
+#include <vm.h>
+#include "harness.h"
+
+/**
+ * mmap and find_vma with a growing number of VMAs. Lookups and searches for
+ * a free range go through the AVL tree and, for comparison, a walk of the
+ * VMA list like find_vma() and find_vma_start_addr() did before the tree.
+ */
+#define RAM_SIZE   (64UL << 20)
+#define MAX_VMAS   4096
+#define NR_LOOKUPS 100000
+
+static uint64_t starts[MAX_VMAS];
+
+/* Not in vm.h, mmap_internal() is its only user in the kernel */
+uint64_t find_vma_start_addr(mm_struct *mm, uint64_t addr, uint64_t len);
+
+static vm_area_struct *list_find_vma(mm_struct *mm, uint64_t addr)
+{
+    vm_area_struct *vma = mm->mmap;
+
+    do {
+        if (addr >= vma->vm_start && addr < vma->vm_end)
+            return vma;
+        vma = container_of(vma->list.next, vm_area_struct, list);
+    } while (vma != mm->mmap);
+
+    return NULL;
+}
+
+/* Lowest free range of len bytes from addr on, by the list */
+static uint64_t list_find_start(mm_struct *mm, uint64_t addr, uint64_t len)
+{
+    vm_area_struct *vma = mm->mmap;
+
+    do {
+        if (addr + len <= vma->vm_start)
+            return addr;
+        addr = MAX(addr, vma->vm_end);
+        vma = container_of(vma->list.next, vm_area_struct, list);
+    } while (vma != mm->mmap);
+
+    return addr;
+}
+
+static void bench_vmas(mm_struct *mm, uint32_t nr_vmas)
+{
+    uint64_t mmap_ns, tree_ns, list_ns, gap_tree_ns, gap_list_ns, t, va;
+    vm_area_struct *vma;
+
+    /* Single pages with a hole after each, so that the lowest gap is searched */
+    t = harness_ns();
+    for (uint32_t i = 0; i < nr_vmas; i++) {
+        vma = mmap_internal(mm, NULL, PAGE_SIZE, PROT_READ, 0);
+        CHECK(vma != NULL);
+        starts[i] = vma->vm_start;
+        CHECK(mmap_internal(mm, NULL, PAGE_SIZE, PROT_READ, 0) != NULL);
+    }
+    mmap_ns = harness_ns() - t;
+    for (uint32_t i = 0; i < nr_vmas; i++)
+        CHECK(svc_munmap((void *)(starts[i] + PAGE_SIZE), PAGE_SIZE) == 0);
+
+    srand(nr_vmas);
+    t = harness_ns();
+    for (uint32_t i = 0; i < NR_LOOKUPS; i++) {
+        va = starts[rand() % nr_vmas] + rand() % PAGE_SIZE;
+        CHECK(find_vma(mm, va) != NULL);
+    }
+    tree_ns = harness_ns() - t;
+
+    srand(nr_vmas);
+    t = harness_ns();
+    for (uint32_t i = 0; i < NR_LOOKUPS; i++) {
+        va = starts[rand() % nr_vmas] + rand() % PAGE_SIZE;
+        CHECK(list_find_vma(mm, va) != NULL);
+    }
+    list_ns = harness_ns() - t;
+
+    /* Two pages fit in no hole, so the search goes past every VMA */
+    t = harness_ns();
+    for (uint32_t i = 0; i < NR_LOOKUPS; i++)
+        va = find_vma_start_addr(mm, starts[0], 2 * PAGE_SIZE);
+    gap_tree_ns = harness_ns() - t;
+    t = harness_ns();
+    for (uint32_t i = 0; i < NR_LOOKUPS; i++)
+        CHECK(list_find_start(mm, starts[0], 2 * PAGE_SIZE) == va);
+    gap_list_ns = harness_ns() - t;
+
+    printf("vmas %5d: mmap %4lu ns, find_vma tree %4lu ns, list %6lu ns, "
+           "free range tree %4lu ns, list %6lu ns\n", nr_vmas, mmap_ns / (2 * nr_vmas),
+           tree_ns / NR_LOOKUPS, list_ns / NR_LOOKUPS, gap_tree_ns / NR_LOOKUPS, gap_list_ns / NR_LOOKUPS);
+
+    CHECK(svc_munmap(NULL, 1UL << 40) == 0);
+}
+
+int main()
+{
+    mm_struct *mm;
+
+    harness_init(RAM_SIZE);
+    mm = harness_user_mm();
+
+    for (uint32_t nr = 16; nr <= MAX_VMAS; nr <<= 2)
+        bench_vmas(mm, nr);
+
+    harness_check();
+    return 0;
+}
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+
+# Copy the memory manager and its headers into a host build directory.
+# Kernel virtual addresses become offsets into a buffer mapped by the
+# harness, and instructions without a host meaning are dropped.
+#
+# With --rev the allocator of an older revision is taken from git instead,
+# for benchmarks against it. Its RAM sits at a fixed --ram-base.
+
+import argparse
+import os
+import re
+import shutil
+import subprocess
+
+SOURCES = ["linux/mm.c", "linux/memblock.c", "linux/vm.c", "linux/zram.c", "lib/lz.c"]
+REV_SOURCES = ["linux/mm.c"]
+
+# Statements like `__asm__ volatile("dsb sy" ::: "memory");`
+ASM_STMT = re.compile(r'__asm__\s*(?:volatile)?\s*\((?:[^;"]|"[^"]*")*\);', re.S)
+
+def patch_mm_h(s, ram_base=None):
+    if ram_base is None:
+        kern_start = "extern char *host_ram;\n#define MM_VIRT_KERN_START ((uint64_t)host_ram)"
+    else:
+        kern_start = "#define MM_VIRT_KERN_START %sUL" % ram_base
+    s = s.replace("#define MM_VIRT_KERN_START 0xFFFF000000000000", kern_start)
+    for name in ["spin_table_start", "spin_table_end", "kern_start", "kern_end",
+                 "su_rsvd_start", "su_rsvd_end"]:
+        s = re.sub(r"#define %s\s+0x(?:FFFF0000)?(\w+)" % name,
+                   lambda m: "#define %s (MM_VIRT_KERN_START + 0x%s)" % (name, m.group(1)), s)
+    return s
+
+def patch_irq_h(s):
+    s = re.sub(r"#define local_irq_save\(flags\) do \{.*?while \(0\)",
+               "#define local_irq_save(flags) do { (flags) = 0; } while (0)", s, flags=re.S)
+    return s.replace('__asm__ volatile("mrs %0, mpidr_el1" : "=r"(mpidr));', "mpidr = 0;")
+
+def patch_util_h(s):
+    return re.sub(r"#define read_sysreg\(reg\) \(\{.*?\}\)",
+                  "#define read_sysreg(reg) 0UL", s, flags=re.S)
+
+def patch_mm_c(s, extra):
+    # Boot tables are not part of the host buffer, the harness fills these
+    s = re.sub(r"const RsvdMem user_rsvd_memory\[\] = \{.*?\};",
+               "RsvdMem user_rsvd_memory[2];", s, flags=re.S)
+    s = s.replace('__asm__ volatile("mrs %0, daif" : "=r"(daif));', "daif = 0;")
+    return s + "\n" + extra
+
+HEADER_PATCHES = {"mm.h": patch_mm_h, "irq.h": patch_irq_h, "util.h": patch_util_h}
+
+class Tree:
+    """Files of the work tree, or of a git revision"""
+
+    def __init__(self, root, rev):
+        self.root = root
+        self.rev = rev
+
+    def git(self, *args):
+        return subprocess.check_output(["git", "-C", self.root] + list(args), text=True)
+
+    def listdir(self, path):
+        if self.rev is None:
+            return os.listdir(os.path.join(self.root, path))
+        return [os.path.basename(f) for f in self.git("ls-tree", "--name-only", self.rev, path + "/").split()]
+
+    def read(self, path):
+        if self.rev is None:
+            with open(os.path.join(self.root, path)) as f:
+                return f.read()
+        return self.git("show", "%s:%s" % (self.rev, path))
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("root", help="top of the kernel tree")
+    parser.add_argument("out", help="host build directory")
+    parser.add_argument("--rev", help="git revision to take the allocator from")
+    parser.add_argument("--ram-base", help="fixed address of RAM, needed with --rev")
+    args = parser.parse_args()
+
+    here = os.path.dirname(os.path.abspath(__file__))
+    tree = Tree(args.root, args.rev)
+    inc = os.path.join(args.out, "include")
+    shutil.rmtree(inc, ignore_errors=True)
+    os.makedirs(inc)
+
+    patches = dict(HEADER_PATCHES)
+    patches["mm.h"] = lambda s: patch_mm_h(s, args.ram_base)
+    for name in tree.listdir("include"):
+        s = tree.read("include/" + name)
+        s = patches.get(name, lambda s: s)(s)
+        with open(os.path.join(inc, name), "w") as f:
+            f.write(ASM_STMT.sub(";", s))
+
+    with open(os.path.join(here, "mm_check.c")) as f:
+        extra = f.read()
+
+    for src in REV_SOURCES if args.rev else SOURCES:
+        s = tree.read(src)
+        # The old allocator keeps its boot tables, they are constant with a fixed RAM
+        if src == "linux/mm.c" and args.rev is None:
+            s = patch_mm_c(s, extra)
+        with open(os.path.join(args.out, os.path.basename(src)), "w") as f:
+            f.write(ASM_STMT.sub(";", s))
+
+if __name__ == "__main__":
+    main()
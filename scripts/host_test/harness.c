@@ -0,0 +1,107 @@
+#include <mm.h>
+#include <vm.h>
+#include <sched.h>
+#include <swap.h>
+#include <util.h>
+#include "harness.h"
+
+/**
+ * Host definitions of what the memory manager calls outside of it. All are
+ * weak, a test may replace them, e.g. to back swap by a buffer.
+ */
+#define __weak __attribute__((weak))
+
+struct timespec { int64_t tv_sec; int64_t tv_nsec; };
+int clock_gettime(int clk, struct timespec *ts);
+void *mmap(void *addr, uint64_t len, int prot, int flags, int fd, int64_t off);
+
+#define PROT_RW            0x3
+#define MAP_PRIVATE_ANON   0x22
+#define MAP_FIXED_NOREPLACE 0x100000
+#define CLOCK_MONOTONIC    1
+
+char *host_ram;
+uint64_t cpio_start, cpio_end;
+TaskStruct *main_task;
+static TaskStruct host_task;
+
+void harness_mem_init(uint64_t size);
+
+void harness_init(uint64_t size)
+{
+    host_ram = mmap((void *)HARNESS_RAM_BASE, size, PROT_RW,
+                    MAP_PRIVATE_ANON | MAP_FIXED_NOREPLACE, -1, 0);
+    if (host_ram != (char *)HARNESS_RAM_BASE) {
+        printf("harness: cannot map RAM at 0x%lx\n", HARNESS_RAM_BASE);
+        exit(1);
+    }
+
+    harness_mem_init(size);
+    page_init();
+    buddy_init();
+    while (deferred_init_section());
+    slab_init();
+    zero_page_init();
+    rmap_cache_init();
+    harness_check();
+}
+
+mm_struct *harness_user_mm()
+{
+    static mm_struct mm;
+
+    memset(&mm, 0, sizeof(mm));
+    mm.arena = &host_task.arena;
+    mm.pgd = get_zeroed_page();
+    host_task.mm = &mm;
+    return &mm;
+}
+
+uint64_t harness_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+__weak TaskStruct *get_current() { return &host_task; }
+__weak void schedule() {}
+__weak void thread_sleep() {}
+__weak void thread_wake(TaskStruct *target) {}
+__weak void thread_release(TaskStruct *target, int16_t ec)
+{
+    printf("harness: task killed with %d\n", ec);
+    exit(1);
+}
+
+__weak uint64_t swap_out(void *page, uint32_t cnt) { return 0; }
+__weak void swap_in(uint64_t entry, void *page) {}
+__weak void swap_dup(uint64_t entry) {}
+__weak void swap_free(uint64_t entry) {}
+
+/* No vmalloc area on the host, large buffers come from the buddy */
+__weak void *vmalloc(uint64_t size) { return __kmalloc(size); }
+__weak void *kvmalloc(uint64_t size) { return __kmalloc(size); }
+__weak void vfree(void *addr) { kfree(addr); }
+__weak uint64_t vsize(void *addr) { return 0; }
+
+int8_t log_2(uint64_t value)
+{
+    int8_t ret = -1;
+
+    while (value) {
+        ret++;
+        value >>= 1;
+    }
+    return ret;
+}
+
+uint64_t ceiling_2(uint64_t value)
+{
+    int8_t ret = log_2(value);
+
+    if (ret == -1)
+        return 0;
+    return (value + ((1UL << ret) - 1)) & ~((1UL << ret) - 1);
+}
@@ -0,0 +1,35 @@
+#ifndef _HOST_HARNESS_H_
+#define _HOST_HARNESS_H_
+
+#include <types.h>
+#include <vm.h>
+
+/**
+ * Host side of the memory manager tests. Physical memory is a buffer at a
+ * fixed address, so that masking kernel bits off a user VA keeps it intact.
+ */
+#define HARNESS_RAM_BASE 0x400000000000UL
+
+#define CHECK(cond) do { if (!(cond)) { \
+    printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); exit(1); } } while (0)
+
+int printf(const char *fmt, ...);
+void exit(int status);
+int rand(void);
+void srand(unsigned int seed);
+
+extern char *host_ram;
+
+/* Map size bytes of RAM and bring up the allocators like kernel() does */
+void harness_init(uint64_t size);
+/* Trap if free lists or slab lists are inconsistent */
+void harness_check();
+int32_t harness_max_order();
+/* Free blocks of each order, nr has PAGE_ORDER_MAX + 1 entries */
+void harness_free_blocks(uint64_t *nr);
+/* Empty address space of current, whose VMAs come from its arena */
+mm_struct *harness_user_mm();
+/* Nanoseconds of a monotonic clock */
+uint64_t harness_ns();
+
+#endif /* _HOST_HARNESS_H_ */
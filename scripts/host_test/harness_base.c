@@ -0,0 +1,46 @@
+#include <mm.h>
+
+/**
+ * Host side of the allocator which the buddy rewrite replaced, built from
+ * git by gen_host.py. Its symbols get a base_ prefix when linked, so that
+ * a benchmark runs both allocators in one process.
+ */
+int printf(const char *fmt, ...);
+void exit(int status);
+void *mmap(void *addr, uint64_t len, int prot, int flags, int fd, int64_t off);
+
+#define PROT_RW             0x3
+#define MAP_PRIVATE_ANON    0x22
+#define MAP_FIXED_NOREPLACE 0x100000
+
+void harness_init(uint64_t size)
+{
+    if (mmap((void *)MM_VIRT_KERN_START, size, PROT_RW,
+             MAP_PRIVATE_ANON | MAP_FIXED_NOREPLACE, -1, 0) != (void *)MM_VIRT_KERN_START) {
+        printf("harness: cannot map RAM at 0x%lx\n", MM_VIRT_KERN_START);
+        exit(1);
+    }
+
+    phys_mem_end = size;
+    page_init();
+    buddy_init();
+    slab_init();
+}
+
+void harness_free_blocks(uint64_t *nr)
+{
+    extern FreeArea *free_area[];
+    struct list_head *pos;
+
+    for (int order = 0; order <= PAGE_ORDER_MAX; order++) {
+        nr[order] = 0;
+        if (free_area[order] == (FreeArea *)0xffffffff)
+            continue;
+
+        pos = &free_area[order]->list;
+        do {
+            nr[order]++;
+            pos = pos->next;
+        } while (pos != &free_area[order]->list);
+    }
+}
@@ -0,0 +1,102 @@
+/**
+ * ============ host harness checks ============
+ * Appended to the host copy of mm.c by gen_host.py, so the static state
+ * of the allocators can be walked.
+ */
+#define CHECK(cond, ...) do { if (!(cond)) { \
+    printf("mm_check: " __VA_ARGS__); printf("\n"); __builtin_trap(); } } while (0)
+
+/* Every block on a free list is free, aligned, marked in the bitmap and counted */
+static void check_free_area(FreeArea *area, bool cma, uint64_t nr_free)
+{
+    uint64_t total = 0;
+
+    for (int8_t order = 0; order <= PAGE_ORDER_MAX; order++) {
+        uint32_t nr = 0;
+
+        for (uint32_t pfn = area[order].head; pfn != PFN_NONE; pfn = pfn_to_page(pfn)->next) {
+            Page *pg = pfn_to_page(pfn);
+
+            CHECK(pg->order == order && pg->flags == PAGE_FLAG_FREED, "pfn 0x%x order %d", pfn, order);
+            CHECK(fa_test_bit(order, pfn), "pfn 0x%x not in bitmap", pfn);
+            CHECK((pfn & ((1U << order) - 1)) == 0, "pfn 0x%x misaligned", pfn);
+            CHECK(pg->cma == cma, "pfn 0x%x on wrong area", pfn);
+            nr++;
+            total += 1U << order;
+        }
+        CHECK(nr == area[order].nr_free, "order %d counts 0x%x, listed 0x%x", order, area[order].nr_free, nr);
+    }
+    CHECK(total == nr_free, "free pages 0x%lx, listed 0x%lx", nr_free, total);
+}
+
+static void check_slab_list(KmemCache *cachep, struct list_head *head, int kind)
+{
+    struct list_head *pos, *obj;
+
+    for (pos = head->next; pos != head; pos = pos->next) {
+        SlabCache *slab = container_of(pos, SlabCache, cache_list);
+        Page *pg = virt_to_page(slab);
+        uint32_t nr_free = 0;
+
+        CHECK(pos->next->prev == pos, "%s broken link", cachep->name);
+        CHECK(slab->kmem_cache == cachep, "%s slab owned by another cache", cachep->name);
+        CHECK(pg->order == cachep->order && pg->flags == PAGE_FLAG_ALLOC, "%s slab head", cachep->name);
+        for (uint32_t i = 0; i < (1U << cachep->order); i++)
+            CHECK(pg[i].slab && pg[i].slab_off == i, "%s slab page %d", cachep->name, i);
+
+        for (obj = slab->slab.list.next; obj != &slab->slab.list; obj = obj->next) {
+            CHECK((uint64_t)obj >= slab->start && (uint64_t)obj < slab->end, "%s object outside", cachep->name);
+            nr_free++;
+        }
+        CHECK(nr_free + slab->inuse == slab->total, "%s inuse 0x%x", cachep->name, slab->inuse);
+
+        if (kind == 0)
+            CHECK(slab->inuse != 0 && slab->inuse != slab->total, "%s not partial", cachep->name);
+        else if (kind == 1)
+            CHECK(slab->inuse == slab->total, "%s not full", cachep->name);
+        else
+            CHECK(slab->inuse == 0, "%s not empty", cachep->name);
+    }
+}
+
+void harness_check()
+{
+    struct list_head *pos;
+
+    check_free_area(free_area, 0, nr_free_pages);
+    check_free_area(cma_area, 1, nr_free_cma);
+
+    for (pos = kmem_cache_list.next; pos != &kmem_cache_list; pos = pos->next) {
+        KmemCache *cachep = container_of(pos, KmemCache, list);
+
+        check_slab_list(cachep, &cachep->slabs_partial, 0);
+        check_slab_list(cachep, &cachep->slabs_full, 1);
+        check_slab_list(cachep, &cachep->slabs_empty, 2);
+    }
+}
+
+/* Highest order with a free block, -1 if none */
+int32_t harness_max_order()
+{
+    for (int32_t order = PAGE_ORDER_MAX; order >= 0; order--)
+        if (free_area[order].head != PFN_NONE)
+            return order;
+    return -1;
+}
+
+/* Free blocks of each order, normal and CMA */
+void harness_free_blocks(uint64_t *nr)
+{
+    for (int8_t order = 0; order <= PAGE_ORDER_MAX; order++)
+        nr[order] = free_area[order].nr_free + cma_area[order].nr_free;
+}
+
+/* Boot reservations of the board, filled here since host_ram is not a constant */
+void harness_mem_init(uint64_t size)
+{
+    memblock_add(0, size);
+    user_rsvd_memory[0].start = spin_table_start;
+    user_rsvd_memory[0].end = spin_table_end;
+    user_rsvd_memory[1].start = kern_start;
+    user_rsvd_memory[1].end = kern_end;
+}
@@ -0,0 +1,66 @@
+#include <mm.h>
+#include "harness.h"
+
+/**
+ * Random buddy and kmalloc traffic over a fixed set of slots. Free lists are
+ * checked every CHECK_EVERY steps, and all memory must come back at the end.
+ * bench_frag times the same traffic against the old allocator.
+ */
+#define RAM_SIZE    (256UL << 20)
+#define NR_SLOTS    4096
+#define NR_STEPS    2000000
+#define CHECK_EVERY 100000
+
+static void *slot[NR_SLOTS];
+static bool is_page[NR_SLOTS];
+
+int main()
+{
+    uint64_t init_free, start, nr_fail = 0;
+
+    harness_init(RAM_SIZE);
+    /* Page lists and empty slabs are counted as used until shrunk */
+    shrink_memory(~0UL);
+    init_free = nr_free_pages;
+    printf("free 0x%lx max order %d\n", init_free, harness_max_order());
+
+    srand(1);
+    start = harness_ns();
+    for (uint32_t step = 0; step < NR_STEPS; step++) {
+        uint32_t i = rand() % NR_SLOTS;
+
+        if (slot[i] != NULL) {
+            if (is_page[i])
+                buddy_free(slot[i]);
+            else
+                kfree(slot[i]);
+            slot[i] = NULL;
+        } else {
+            is_page[i] = rand() % 3 == 0;
+            slot[i] = is_page[i] ? buddy_alloc(1 << (rand() % 5)) : __kmalloc(1 + rand() % 0x9000);
+            if (slot[i] == NULL)
+                nr_fail++;
+            else
+                memset(slot[i], 0xaa, 16);
+        }
+
+        if (step % CHECK_EVERY == 0)
+            harness_check();
+    }
+    printf("%d steps in %lu ms, 0x%lx failed\n", NR_STEPS, (harness_ns() - start) / 1000000, nr_fail);
+
+    for (uint32_t i = 0; i < NR_SLOTS; i++) {
+        if (slot[i] == NULL)
+            continue;
+        if (is_page[i])
+            buddy_free(slot[i]);
+        else
+            kfree(slot[i]);
+    }
+
+    shrink_memory(~0UL);
+    harness_check();
+    printf("free 0x%lx max order %d\n", nr_free_pages, harness_max_order());
+    CHECK(nr_free_pages == init_free);
+    return 0;
+}
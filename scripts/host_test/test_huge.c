@@ -0,0 +1,184 @@
+#include <mm.h>
+#include <vm.h>
+#include <sched.h>
+#include "harness.h"
+
+/**
+ * 2MB blocks of anonymous mappings: populated and faulted in, split by
+ * munmap, mprotect, mremap and fork, with the data kept through all of it.
+ */
+#define RAM_SIZE (64UL << 20)
+#define MB       (1UL << 20)
+
+/* Data abort from EL0, write, permission / translation fault at level 2 */
+#define ESR_WRITE_PERM ((0b100100U << 26) | (1 << 6) | 0b001110)
+#define ESR_WRITE_TRAN ((0b100100U << 26) | (1 << 6) | 0b000110)
+
+static mm_struct *mm;
+
+static uint64_t ent(mm_struct *m, uint64_t va)
+{
+    return (uint64_t)walk(m->pgd, va);
+}
+
+static int32_t *word(mm_struct *m, uint64_t va)
+{
+    uint64_t e = ent(m, va), pa;
+
+    if (e == 0)
+        return NULL;
+    pa = (e & ~ATTR_MASK) + (va & (pmd_huge(e) ? HPAGE_SIZE - 1 : PAGE_OFFSET_MASK));
+    return (int32_t *)phys_to_virt(pa);
+}
+
+static uint32_t nr_blocks(uint64_t start, uint64_t end)
+{
+    uint32_t n = 0;
+
+    for (uint64_t va = start & ~(HPAGE_SIZE - 1); va < end; va += HPAGE_SIZE)
+        if (ent(mm, va) && pmd_huge(ent(mm, va)))
+            n++;
+    return n;
+}
+
+/* Child address space for dup_vma(), with an arena of its own */
+static mm_struct *child_mm(TaskStruct *task)
+{
+    static mm_struct cm;
+
+    memset(task, 0, sizeof(TaskStruct));
+    memset(&cm, 0, sizeof(cm));
+    cm.arena = &task->arena;
+    cm.pgd = get_zeroed_page();
+    return &cm;
+}
+
+/* Take every free page, so that the next allocation fails */
+static void *hog_memory()
+{
+    void *hog = NULL, *page;
+
+    while ((page = buddy_alloc(1)) != NULL) {
+        *(void **)page = hog;
+        hog = page;
+    }
+    return hog;
+}
+
+static void hog_release(void *hog)
+{
+    void *page;
+
+    while (hog != NULL) {
+        page = *(void **)hog;
+        buddy_free(hog);
+        hog = page;
+    }
+}
+
+static void child_release(TaskStruct *task, mm_struct *cm)
+{
+    release_pgtable(cm->pgd, 0);
+    kfree(cm->pgd);
+    arena_release(&task->arena);
+}
+
+int main()
+{
+    uint64_t init_free, a, b0, b1, b2, m, c, cb;
+    TaskStruct ct;
+    mm_struct *cm;
+    void *hog;
+
+    harness_init(RAM_SIZE);
+    mm = harness_user_mm();
+
+    a = (uint64_t)svc_mmap(NULL, 4 * MB, PROT_READ | PROT_WRITE, MAP_POPULATE, 0, 0);
+    CHECK(svc_munmap((void *)a, 4 * MB) == 0);
+    shrink_memory(~0UL);
+    init_free = nr_free_pages + nr_free_cma;
+
+    a = (uint64_t)svc_mmap(NULL, 8 * MB, PROT_READ | PROT_WRITE, MAP_POPULATE, 0, 0);
+    CHECK(nr_blocks(a, a + 8 * MB) == 3);
+    for (uint64_t va = a; va < a + 8 * MB; va += PAGE_SIZE) {
+        CHECK(word(mm, va) != NULL && *word(mm, va) == 0);
+        *word(mm, va) = va >> PAGE_SHIFT;
+    }
+
+    /* A page punched out of the first block */
+    b0 = (a + HPAGE_SIZE - 1) & ~(HPAGE_SIZE - 1);
+    CHECK(svc_munmap((void *)(b0 + 5 * PAGE_SIZE), PAGE_SIZE) == 0);
+    CHECK(nr_blocks(a, a + 8 * MB) == 2 && ent(mm, b0 + 5 * PAGE_SIZE) == 0);
+    for (uint64_t va = a; va < a + 8 * MB; va += PAGE_SIZE)
+        if (va != b0 + 5 * PAGE_SIZE)
+            CHECK(word(mm, va) != NULL && *word(mm, va) == (int32_t)(va >> PAGE_SHIFT));
+
+    /* A whole block read only and back stays a block, the write fault restores it */
+    b1 = b0 + HPAGE_SIZE;
+    CHECK(svc_mprotect((void *)b1, HPAGE_SIZE, PROT_READ) == 0);
+    CHECK(nr_blocks(b1, b1 + 1) == 1 && (ent(mm, b1) & PTE_AP_MASK) == PTE_AP_RDONLY);
+    CHECK(svc_mprotect((void *)b1, HPAGE_SIZE, PROT_READ | PROT_WRITE) == 0);
+    CHECK((ent(mm, b1) & PTE_AP_MASK) == PTE_AP_RDONLY);
+    do_page_fault(b1 + 0x1234, ESR_WRITE_PERM);
+    CHECK((ent(mm, b1) & PTE_AP_MASK) == PTE_AP_RDWR && nr_blocks(b1, b1 + 1) == 1);
+
+    /* mprotect of two pages at the block end splits it */
+    CHECK(svc_mprotect((void *)(b1 + HPAGE_SIZE - 2 * PAGE_SIZE), 2 * PAGE_SIZE, PROT_READ) == 0);
+    CHECK(nr_blocks(a, a + 8 * MB) == 1);
+    CHECK((ent(mm, b1 + HPAGE_SIZE - PAGE_SIZE) & PTE_AP_MASK) == PTE_AP_RDONLY);
+    CHECK((ent(mm, b1 + HPAGE_SIZE - 3 * PAGE_SIZE) & PTE_AP_MASK) == PTE_AP_RDWR);
+    for (uint64_t va = b1; va < b1 + HPAGE_SIZE; va += PAGE_SIZE)
+        CHECK(word(mm, va) != NULL && *word(mm, va) == (int32_t)(va >> PAGE_SHIFT));
+
+    /* mremap moves the last block by pages */
+    b2 = b1 + HPAGE_SIZE;
+    CHECK(nr_blocks(b2, b2 + 1) == 1);
+    m = (uint64_t)svc_mremap((void *)b2, HPAGE_SIZE, HPAGE_SIZE + PAGE_SIZE, MREMAP_MAYMOVE);
+    CHECK(m != 0);
+    for (uint64_t off = 0; off < HPAGE_SIZE; off += PAGE_SIZE)
+        CHECK(word(mm, m + off) != NULL && *word(mm, m + off) == (int32_t)((b2 + off) >> PAGE_SHIFT));
+
+    /* Faults take a block where the VMA covers one, pages elsewhere */
+    c = (uint64_t)svc_mmap(NULL, 4 * MB, PROT_READ | PROT_WRITE, 0, 0, 0);
+    cb = (c + HPAGE_SIZE - 1) & ~(HPAGE_SIZE - 1);
+    do_page_fault(cb + 0x10, ESR_WRITE_TRAN);
+    CHECK(nr_blocks(c, c + 4 * MB) == 1);
+    do_page_fault(c, ESR_WRITE_TRAN);
+    CHECK(ent(mm, c) != 0 && !pmd_huge(ent(mm, c)));
+    *word(mm, cb + 0x3000) = 77;
+
+    /* Fork fails instead of hanging when the blocks cannot be split */
+    cm = child_mm(&ct);
+    hog = hog_memory();
+    CHECK(dup_vma(mm, cm) == -1);
+    hog_release(hog);
+    child_release(&ct, cm);
+    CHECK(nr_blocks(c, c + 4 * MB) == 1);
+
+    /* Or when the tables of the child cannot be allocated */
+    cm = child_mm(&ct);
+    CHECK(dup_vma(mm, cm) == 0);
+    hog = hog_memory();
+    CHECK(dup_pages(mm->pgd, cm->pgd, 0) == -1);
+    hog_release(hog);
+    child_release(&ct, cm);
+    CHECK(*word(mm, cb + 0x3000) == 77);
+
+    /* Fork shares the pages of the split blocks */
+    cm = child_mm(&ct);
+    CHECK(dup_vma(mm, cm) == 0);
+    CHECK(dup_pages(mm->pgd, cm->pgd, 0) == 0);
+    CHECK(nr_blocks(c, c + 4 * MB) == 0);
+    CHECK(word(cm, cb + 0x3000) == word(mm, cb + 0x3000) && *word(cm, cb + 0x3000) == 77);
+    child_release(&ct, cm);
+
+    CHECK(svc_munmap(NULL, 1UL << 40) == 0);
+    for (uint32_t i = 0; i < 512; i++)
+        CHECK(((uint64_t *)mm->pgd)[i] == 0);
+
+    shrink_memory(~0UL);
+    harness_check();
+    printf("free 0x%lx\n", nr_free_pages + nr_free_cma);
+    CHECK(nr_free_pages + nr_free_cma == init_free);
+    return 0;
+}
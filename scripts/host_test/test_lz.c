@@ -0,0 +1,112 @@
+#include <lz.h>
+#include <util.h>
+#include "harness.h"
+
+/**
+ * Round trip of generated inputs, then lz_decompress() on random and mutated
+ * streams. Buffers are allocated to their exact size, so AddressSanitizer
+ * catches any access past src or dst.
+ */
+#define NR_ROUND_TRIP 20000
+#define NR_FUZZ       200000
+#define MAX_LEN       0x4000
+#define SAMPLE_LEN    0x1000
+
+void *malloc(uint64_t size);
+void free(void *ptr);
+
+static uint16_t dict[1 << LZ_HASH_BITS];
+
+/* Mix of literals, runs and repeats of earlier data */
+static void gen_input(uint8_t *buf, uint32_t len)
+{
+    uint32_t i = 0, n;
+
+    while (i < len) {
+        n = 1 + rand() % 64;
+        n = MIN(n, len - i);
+        switch (rand() % 4) {
+        case 0:
+            for (uint32_t k = 0; k < n; k++)
+                buf[i + k] = rand();
+            break;
+        case 1:
+            memset(buf + i, rand(), n);
+            break;
+        default:
+            for (uint32_t k = 0, off = 1 + rand() % (i + 1); k < n; k++)
+                buf[i + k] = i + k >= off ? buf[i + k - off] : rand() % 4;
+            break;
+        }
+        i += n;
+    }
+}
+
+static void round_trip(uint32_t len)
+{
+    uint8_t *src = malloc(len + 1), *back = malloc(len + 1);
+    uint32_t cap = len + len / 255 + 16, size;
+    uint8_t *dst = malloc(cap);
+
+    gen_input(src, len);
+    size = lz_compress(src, len, dst, cap, dict);
+    CHECK(size != 0);
+    CHECK(lz_decompress(dst, size, back, len) == (int32_t)len);
+    for (uint32_t i = 0; i < len; i++)
+        CHECK(back[i] == src[i]);
+
+    /* Too small an output fails instead of overflowing */
+    if (size > 1)
+        CHECK(lz_compress(src, len, dst, size - 1, dict) == 0);
+    if (len > 0)
+        CHECK(lz_decompress(dst, size, back, len - 1) == -1);
+
+    free(src);
+    free(back);
+    free(dst);
+}
+
+static void fuzz_decompress(uint32_t len, uint8_t *valid, uint32_t valid_len)
+{
+    uint32_t cap = rand() % (MAX_LEN + 1);
+    uint8_t *src = malloc(len + 1), *dst = malloc(cap + 1);
+    int32_t ret;
+
+    /* Either noise or a valid stream with a few bytes changed */
+    if (valid_len && rand() % 2) {
+        len = MIN(len, valid_len);
+        memcpy(src, valid, len);
+        for (uint32_t k = rand() % 4 + 1; k && len; k--)
+            src[rand() % len] = rand();
+    } else {
+        for (uint32_t i = 0; i < len; i++)
+            src[i] = rand();
+    }
+
+    ret = lz_decompress(src, len, dst, cap);
+    CHECK(ret >= -1 && ret <= (int32_t)cap);
+
+    free(src);
+    free(dst);
+}
+
+int main()
+{
+    uint8_t *page = malloc(SAMPLE_LEN), *valid = malloc(MAX_LEN);
+    uint32_t valid_len;
+
+    srand(4);
+    round_trip(0);
+    for (uint32_t i = 0; i < NR_ROUND_TRIP; i++)
+        round_trip(rand() % (i % 100 == 0 ? 0xfff0 : MAX_LEN));
+    printf("round trip ok\n");
+
+    gen_input(page, SAMPLE_LEN);
+    valid_len = lz_compress(page, SAMPLE_LEN, valid, MAX_LEN, dict);
+    CHECK(valid_len != 0);
+
+    for (uint32_t i = 0; i < NR_FUZZ; i++)
+        fuzz_decompress(rand() % 512, valid, valid_len);
+    printf("decompress fuzz ok\n");
+    return 0;
+}
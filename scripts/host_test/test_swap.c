@@ -0,0 +1,118 @@
+#include <mm.h>
+#include <vm.h>
+#include <swap.h>
+#include "harness.h"
+
+/**
+ * shrink_anon() over pages mapped by fake entries, with swap backed by a
+ * buffer. Some pages are touched while being written and must stay mapped.
+ */
+#define RAM_SIZE  (64UL << 20)
+#define NR_PAGES  1000
+#define NR_SLOTS  2048
+
+static char swap_dev[NR_SLOTS][PAGE_SIZE];
+static uint8_t swap_cnt[NR_SLOTS];
+static uint32_t nr_used;
+static uint64_t pte[NR_PAGES * 2];
+
+#define shared(i)  ((i) % 3 == 0)
+#define touched(i) ((i) % 7 == 0)
+
+uint64_t swap_out(void *page, uint32_t cnt)
+{
+    uint32_t i = *(uint32_t *)page;
+
+    for (uint32_t slot = 1; slot < NR_SLOTS; slot++) {
+        if (swap_cnt[slot])
+            continue;
+
+        swap_cnt[slot] = cnt;
+        nr_used++;
+        memcpy(swap_dev[slot], page, PAGE_SIZE);
+
+        /* The owner runs during the write and sets the access flag */
+        if (touched(i))
+            pte[i] |= AF_ACCESS;
+        return swp_entry(slot);
+    }
+    return 0;
+}
+
+void swap_in(uint64_t entry, void *page)
+{
+    memcpy(page, swap_dev[swp_slot(entry)], PAGE_SIZE);
+}
+
+void swap_free(uint64_t entry)
+{
+    if (--swap_cnt[swp_slot(entry)] == 0)
+        nr_used--;
+}
+
+int main()
+{
+    uint64_t init_free, freed;
+    uint32_t nr_swapped = 0;
+    char buf[PAGE_SIZE];
+
+    harness_init(RAM_SIZE);
+    shrink_memory(~0UL);
+    init_free = nr_free_pages + nr_free_cma;
+
+    for (uint32_t i = 0; i < NR_PAGES; i++) {
+        char *page = alloc_movable_page(0);
+
+        CHECK(page != NULL);
+        memset(page, i & 0xff, PAGE_SIZE);
+        *(uint32_t *)page = i;
+        pte[i] = virt_to_phys(page) | BASE_PTE_ATTR;
+        rmap_add(page, &pte[i], (uint64_t)i << PAGE_SHIFT);
+
+        if (shared(i)) {
+            buddy_inc_refcnt(page);
+            pte[NR_PAGES + i] = pte[i];
+            rmap_add(page, &pte[NR_PAGES + i], (uint64_t)i << PAGE_SHIFT);
+        }
+    }
+
+    /* The first turn of the clock clears the access flags, the second swaps */
+    freed = shrink_anon(NR_PAGES);
+    printf("freed 0x%lx, slots used 0x%x\n", freed, nr_used);
+    harness_check();
+
+    for (uint32_t i = 0; i < NR_PAGES; i++) {
+        if (!is_swap_pte(pte[i]))
+            continue;
+
+        CHECK(!touched(i));
+        if (shared(i))
+            CHECK(pte[NR_PAGES + i] == pte[i]);
+
+        swap_in(pte[i], buf);
+        CHECK(*(uint32_t *)buf == i && buf[PAGE_SIZE - 1] == (char)(i & 0xff));
+        nr_swapped++;
+    }
+    CHECK(nr_swapped == freed && nr_swapped > 0);
+    /* Touched pages gave their slots back */
+    CHECK(nr_used == nr_swapped);
+
+    for (uint32_t i = 0; i < NR_PAGES * 2; i++) {
+        if (i >= NR_PAGES && !shared(i - NR_PAGES))
+            continue;
+
+        if (is_swap_pte(pte[i])) {
+            swap_free(pte[i]);
+        } else {
+            void *page = (void *)phys_to_virt(pte[i] & ~ATTR_MASK);
+            rmap_del(page, &pte[i]);
+            buddy_free(page);
+        }
+    }
+
+    shrink_memory(~0UL);
+    harness_check();
+    printf("free 0x%lx, slots used 0x%x\n", nr_free_pages + nr_free_cma, nr_used);
+    CHECK(nr_free_pages + nr_free_cma == init_free && nr_used == 0);
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <mm.h>
+#include <vm.h>
+#include "harness.h"
+
+/**
+ * munmap, mprotect and mremap on populated mappings: the VMAs they leave,
+ * the entries, the data which moves along, and no page leaking at the end.
+ */
+#define RAM_SIZE (64UL << 20)
+#define PG(n)    ((uint64_t)(n) << PAGE_SHIFT)
+
+static mm_struct *mm;
+
+static uint64_t ent(uint64_t va)
+{
+    return (uint64_t)walk(mm->pgd, va);
+}
+
+static int32_t *word(uint64_t va)
+{
+    uint64_t e = ent(va);
+
+    if (e == 0)
+        return NULL;
+    return (int32_t *)phys_to_virt((e & ~ATTR_MASK) + (va & PAGE_OFFSET_MASK));
+}
+
+static uint32_t nr_vmas()
+{
+    uint32_t n = 0;
+    vm_area_struct *vma = mm->mmap;
+
+    if (vma == NULL)
+        return 0;
+    do {
+        n++;
+        vma = container_of(vma->list.next, vm_area_struct, list);
+    } while (vma != mm->mmap);
+    return n;
+}
+
+static uint64_t map(uint64_t len)
+{
+    return (uint64_t)svc_mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_POPULATE, 0, 0);
+}
+
+int main()
+{
+    uint64_t init_free, a, b, c, d;
+
+    harness_init(RAM_SIZE);
+    mm = harness_user_mm();
+
+    /* Page tables of the range stay once made, count from there */
+    a = map(PG(400));
+    CHECK(svc_munmap((void *)a, PG(400)) == 0);
+    shrink_memory(~0UL);
+    init_free = nr_free_pages + nr_free_cma;
+
+    a = map(PG(16));
+    b = map(PG(16));
+    CHECK(b == a + PG(16) && nr_vmas() == 2);
+    for (uint32_t i = 0; i < 32; i++) {
+        CHECK(word(a + PG(i)) != NULL);
+        *word(a + PG(i)) = i;
+    }
+
+    /* Hole in a, then reused by the next mapping */
+    CHECK(svc_munmap((void *)(a + PG(4)), PG(4)) == 0);
+    CHECK(nr_vmas() == 3 && ent(a + PG(5)) == 0 && ent(a + PG(3)) != 0);
+    CHECK(find_vma(mm, a + PG(5)) == NULL && find_vma(mm, a + PG(8))->vm_start == a + PG(8));
+    c = (uint64_t)svc_mmap(NULL, PG(4), PROT_READ, 0, 0, 0);
+    CHECK(c == a + PG(4));
+    CHECK(svc_munmap((void *)c, PG(4)) == 0);
+
+    /* Middle of b read only, then back, and it merges again */
+    CHECK(svc_mprotect((void *)(b + PG(2)), PG(4), PROT_READ) == 0);
+    CHECK(nr_vmas() == 5 && (ent(b + PG(3)) & PTE_AP_MASK) == PTE_AP_RDONLY);
+    CHECK(svc_mprotect((void *)(b + PG(2)), PG(4), PROT_READ | PROT_WRITE) == 0);
+    CHECK(nr_vmas() == 3);
+    /* Made writable again by the write fault, not by mprotect */
+    CHECK((ent(b + PG(3)) & PTE_AP_MASK) == PTE_AP_RDONLY);
+    CHECK((ent(b + PG(7)) & PTE_AP_MASK) == PTE_AP_RDWR);
+
+    /* Unmapped range, and an empty one which changes nothing */
+    CHECK(svc_mprotect((void *)(a + PG(4)), PG(1), PROT_READ) == -1);
+    CHECK(svc_mprotect((void *)(b + PG(8)), 0, PROT_READ) == 0);
+    CHECK(nr_vmas() == 3 && find_vma(mm, b + PG(8))->vm_start == b);
+
+    /* b is the last mapping and grows in place */
+    CHECK((uint64_t)svc_mremap((void *)b, PG(16), PG(32), 0) == b);
+    CHECK(find_vma(mm, b + PG(20)) != NULL);
+
+    /* Tail of a is followed by b, so it has to move */
+    CHECK(svc_mremap((void *)(a + PG(8)), PG(8), PG(64), 0) == NULL);
+    d = (uint64_t)svc_mremap((void *)(a + PG(8)), PG(8), PG(64), MREMAP_MAYMOVE);
+    CHECK(d != 0 && d != a + PG(8));
+    for (uint32_t i = 0; i < 8; i++) {
+        CHECK(word(d + PG(i)) != NULL && *word(d + PG(i)) == 8 + i);
+        CHECK(ent(a + PG(8 + i)) == 0);
+    }
+    CHECK(find_vma(mm, a + PG(8)) == NULL && find_vma(mm, d + PG(60)) != NULL);
+
+    /* Shrink */
+    CHECK((uint64_t)svc_mremap((void *)d, PG(64), PG(4), 0) == d);
+    CHECK(ent(d + PG(5)) == 0 && find_vma(mm, d + PG(5)) == NULL);
+
+    CHECK(svc_munmap(NULL, 1UL << 40) == 0);
+    CHECK(nr_vmas() == 0);
+    for (uint32_t i = 0; i < 512; i++)
+        CHECK(((uint64_t *)mm->pgd)[i] == 0);
+
+    shrink_memory(~0UL);
+    harness_check();
+    printf("free 0x%lx\n", nr_free_pages + nr_free_cma);
+    CHECK(nr_free_pages + nr_free_cma == init_free);
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include <mm.h>
+#include <vm.h>
+#include "harness.h"
+
+/**
+ * Random mmap / munmap / mprotect checked against a page by page model of
+ * the address space. After each step the VMA list must match the model and
+ * the tree must be a balanced search tree with correct gaps.
+ */
+#define RAM_SIZE  (64UL << 20)
+#define NR_STEPS  6000
+#define NR_PAGES  0x2000          /* Model covers [0, NR_PAGES) pages */
+#define HINT_MAX  (NR_PAGES / 2)  /* Requests start below */
+
+static uint8_t model[NR_PAGES];  /* prot + 1 of each page, 0 if unmapped */
+static uint8_t seen[NR_PAGES];
+
+/* Lowest free run of len pages from hint on */
+static uint64_t model_find(uint64_t hint, uint64_t len)
+{
+    uint64_t start = hint, i;
+
+    for (i = start; i < start + len && i < NR_PAGES; i++) {
+        if (model[i]) {
+            start = i + 1;
+            i = start - 1;
+        }
+    }
+    return start;
+}
+
+/* Returns the height, and checks order, balance and the gap fields */
+static int32_t check_subtree(vm_area_struct *vma, vm_area_struct **prev)
+{
+    int32_t lh, rh;
+    uint64_t max_gap;
+
+    if (vma == NULL)
+        return 0;
+
+    lh = check_subtree(vma->left, prev);
+
+    CHECK(*prev == NULL || (*prev)->vm_end <= vma->vm_start);
+    CHECK(vma->gap == vma->vm_start - (*prev ? (*prev)->vm_end : 0));
+    *prev = vma;
+
+    rh = check_subtree(vma->right, prev);
+
+    CHECK(lh - rh <= 1 && rh - lh <= 1);
+    CHECK(vma->height == MAX(lh, rh) + 1);
+    max_gap = vma->gap;
+    if (vma->left)
+        max_gap = MAX(max_gap, vma->left->max_gap);
+    if (vma->right)
+        max_gap = MAX(max_gap, vma->right->max_gap);
+    CHECK(vma->max_gap == max_gap);
+    return vma->height;
+}
+
+static void check_mm(mm_struct *mm)
+{
+    vm_area_struct *vma = mm->mmap, *prev = NULL;
+    struct list_head *pos;
+
+    check_subtree(mm->vma_root, &prev);
+    CHECK(prev == (mm->mmap ? container_of(mm->mmap->list.prev, vm_area_struct, list) : NULL));
+
+    memset(seen, 0, sizeof(seen));
+    if (vma != NULL) {
+        pos = &vma->list;
+        do {
+            vma = container_of(pos, vm_area_struct, list);
+            CHECK(vma->vm_start < vma->vm_end && vma->vm_end <= (uint64_t)NR_PAGES << PAGE_SHIFT);
+            for (uint64_t va = vma->vm_start; va < vma->vm_end; va += PAGE_SIZE)
+                seen[va >> PAGE_SHIFT] = vma->prot + 1;
+            pos = pos->next;
+        } while (pos != &mm->mmap->list);
+    }
+
+    for (uint32_t i = 0; i < NR_PAGES; i++)
+        CHECK(seen[i] == model[i]);
+
+    for (uint32_t k = 0; k < 16; k++) {
+        uint64_t va = ((uint64_t)(rand() % NR_PAGES) << PAGE_SHIFT) + rand() % PAGE_SIZE;
+        vma = find_vma(mm, va);
+        CHECK((vma != NULL) == (model[va >> PAGE_SHIFT] != 0));
+        CHECK(vma == NULL || (va >= vma->vm_start && va < vma->vm_end));
+    }
+}
+
+int main()
+{
+    mm_struct *mm;
+    uint32_t depth;
+
+    harness_init(RAM_SIZE);
+    mm = harness_user_mm();
+
+    srand(10);
+    for (uint32_t step = 0; step < NR_STEPS; step++) {
+        uint64_t start = 1 + rand() % (HINT_MAX - 1), len = 1 + rand() % 16;
+        int prot = rand() % 2 ? PROT_READ : PROT_READ | PROT_WRITE;
+        vm_area_struct *vma;
+
+        switch (rand() % 3) {
+        case 0:
+            /* Model is full up to its end, leave it to munmap */
+            if (model_find(start, len) + len > NR_PAGES)
+                break;
+            vma = mmap_internal(mm, (void *)(start << PAGE_SHIFT), len << PAGE_SHIFT, prot, 0);
+            CHECK(vma != NULL && vma->vm_start == model_find(start, len) << PAGE_SHIFT);
+            for (uint64_t i = 0; i < len; i++)
+                model[(vma->vm_start >> PAGE_SHIFT) + i] = prot + 1;
+            break;
+        case 1:
+            CHECK(svc_munmap((void *)(start << PAGE_SHIFT), len << PAGE_SHIFT) == 0);
+            memset(model + start, 0, len);
+            break;
+        default: {
+            bool mapped = 1;
+
+            for (uint64_t i = start; i < start + len; i++)
+                mapped &= model[i] != 0;
+            CHECK(svc_mprotect((void *)(start << PAGE_SHIFT), len << PAGE_SHIFT, prot) == (mapped ? 0 : -1));
+            if (mapped)
+                memset(model + start, prot + 1, len);
+            break;
+        }
+        }
+
+        check_mm(mm);
+    }
+
+    depth = mm->vma_root ? mm->vma_root->height : 0;
+    CHECK(svc_munmap(0, (uint64_t)NR_PAGES << PAGE_SHIFT) == 0);
+    CHECK(mm->mmap == NULL && mm->vma_root == NULL);
+    printf("%d steps ok, tree height was %d\n", NR_STEPS, depth);
+
+    /* Empty mappings are refused */
+    CHECK(mmap_internal(mm, (void *)PAGE_SIZE, 0, PROT_READ, 0) == NULL);
+    CHECK(mm->mmap == NULL);
+    return 0;
+}
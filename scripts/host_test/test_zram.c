@@ -0,0 +1,80 @@
+#include <mm.h>
+#include <swap.h>
+#include <zram.h>
+#include "harness.h"
+
+/**
+ * Pages of different compressibility through zram_store() / zram_load(),
+ * shared entries, and more sharers than fit in a byte.
+ */
+#define RAM_SIZE (64UL << 20)
+#define NR_PAGES 3000
+#define NR_ROUND 5
+
+static uint64_t entry[NR_PAGES];
+
+/* Odd seeds give a slowly changing pattern, even ones short random runs */
+static void fill_page(char *page, uint8_t seed)
+{
+    for (uint32_t k = 0; k < PAGE_SIZE; k++)
+        page[k] = (seed & 1) ? k / 64 + seed : (k % 7 ? page[k - 1] : rand());
+}
+
+int main()
+{
+    char *page, *back;
+    uint64_t init_free, ent;
+    uint32_t nr_stored = 0;
+
+    harness_init(RAM_SIZE);
+    zram_init();
+    page = buddy_alloc(1);
+    back = buddy_alloc(1);
+    shrink_memory(~0UL);
+    init_free = nr_free_pages;
+
+    srand(8);
+    for (uint32_t r = 0; r < NR_ROUND; r++) {
+        for (uint32_t i = 0; i < NR_PAGES; i++) {
+            fill_page(page, rand());
+            entry[i] = zram_store(page, 1 + i % 2);
+            if (entry[i] == 0)
+                continue;
+
+            nr_stored++;
+            CHECK(is_zram_entry(entry[i]) && is_swap_pte(entry[i]));
+            zram_load(entry[i], back);
+            for (uint32_t k = 0; k < PAGE_SIZE; k++)
+                CHECK(back[k] == page[k]);
+        }
+
+        for (uint32_t i = 0; i < NR_PAGES; i++) {
+            if (entry[i] == 0)
+                continue;
+            zram_free(entry[i]);
+            if (i % 2)
+                zram_free(entry[i]);
+        }
+        harness_check();
+    }
+    printf("stored 0x%x of 0x%x\n", nr_stored, NR_PAGES * NR_ROUND);
+    CHECK(nr_stored > 0 && !zram_full());
+
+    /* A slot shared by more tasks than a byte counts */
+    fill_page(page, 1);
+    ent = zram_store(page, 1);
+    CHECK(ent != 0);
+    for (uint32_t i = 0; i < 300; i++)
+        zram_dup(ent);
+    for (uint32_t i = 0; i < 300; i++)
+        zram_free(ent);
+    zram_load(ent, back);
+    CHECK(back[PAGE_SIZE - 1] == page[PAGE_SIZE - 1]);
+    zram_free(ent);
+
+    shrink_memory(~0UL);
+    harness_check();
+    printf("free 0x%lx\n", nr_free_pages);
+    CHECK(nr_free_pages == init_free);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+
+# Pack a directory into a newc cpio archive like `find . | cpio -o -H newc`.
+# With --align, zero words are put before headers so that file data starts
+# on the boundary, and the kernel maps read only segments in place.
+
+import argparse
+import os
+import stat
+
+NEWC_MAGIC = b"070701"
+NEWC_HDR_SIZE = 110
+TRAILER = "TRAILER!!!"
+
+def pad4(n):
+    return (4 - n % 4) % 4
+
+def entry(name, st, data):
+    name = name.encode() + b"\x00"
+    fields = [st.st_ino & 0xffffffff if st else 0,
+              st.st_mode if st else 0,
+              0, 0,                       # uid, gid
+              st.st_nlink if st else 1,
+              int(st.st_mtime) if st else 0,
+              len(data),
+              0, 0, 0, 0,                 # dev / rdev major, minor
+              len(name),
+              0]                          # check
+    hdr = NEWC_MAGIC + b"".join(b"%08X" % f for f in fields) + name
+    return hdr + b"\x00" * pad4(len(hdr)), data + b"\x00" * pad4(len(data))
+
+def pack(root, align):
+    out = bytearray()
+    paths = ["."]
+    for top, dirs, files in os.walk(root):
+        dirs.sort()
+        rel = os.path.relpath(top, root)
+        for name in sorted(dirs) + sorted(files):
+            paths.append("./" + os.path.normpath(os.path.join(rel, name)))
+
+    for path in paths:
+        st = os.lstat(os.path.join(root, path))
+        data = b""
+        if stat.S_ISREG(st.st_mode):
+            with open(os.path.join(root, path), "rb") as f:
+                data = f.read()
+
+        hdr, data = entry(path, st, data)
+        if align and len(data):
+            out += b"\x00" * ((-(len(out) + len(hdr))) % align)
+        out += hdr + data
+
+    hdr, data = entry(TRAILER, None, b"")
+    out += hdr + data
+    return bytes(out + b"\x00" * ((-len(out)) % 512))
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--align", type=int, default=0,
+                        help="start file data on this boundary, e.g. 4096")
+    parser.add_argument("rootfs")
+    parser.add_argument("output")
+    args = parser.parse_args()
+
+    if args.align % 4:
+        parser.error("alignment has to be a multiple of 4")
+
+    with open(args.output, "wb") as f:
+        f.write(pack(args.rootfs, args.align))
+
+if __name__ == "__main__":
+    main()